@@ -0,0 +1,125 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define MIN_BLOCK_SIZE 4096
+#define ALIGNMENT (sizeof(void *))
+
+static arena_block_t *new_block(arena_block_t *prev, size_t min_size);
+
+void arena_init(arena_t *arena)
+{
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+void arena_free(arena_t *arena)
+{
+    arena_block_t *block, *prev;
+
+    for (block = arena->head; block; block = prev)
+    {
+        prev = block->prev;
+        free(block);
+    }
+
+    arena_init(arena);
+}
+
+/*
+ * Drops everything allocated so far. Only the newest block is kept, it is
+ * also the largest one since block sizes double.
+ */
+void arena_reset(arena_t *arena)
+{
+    arena_block_t *block, *prev;
+
+    if (!arena->head)
+        return;
+
+    for (block = arena->head->prev; block; block = prev)
+    {
+        prev = block->prev;
+        free(block);
+    }
+
+    arena->head->prev = NULL;
+    arena->head->used = 0;
+    arena->last = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_block_t *block = arena->head;
+    size_t offset;
+
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    if (!block || block->size - block->used < size)
+    {
+        block = new_block(block, size);
+        if (!block)
+            return NULL;
+
+        arena->head = block;
+    }
+
+    offset = block->used;
+    block->used += size;
+
+    arena->last = block->data + offset;
+    return arena->last;
+}
+
+/*
+ * Resizes an allocation. The most recent allocation is extended in place when
+ * its block has room, anything else is copied to fresh space.
+ */
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_block_t *block = arena->head;
+    size_t offset;
+    void *new_ptr;
+
+    if (ptr && ptr == arena->last)
+    {
+        offset = (char *)ptr - block->data;
+        if (offset + new_size <= block->size)
+        {
+            block->used = offset + ((new_size + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+            return ptr;
+        }
+    }
+
+    new_ptr = arena_alloc(arena, new_size);
+    if (!new_ptr)
+        return NULL;
+
+    if (ptr)
+        memcpy(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+
+    return new_ptr;
+}
+
+arena_block_t *new_block(arena_block_t *prev, size_t min_size)
+{
+    arena_block_t *block;
+    size_t size;
+
+    size = (prev) ? prev->size * 2 : MIN_BLOCK_SIZE;
+    while (size < min_size)
+        size *= 2;
+
+    block = malloc(sizeof(arena_block_t) + size);
+    if (!block)
+        return NULL;
+
+    block->prev = prev;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
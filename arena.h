@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block
+{
+    struct arena_block *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+typedef struct arena
+{
+    arena_block_t *head; // Block allocations are served from
+    void *last;          // Most recent allocation, may be grown in place
+} arena_t;
+
+void arena_init(arena_t *arena);
+
+void arena_free(arena_t *arena);
+
+void arena_reset(arena_t *arena);
+
+void *arena_alloc(arena_t *arena, size_t size);
+
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+
+#endif
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser.h"
+#include "arena.h"
+#include "scan.h"
+
+#define MIN_SECONDS 0.25
+
+typedef struct bench_case
+{
+    const char *name;
+    size_t nlines;
+    char **lines;
+    size_t bytes; // Total length of all lines
+} bench_case_t;
+
+typedef struct strbuf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} strbuf_t;
+
+static const char *REALISTIC[] = {
+    "ls -la",
+    "cd /usr/local/src",
+    "grep -rn \"TODO\" src | sort | uniq -c > todo.txt",
+    "git log --oneline --graph --decorate | head -n 40",
+    "find . -name '*.o' -newer Makefile | xargs rm -f",
+    "cat < /etc/passwd | cut -d: -f1 | sort > users.txt",
+    "make -j8 CFLAGS='-O2 -g' > build.log &",
+    "ps aux | grep -v grep | grep \"kai\" | awk '{print $2}'",
+    "tar czf backup.tar.gz docs \"My Documents\" 'notes 2024'",
+    "echo \"hello world\" | tr a-z A-Z",
+    "make clean && make -j8 || echo 'build failed'; ls -l kai",
+};
+
+// Bumped by the --wrap'ed allocators, reset around the measured sections
+static size_t alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+static int add_line(bench_case_t *bc, char *line);
+
+static int load_file(bench_case_t *bc, const char *path);
+
+static int gen_realistic(bench_case_t *bc);
+
+static int gen_pipeline(bench_case_t *bc);
+
+static int gen_quoting(bench_case_t *bc);
+
+static int gen_argv(bench_case_t *bc);
+
+static int gen_redirections(bench_case_t *bc);
+
+static int gen_long_words(bench_case_t *bc);
+
+static int run_case(bench_case_t *bc);
+
+static void free_case(bench_case_t *bc);
+
+static void sb_printf(strbuf_t *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static double now(void);
+
+/*
+ * Usage: bench [file...]
+ * Without arguments the built-in corpus is run, otherwise every line of each
+ * file is used as input.
+ */
+int main(int argc, char *argv[])
+{
+    static int (*const generators[])(bench_case_t *) = {
+        gen_realistic, gen_pipeline, gen_quoting, gen_argv, gen_redirections, gen_long_words,
+    };
+    bench_case_t bc;
+    size_t ncases;
+    size_t i;
+    int ret = 0;
+
+    ncases = (argc > 1) ? (size_t)argc - 1 : sizeof(generators) / sizeof(generators[0]);
+
+    printf("Delimiter scanner: %s\n\n", scan_impl_name());
+    printf("%-16s %8s %10s %12s %10s %12s %12s\n", "case", "lines", "bytes/line", "ns/line", "MB/s",
+           "allocs/line", "cold allocs");
+
+    for (i = 0; i < ncases; i++)
+    {
+        memset(&bc, 0, sizeof(bc));
+
+        if (argc > 1)
+            ret = load_file(&bc, argv[i + 1]);
+        else
+            ret = generators[i](&bc);
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "Failed to set up case %zu\n", i + 1);
+            free_case(&bc);
+            return 1;
+        }
+
+        ret = run_case(&bc);
+        free_case(&bc);
+        if (ret < 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+int add_line(bench_case_t *bc, char *line)
+{
+    char **new_lines;
+
+    if (!line)
+        return -1;
+
+    new_lines = realloc(bc->lines, (bc->nlines + 1) * sizeof(char *));
+    if (!new_lines)
+    {
+        free(line);
+        return -1;
+    }
+
+    bc->lines = new_lines;
+    bc->lines[bc->nlines++] = line;
+    bc->bytes += strlen(line);
+
+    return 0;
+}
+
+int load_file(bench_case_t *bc, const char *path)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return -1;
+    }
+
+    bc->name = path;
+    while ((len = getline(&line, &cap, file)) >= 0)
+    {
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        if (add_line(bc, strdup(line)) < 0)
+            break;
+    }
+
+    free(line);
+    fclose(file);
+
+    return (bc->nlines > 0) ? 0 : -1;
+}
+
+int gen_realistic(bench_case_t *bc)
+{
+    size_t i;
+
+    bc->name = "realistic";
+    for (i = 0; i < sizeof(REALISTIC) / sizeof(REALISTIC[0]); i++)
+    {
+        if (add_line(bc, strdup(REALISTIC[i])) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int gen_pipeline(bench_case_t *bc)
+{
+    strbuf_t sb = {0};
+    int i;
+
+    bc->name = "deep pipeline";
+    for (i = 0; i < 256; i++)
+        sb_printf(&sb, "%sfilter%d -n %d --mode=fast", (i > 0) ? " | " : "", i, i);
+
+    return add_line(bc, sb.data);
+}
+
+int gen_quoting(bench_case_t *bc)
+{
+    strbuf_t sb = {0};
+    int i;
+
+    bc->name = "heavy quoting";
+    sb_printf(&sb, "printf");
+    for (i = 0; i < 10000; i++)
+        sb_printf(&sb, " \"a %d\"'b|c'd\"\"'e > f'", i);
+
+    return add_line(bc, sb.data);
+}
+
+int gen_argv(bench_case_t *bc)
+{
+    strbuf_t sb = {0};
+    int i;
+
+    bc->name = "huge argv";
+    sb_printf(&sb, "rm -f");
+    for (i = 0; i < 50000; i++)
+        sb_printf(&sb, " src/module%03d/file%05d.c", i % 1000, i);
+
+    return add_line(bc, sb.data);
+}
+
+int gen_redirections(bench_case_t *bc)
+{
+    strbuf_t sb = {0};
+    int i;
+
+    bc->name = "redirections";
+    sb_printf(&sb, "sort");
+    for (i = 0; i < 2000; i++)
+        sb_printf(&sb, " <in%d.txt >'out %d.txt'", i, i);
+
+    return add_line(bc, sb.data);
+}
+
+int gen_long_words(bench_case_t *bc)
+{
+    strbuf_t sb = {0};
+    int i, j;
+
+    // Encoded payloads passed as arguments, where delimiters are far apart
+    bc->name = "long words";
+    sb_printf(&sb, "curl -d");
+    for (i = 0; i < 64; i++)
+    {
+        sb_printf(&sb, " ");
+        for (j = 0; j < 256; j++)
+            sb_printf(&sb, "%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c", 'A' + (i + j) % 26, 'a' + j % 26, '0' + j % 10, '+',
+                      'Q', 'x', '/', '=', 'k', 'P', '2', 'z', 'M', 'b', 'W', 'v');
+    }
+
+    return add_line(bc, sb.data);
+}
+
+int run_case(bench_case_t *bc)
+{
+    arena_t arena;
+    list_node_t *root;
+    size_t cold_allocs;
+    size_t iters, i;
+    double start, elapsed;
+    double lines;
+
+    arena_init(&arena);
+
+    // First pass on a fresh arena doubles as a sanity check
+    alloc_count = 0;
+    for (i = 0; i < bc->nlines; i++)
+    {
+        if (parse_command_list(&root, bc->lines[i], &arena, NULL) == PARSER_RET_MEM)
+        {
+            fprintf(stderr, "%s: out of memory on line %zu\n", bc->name, i + 1);
+            arena_free(&arena);
+            return -1;
+        }
+        arena_reset(&arena);
+    }
+    cold_allocs = alloc_count;
+
+    alloc_count = 0;
+    iters = 0;
+    start = now();
+    do
+    {
+        for (i = 0; i < bc->nlines; i++)
+        {
+            parse_command_list(&root, bc->lines[i], &arena, NULL);
+            arena_reset(&arena);
+        }
+
+        iters++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_SECONDS);
+
+    lines = (double)iters * bc->nlines;
+    printf("%-16s %8zu %10zu %12.1f %10.1f %12.3f %12.3f\n", bc->name, bc->nlines, bc->bytes / bc->nlines,
+           elapsed * 1e9 / lines, bc->bytes * iters / elapsed / 1e6, alloc_count / lines,
+           (double)cold_allocs / bc->nlines);
+
+    arena_free(&arena);
+
+    return 0;
+}
+
+void free_case(bench_case_t *bc)
+{
+    size_t i;
+
+    for (i = 0; i < bc->nlines; i++)
+        free(bc->lines[i]);
+
+    free(bc->lines);
+}
+
+void sb_printf(strbuf_t *sb, const char *fmt, ...)
+{
+    va_list args;
+    size_t new_cap;
+    char *new_data;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (sb->len + len + 1 > sb->cap)
+    {
+        new_cap = (sb->cap) ? sb->cap : 256;
+        while (new_cap < sb->len + len + 1)
+            new_cap *= 2;
+
+        new_data = realloc(sb->data, new_cap);
+        if (!new_data)
+        {
+            fputs("Out of memory\n", stderr);
+            exit(1);
+        }
+
+        sb->data = new_data;
+        sb->cap = new_cap;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, args);
+    va_end(args);
+
+    sb->len += len;
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "arena.h"
+#include "oracle.h"
+
+static void compare_node(const char *input, const list_node_t *got, const list_node_t *want);
+
+static void compare(const char *input, const command_list_t *got, const command_list_t *want);
+
+static bool str_eq(const char *a, const char *b);
+
+static void mismatch(const char *input, const char *what, size_t index);
+
+// Checks the arena parser against the reference parser for every input
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static arena_t arena;
+    list_node_t *got, *want;
+    char *input;
+    int ret, want_ret;
+
+    // The shell hands the parser C strings
+    input = malloc(size + 1);
+    if (!input)
+        return 0;
+    memcpy(input, data, size);
+    input[size] = '\0';
+
+    ret = parse_command_list(&got, input, &arena, NULL);
+    want_ret = oracle_parse(&want, input);
+
+    if (ret != PARSER_RET_MEM && want_ret != PARSER_RET_MEM)
+    {
+        if (ret != want_ret)
+            mismatch(input, "return value", 0);
+        if (ret == PARSER_OK)
+            compare_node(input, got, want);
+    }
+
+    oracle_free(want);
+    arena_reset(&arena);
+    free(input);
+
+    return 0;
+}
+
+void compare_node(const char *input, const list_node_t *got, const list_node_t *want)
+{
+    if (got->op != want->op)
+        mismatch(input, "list operator", 0);
+
+    if (got->op == LIST_PIPELINE)
+    {
+        compare(input, &got->pipeline, &want->pipeline);
+        return;
+    }
+
+    compare_node(input, got->left, want->left);
+    compare_node(input, got->right, want->right);
+}
+
+void compare(const char *input, const command_list_t *got, const command_list_t *want)
+{
+    const command_t *a, *b;
+    size_t i, j;
+
+    if (got->count != want->count)
+        mismatch(input, "command count", 0);
+    if (strcmp(got->text, want->text) != 0)
+        mismatch(input, "pipeline text", 0);
+
+    for (i = 0; i < got->count; i++)
+    {
+        a = &got->commands[i];
+        b = &want->commands[i];
+
+        if (a->argc != b->argc)
+            mismatch(input, "argc", i);
+        for (j = 0; j <= a->argc; j++)
+        {
+            if (!str_eq(a->argv[j], b->argv[j]))
+                mismatch(input, "argv", i);
+        }
+
+        if (a->in_bg != b->in_bg)
+            mismatch(input, "background flag", i);
+        if (!str_eq(a->input_file, b->input_file))
+            mismatch(input, "input file", i);
+        if (!str_eq(a->output_file, b->output_file))
+            mismatch(input, "output file", i);
+        if (!a->here_doc != !b->here_doc ||
+            (a->here_doc && (a->here_doc->len != b->here_doc->len || strcmp(a->here_doc->data, b->here_doc->data) != 0)))
+            mismatch(input, "here document", i);
+
+        if (a->tee_count != b->tee_count)
+            mismatch(input, "tee count", i);
+        for (j = 0; j < a->tee_count; j++)
+        {
+            if (!str_eq(a->tee_files[j], b->tee_files[j]))
+                mismatch(input, "tee file", i);
+        }
+
+        if (a->pipe_size != b->pipe_size)
+            mismatch(input, "pipe size", i);
+
+        if (a->nexpansions != b->nexpansions)
+            mismatch(input, "expansion count", i);
+        for (j = 0; j < a->nexpansions; j++)
+        {
+            if (a->expansions[j].word != b->expansions[j].word || a->expansions[j].offset != b->expansions[j].offset ||
+                a->expansions[j].quoted != b->expansions[j].quoted || a->expansions[j].kind != b->expansions[j].kind ||
+                !str_eq(a->expansions[j].text, b->expansions[j].text))
+                mismatch(input, "expansion", i);
+        }
+    }
+}
+
+bool str_eq(const char *a, const char *b)
+{
+    if (!a || !b)
+        return a == b;
+
+    return strcmp(a, b) == 0;
+}
+
+void mismatch(const char *input, const char *what, size_t index)
+{
+    fprintf(stderr, "Parser mismatch in %s of command %zu for input:\n%s\n", what, index, input);
+    abort();
+}
+
+#ifdef FUZZ_STANDALONE
+/*
+ * Driver for AFL and plain replay: every argument is a file holding one
+ * input, stdin is used when there are none.
+ */
+static int run_file(FILE *file);
+
+int main(int argc, char *argv[])
+{
+    FILE *file;
+    int i;
+
+    if (argc < 2)
+        return run_file(stdin);
+
+    for (i = 1; i < argc; i++)
+    {
+        file = fopen(argv[i], "rb");
+        if (!file)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        if (run_file(file) < 0)
+        {
+            fclose(file);
+            return 1;
+        }
+        fclose(file);
+    }
+
+    return 0;
+}
+
+int run_file(FILE *file)
+{
+    char *data = NULL, *new_data;
+    size_t len = 0, cap = 0;
+    size_t nread;
+
+    for (;;)
+    {
+        if (len == cap)
+        {
+            cap = (cap) ? cap * 2 : 4096;
+            new_data = realloc(data, cap);
+            if (!new_data)
+            {
+                free(data);
+                return -1;
+            }
+            data = new_data;
+        }
+
+        nread = fread(data + len, 1, cap - len, file);
+        if (nread == 0)
+            break;
+        len += nread;
+    }
+
+    LLVMFuzzerTestOneInput((const uint8_t *)data, len);
+    free(data);
+
+    return 0;
+}
+#endif
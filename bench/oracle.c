@@ -0,0 +1,926 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "oracle.h"
+
+typedef enum token_type
+{
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_AMP,
+    TOK_SEMI,
+    TOK_AND_IF,
+    TOK_OR_IF,
+    TOK_IN,
+    TOK_OUT,
+    TOK_TEE,
+    TOK_HERE,     // '<<' or '<<-', text is the body once read
+    TOK_HERESTR,  // '<<<'
+    TOK_NEWLINE,
+    TOK_END
+} token_type_t;
+
+typedef struct token
+{
+    token_type_t type;
+    char *text;
+
+    // Source span, for pipeline text
+    size_t start;
+    size_t end;
+
+    size_t size; // Pipe size given as '|[SIZE]'
+    bool strip_tabs; // '<<-'
+
+    // Expansions of a word, word indexes are set when it becomes an argument
+    expansion_t *expansions;
+    size_t nexpansions;
+    bool subst; // Has expansions other than wildcards
+} token_t;
+
+typedef struct oracle
+{
+    const char *input;
+    token_t *tokens;
+    size_t ntokens;
+    size_t pos;
+
+    bool more; // Input ended inside a heredoc body
+} oracle_t;
+
+static int parse_list(oracle_t *o, list_node_t **node);
+
+static int parse_and_or(oracle_t *o, list_node_t **node);
+
+static int parse_pipeline(oracle_t *o, list_node_t **node);
+
+static int parse_command(oracle_t *o, command_t *cmd);
+
+static list_node_t *new_node(list_op_t op, list_node_t *left, list_node_t *right);
+
+static int lex(oracle_t *o);
+
+static int add_token(oracle_t *o, token_type_t type, char *text, size_t start, size_t end);
+
+static void free_tokens(oracle_t *o);
+
+static int add_arg(command_t *cmd, char *arg);
+
+static int add_tee(command_t *cmd, char *file);
+
+static bool lex_size(const char *str, size_t *size, size_t *len);
+
+static size_t read_bodies(oracle_t *o, size_t *heredocs, size_t count, size_t start);
+
+static void skip_newlines(oracle_t *o);
+
+static void free_here_doc(here_doc_t *doc);
+
+static int lex_dollar(const char *input, size_t i, expansion_t *exp, size_t *last);
+
+static size_t lex_subst(const char *input, size_t i);
+
+static size_t lex_name(const char *input);
+
+static int add_expansion(expansion_t **expansions, size_t *count, expansion_t *exp);
+
+int oracle_parse(list_node_t **root, const char *input)
+{
+    oracle_t o = {input, NULL, 0, 0, false};
+    int ret;
+
+    *root = NULL;
+
+    ret = lex(&o);
+    if (ret > 0)
+    {
+        skip_newlines(&o);
+
+        ret = parse_list(&o, root);
+        if (ret > 0 && o.tokens[o.pos].type != TOK_END)
+            ret = PARSER_RET_INVALID;
+        if (ret > 0 && o.more)
+            ret = PARSER_RET_MORE;
+    }
+
+    free_tokens(&o);
+
+    if (ret <= 0)
+    {
+        oracle_free(*root);
+        *root = NULL;
+    }
+
+    return ret;
+}
+
+void oracle_free(list_node_t *root)
+{
+    command_list_t *list;
+    size_t i, j;
+
+    if (!root)
+        return;
+
+    oracle_free(root->left);
+    oracle_free(root->right);
+
+    list = &root->pipeline;
+    for (i = 0; i < list->count; i++)
+    {
+        for (j = 0; j < list->commands[i].argc; j++)
+            free(list->commands[i].argv[j]);
+
+        free(list->commands[i].argv);
+        free(list->commands[i].input_file);
+        free(list->commands[i].output_file);
+        free_here_doc(list->commands[i].here_doc);
+
+        for (j = 0; j < list->commands[i].nexpansions; j++)
+            free(list->commands[i].expansions[j].text);
+        free(list->commands[i].expansions);
+
+        for (j = 0; j < list->commands[i].tee_count; j++)
+            free(list->commands[i].tee_files[j]);
+        free(list->commands[i].tee_files);
+    }
+
+    free(list->commands);
+    free(list->text);
+    free(root);
+}
+
+// list: and_or [(';' | '&' | NEWLINE) NEWLINE* [list]]
+int parse_list(oracle_t *o, list_node_t **node)
+{
+    list_node_t *right = NULL;
+    token_type_t type;
+    int ret;
+
+    ret = parse_and_or(o, node);
+    if (ret <= 0)
+        return ret;
+
+    type = o->tokens[o->pos].type;
+    if (type != TOK_SEMI && type != TOK_AMP && type != TOK_NEWLINE)
+        return PARSER_OK;
+
+    if (type == TOK_AMP)
+    {
+        // No subshells to put an and-or list in background
+        if ((*node)->op != LIST_PIPELINE)
+            return PARSER_RET_INVALID;
+
+        (*node)->pipeline.commands[(*node)->pipeline.count - 1].in_bg = true;
+    }
+
+    o->pos++;
+    skip_newlines(o);
+    if (o->tokens[o->pos].type == TOK_END)
+        return PARSER_OK;
+
+    ret = parse_list(o, &right);
+
+    *node = new_node(LIST_SEQ, *node, right);
+    if (!*node)
+    {
+        oracle_free(right);
+        return PARSER_RET_MEM;
+    }
+
+    return ret;
+}
+
+// and_or: pipeline (('&&' | '||') pipeline)*
+int parse_and_or(oracle_t *o, list_node_t **node)
+{
+    list_node_t *left, *right;
+    list_op_t op;
+    int ret;
+
+    ret = parse_pipeline(o, node);
+
+    while (ret > 0 && (o->tokens[o->pos].type == TOK_AND_IF || o->tokens[o->pos].type == TOK_OR_IF))
+    {
+        op = (o->tokens[o->pos].type == TOK_AND_IF) ? LIST_AND : LIST_OR;
+        o->pos++;
+
+        right = NULL;
+        ret = parse_pipeline(o, &right);
+
+        left = *node;
+        *node = new_node(op, left, right);
+        if (!*node)
+        {
+            oracle_free(left);
+            oracle_free(right);
+            return PARSER_RET_MEM;
+        }
+    }
+
+    return ret;
+}
+
+// pipeline: command ('|' command)*
+int parse_pipeline(oracle_t *o, list_node_t **node)
+{
+    command_list_t *list;
+    command_t *cmds;
+    size_t first = o->pos;
+    size_t len;
+    int ret;
+
+    *node = new_node(LIST_PIPELINE, NULL, NULL);
+    if (!*node)
+        return PARSER_RET_MEM;
+    list = &(*node)->pipeline;
+
+    for (;;)
+    {
+        cmds = realloc(list->commands, (list->count + 1) * sizeof(command_t));
+        if (!cmds)
+            return PARSER_RET_MEM;
+        list->commands = cmds;
+
+        ret = parse_command(o, &list->commands[list->count++]);
+        if (ret <= 0)
+            return ret;
+
+        if (o->tokens[o->pos].type != TOK_PIPE)
+            break;
+        list->commands[list->count - 1].pipe_size = o->tokens[o->pos].size;
+        o->pos++;
+    }
+
+    len = o->tokens[o->pos - 1].end - o->tokens[first].start;
+    list->text = strndup(o->input + o->tokens[first].start, len);
+    if (!list->text)
+        return PARSER_RET_MEM;
+
+    return PARSER_OK;
+}
+
+// command: (word | ('<' | '>' | '|>' | '<<' | '<<<') word)+
+int parse_command(oracle_t *o, command_t *cmd)
+{
+    token_t *tok;
+    here_doc_t *doc;
+    expansion_t exp;
+    char *arg;
+    size_t i;
+
+    memset(cmd, 0, sizeof(command_t));
+    if (add_arg(cmd, NULL) < 0)
+        return PARSER_RET_MEM;
+
+    for (;;)
+    {
+        tok = &o->tokens[o->pos];
+
+        if (tok->type == TOK_WORD)
+        {
+            arg = strdup(tok->text);
+            if (!arg || add_arg(cmd, arg) < 0)
+                return PARSER_RET_MEM;
+
+            for (i = 0; i < tok->nexpansions; i++)
+            {
+                exp = tok->expansions[i];
+                exp.word = cmd->argc - 1;
+                exp.text = (exp.text) ? strdup(exp.text) : NULL;
+                if ((tok->expansions[i].text && !exp.text) || add_expansion(&cmd->expansions, &cmd->nexpansions, &exp) < 0)
+                    return PARSER_RET_MEM;
+            }
+
+            o->pos++;
+            continue;
+        }
+
+        if (tok->type == TOK_HERE || tok->type == TOK_HERESTR)
+        {
+            if (tok[1].type != TOK_WORD || (tok->type == TOK_HERE && tok[1].text[0] == '\0') || tok[1].subst)
+                return PARSER_RET_INVALID;
+
+            doc = calloc(1, sizeof(here_doc_t));
+            if (!doc)
+                return PARSER_RET_MEM;
+
+            if (tok->type == TOK_HERESTR)
+            {
+                doc->len = strlen(tok[1].text) + 1;
+                doc->data = malloc(doc->len + 1);
+                if (doc->data)
+                {
+                    strcpy(doc->data, tok[1].text);
+                    strcat(doc->data, "\n");
+                }
+            }
+            else
+            {
+                // Not read if the input ran out first
+                doc->data = strdup((tok->text) ? tok->text : "");
+                doc->len = (doc->data) ? strlen(doc->data) : 0;
+            }
+
+            if (!doc->data)
+            {
+                free(doc);
+                return PARSER_RET_MEM;
+            }
+
+            free_here_doc(cmd->here_doc);
+            cmd->here_doc = doc;
+            free(cmd->input_file);
+            cmd->input_file = NULL;
+
+            o->pos += 2;
+            continue;
+        }
+
+        if (tok->type != TOK_IN && tok->type != TOK_OUT && tok->type != TOK_TEE)
+            break;
+
+        // Only arguments are expanded
+        if (tok[1].type != TOK_WORD || tok[1].text[0] == '\0' || tok[1].subst)
+            return PARSER_RET_INVALID;
+
+        arg = strdup(tok[1].text);
+        if (!arg)
+            return PARSER_RET_MEM;
+
+        // First '>' is the output, later ones and '|>' add copies
+        if (tok->type == TOK_IN)
+        {
+            free(cmd->input_file);
+            cmd->input_file = arg;
+            free_here_doc(cmd->here_doc);
+            cmd->here_doc = NULL;
+        }
+        else if (tok->type == TOK_OUT && !cmd->output_file)
+        {
+            cmd->output_file = arg;
+        }
+        else if (add_tee(cmd, arg) < 0)
+        {
+            return PARSER_RET_MEM;
+        }
+
+        o->pos += 2;
+    }
+
+    return (cmd->argc > 0) ? PARSER_OK : PARSER_RET_INVALID;
+}
+
+list_node_t *new_node(list_op_t op, list_node_t *left, list_node_t *right)
+{
+    list_node_t *node;
+
+    node = calloc(1, sizeof(list_node_t));
+    if (!node)
+        return NULL;
+
+    node->op = op;
+    node->left = left;
+    node->right = right;
+
+    return node;
+}
+
+// Returns PARSER_RET_EMPTY for blank lines, the list always ends in TOK_END
+int lex(oracle_t *o)
+{
+    const char *input = o->input;
+    char *word;
+    size_t len, start = 0;
+    size_t size, size_len;
+    bool in_word;
+    char quote;
+    size_t i, n;
+    int ret = 0;
+
+    // Heredoc tokens on the current line, by index
+    size_t *heredocs;
+    size_t nheredocs = 0;
+
+    // Of the current word
+    expansion_t *expansions = NULL;
+    size_t nexpansions = 0;
+    bool subst = false;
+    expansion_t exp;
+
+    word = malloc(strlen(input) + 1);
+    heredocs = malloc((strlen(input) + 1) * sizeof(size_t));
+    if (!word || !heredocs)
+    {
+        free(word);
+        free(heredocs);
+        return PARSER_RET_MEM;
+    }
+
+    len = 0;
+    in_word = false;
+    quote = '\0';
+    for (i = 0;; i++)
+    {
+        if (quote)
+        {
+            if (input[i] == '\0')
+            {
+                ret = PARSER_RET_INVALID;
+                goto fail;
+            }
+
+            if (input[i] == quote)
+                quote = '\0';
+            else if (quote == '"' && input[i] == '$')
+                goto dollar;
+            else
+                word[len++] = input[i];
+
+            continue;
+        }
+
+        if (input[i] != '\0' && !isspace((unsigned char)input[i]) && !strchr("|&;<>", input[i]))
+        {
+            if (!in_word)
+                start = i;
+            in_word = true;
+
+            if (input[i] == '\'' || input[i] == '"')
+                quote = input[i];
+            else if (input[i] == '$')
+                goto dollar;
+            else if (strchr("*?[", input[i]))
+                goto glob;
+            else
+                word[len++] = input[i];
+
+            continue;
+
+        glob:
+            exp.word = 0;
+            exp.offset = len;
+            exp.text = NULL;
+            exp.quoted = false;
+            exp.kind = EXPANSION_GLOB;
+            if (add_expansion(&expansions, &nexpansions, &exp) < 0)
+                goto mem;
+
+            word[len++] = input[i];
+            continue;
+
+        dollar:
+            ret = lex_dollar(input, i, &exp, &n);
+            if (ret == PARSER_RET_INVALID)
+                goto fail;
+            if (ret == PARSER_RET_MEM)
+                goto mem;
+
+            if (ret == 0)
+            {
+                word[len++] = '$';
+                continue;
+            }
+
+            exp.word = 0;
+            exp.offset = len;
+            exp.quoted = quote != '\0';
+            if (add_expansion(&expansions, &nexpansions, &exp) < 0)
+                goto mem;
+            subst = true;
+
+            ret = 0;
+            i = n;
+            continue;
+        }
+
+        if (in_word)
+        {
+            word[len] = '\0';
+            if (add_token(o, TOK_WORD, strdup(word), start, i) < 0)
+                goto mem;
+
+            o->tokens[o->ntokens - 1].expansions = expansions;
+            o->tokens[o->ntokens - 1].nexpansions = nexpansions;
+            o->tokens[o->ntokens - 1].subst = subst;
+            expansions = NULL;
+            nexpansions = 0;
+            subst = false;
+
+            // The word after '<<' ends the body
+            if (o->ntokens > 1 && o->tokens[o->ntokens - 2].type == TOK_HERE && word[0] != '\0')
+                heredocs[nheredocs++] = o->ntokens - 2;
+
+            len = 0;
+            in_word = false;
+        }
+
+        if (input[i] == '\0')
+        {
+            if (nheredocs > 0)
+                o->more = true;
+            break;
+        }
+
+        switch (input[i])
+        {
+        case '|':
+            if (input[i + 1] == '|' || input[i + 1] == '>')
+            {
+                ret = add_token(o, (input[i + 1] == '|') ? TOK_OR_IF : TOK_TEE, NULL, i, i + 2);
+                i++;
+            }
+            else if (input[i + 1] == '[' && lex_size(input + i + 2, &size, &size_len) && input[i + 2 + size_len] == ']')
+            {
+                ret = add_token(o, TOK_PIPE, NULL, i, i + size_len + 3);
+                if (ret == 0)
+                    o->tokens[o->ntokens - 1].size = size;
+                i += size_len + 2;
+            }
+            else
+                ret = add_token(o, TOK_PIPE, NULL, i, i + 1);
+            break;
+        case '&':
+            if (input[i + 1] == '&')
+            {
+                ret = add_token(o, TOK_AND_IF, NULL, i, i + 2);
+                i++;
+            }
+            else
+                ret = add_token(o, TOK_AMP, NULL, i, i + 1);
+            break;
+        case ';':
+            ret = add_token(o, TOK_SEMI, NULL, i, i + 1);
+            break;
+        case '<':
+            if (input[i + 1] == '<' && input[i + 2] == '<')
+            {
+                ret = add_token(o, TOK_HERESTR, NULL, i, i + 3);
+                i += 2;
+            }
+            else if (input[i + 1] == '<')
+            {
+                n = (input[i + 2] == '-') ? 3 : 2;
+                ret = add_token(o, TOK_HERE, NULL, i, i + n);
+                if (ret == 0)
+                    o->tokens[o->ntokens - 1].strip_tabs = n == 3;
+                i += n - 1;
+            }
+            else
+                ret = add_token(o, TOK_IN, NULL, i, i + 1);
+            break;
+        case '\n':
+            ret = add_token(o, TOK_NEWLINE, NULL, i, i + 1);
+            if (ret == 0 && nheredocs > 0)
+            {
+                n = read_bodies(o, heredocs, nheredocs, i + 1);
+                if (n == (size_t)-1)
+                    goto mem;
+
+                nheredocs = 0;
+                i = n - 1;
+            }
+            break;
+        case '>':
+            ret = add_token(o, TOK_OUT, NULL, i, i + 1);
+            break;
+        default:
+            break;
+        }
+
+        if (ret < 0)
+            goto mem;
+    }
+
+    free(word);
+    free(heredocs);
+
+    if (add_token(o, TOK_END, NULL, i, i) < 0)
+        return PARSER_RET_MEM;
+
+    // Blank lines alone are empty too
+    for (n = 0; o->tokens[n].type == TOK_NEWLINE; n++)
+        ;
+
+    return (o->tokens[n].type != TOK_END) ? PARSER_OK : PARSER_RET_EMPTY;
+
+mem:
+    ret = PARSER_RET_MEM;
+fail:
+    free(word);
+    free(heredocs);
+    for (n = 0; n < nexpansions; n++)
+        free(expansions[n].text);
+    free(expansions);
+    return ret;
+}
+
+/*
+ * Reads the bodies of the heredocs in order from the lines at start on,
+ * returns where the next line starts or -1 without memory. A body running
+ * into the end of the input sets o->more.
+ */
+size_t read_bodies(oracle_t *o, size_t *heredocs, size_t count, size_t start)
+{
+    const char *input = o->input;
+    token_t *tok;
+    const char *delim;
+    char *body, *line;
+    size_t tabs, end, k;
+
+    for (k = 0; k < count; k++)
+    {
+        tok = &o->tokens[heredocs[k]];
+        delim = tok[1].text;
+
+        body = calloc(1, strlen(input + start) + 1);
+        if (!body)
+            return -1;
+
+        for (;;)
+        {
+            if (input[start] == '\0')
+            {
+                free(body);
+                o->more = true;
+                return start;
+            }
+
+            for (end = start; input[end] != '\0' && input[end] != '\n'; end++)
+                ;
+
+            line = strndup(input + start, end - start);
+            if (!line)
+            {
+                free(body);
+                return -1;
+            }
+
+            for (tabs = 0; tok->strip_tabs && line[tabs] == '\t'; tabs++)
+                ;
+
+            if (strcmp(line + tabs, delim) == 0)
+            {
+                free(line);
+                start = (input[end] == '\n') ? end + 1 : end;
+                break;
+            }
+
+            if (input[end] == '\0')
+            {
+                free(line);
+                free(body);
+                o->more = true;
+                return end;
+            }
+
+            strcat(body, line + tabs);
+            strcat(body, "\n");
+            free(line);
+
+            start = end + 1;
+        }
+
+        tok->text = body;
+    }
+
+    return start;
+}
+
+void skip_newlines(oracle_t *o)
+{
+    while (o->tokens[o->pos].type == TOK_NEWLINE)
+        o->pos++;
+}
+
+void free_here_doc(here_doc_t *doc)
+{
+    if (!doc)
+        return;
+
+    free(doc->data);
+    free(doc);
+}
+
+int add_token(oracle_t *o, token_type_t type, char *text, size_t start, size_t end)
+{
+    token_t *new_tokens;
+
+    if (type == TOK_WORD && !text)
+        return -1;
+
+    new_tokens = realloc(o->tokens, (o->ntokens + 1) * sizeof(token_t));
+    if (!new_tokens)
+    {
+        free(text);
+        return -1;
+    }
+
+    o->tokens = new_tokens;
+    o->tokens[o->ntokens].type = type;
+    o->tokens[o->ntokens].text = text;
+    o->tokens[o->ntokens].start = start;
+    o->tokens[o->ntokens].end = end;
+    o->tokens[o->ntokens].size = 0;
+    o->tokens[o->ntokens].strip_tabs = false;
+    o->tokens[o->ntokens].expansions = NULL;
+    o->tokens[o->ntokens].nexpansions = 0;
+    o->tokens[o->ntokens].subst = false;
+    o->ntokens++;
+
+    return 0;
+}
+
+void free_tokens(oracle_t *o)
+{
+    size_t i, j;
+
+    for (i = 0; i < o->ntokens; i++)
+    {
+        free(o->tokens[i].text);
+
+        for (j = 0; j < o->tokens[i].nexpansions; j++)
+            free(o->tokens[i].expansions[j].text);
+        free(o->tokens[i].expansions);
+    }
+
+    free(o->tokens);
+}
+
+// Appends arg and keeps argv NULL terminated, a NULL arg only sets up argv
+int add_arg(command_t *cmd, char *arg)
+{
+    char **new_argv;
+
+    new_argv = realloc(cmd->argv, (cmd->argc + 2) * sizeof(char *));
+    if (!new_argv)
+    {
+        free(arg);
+        return -1;
+    }
+    cmd->argv = new_argv;
+
+    if (arg)
+        cmd->argv[cmd->argc++] = arg;
+    cmd->argv[cmd->argc] = NULL;
+
+    return 0;
+}
+
+int add_tee(command_t *cmd, char *file)
+{
+    char **new_files;
+
+    new_files = realloc(cmd->tee_files, (cmd->tee_count + 1) * sizeof(char *));
+    if (!new_files)
+    {
+        free(file);
+        return -1;
+    }
+
+    cmd->tee_files = new_files;
+    cmd->tee_files[cmd->tee_count++] = file;
+
+    return 0;
+}
+
+// Digits with an optional K, M or G suffix, false if missing or too large
+bool lex_size(const char *str, size_t *size, size_t *len)
+{
+    static const char suffixes[] = "kKmMgG";
+    size_t value = 0;
+    size_t i;
+    const char *suffix;
+
+    for (i = 0; isdigit((unsigned char)str[i]); i++)
+    {
+        if (__builtin_mul_overflow(value, 10, &value) || __builtin_add_overflow(value, str[i] - '0', &value))
+            return false;
+    }
+
+    if (i == 0)
+        return false;
+
+    suffix = (str[i] != '\0') ? strchr(suffixes, str[i]) : NULL;
+    if (suffix)
+    {
+        if (__builtin_mul_overflow(value, (size_t)1 << (10 * ((suffix - suffixes) / 2 + 1)), &value))
+            return false;
+        i++;
+    }
+
+    *size = value;
+    *len = i;
+
+    return true;
+}
+
+/*
+ * Reads the expansion of the '$' at i into exp, *last is set to its last
+ * character. Returns 1 for one, 0 for a plain '$', PARSER_RET_INVALID or
+ * PARSER_RET_MEM.
+ */
+int lex_dollar(const char *input, size_t i, expansion_t *exp, size_t *last)
+{
+    size_t start, len;
+    const char *close;
+
+    if (input[i + 1] == '(')
+    {
+        *last = lex_subst(input, i);
+        if (*last == 0)
+            return PARSER_RET_INVALID; // Mismatched parentheses
+
+        exp->kind = EXPANSION_COMMAND;
+        start = i + 2;
+        len = *last - start;
+    }
+    else if (input[i + 1] == '{')
+    {
+        close = strchr(input + i + 2, '}');
+        if (!close)
+            return PARSER_RET_INVALID;
+
+        exp->kind = EXPANSION_VAR;
+        start = i + 2;
+        len = close - (input + start);
+        *last = close - input;
+
+        if (!(len == 1 && input[start] == '?') && (len == 0 || lex_name(input + start) != len))
+            return PARSER_RET_INVALID;
+    }
+    else
+    {
+        exp->kind = EXPANSION_VAR;
+        start = i + 1;
+        len = (input[start] == '?') ? 1 : lex_name(input + start);
+        if (len == 0)
+            return 0;
+
+        *last = start + len - 1;
+    }
+
+    exp->text = strndup(input + start, len);
+    if (!exp->text)
+        return PARSER_RET_MEM;
+
+    return 1;
+}
+
+// Length of the variable name input starts with
+size_t lex_name(const char *input)
+{
+    size_t len = 0;
+
+    if (!isalpha((unsigned char)input[0]) && input[0] != '_')
+        return 0;
+
+    while (isalnum((unsigned char)input[len]) || input[len] == '_')
+        len++;
+
+    return len;
+}
+
+// Returns the index of the ')' closing the '$(' at i, 0 if there is none
+size_t lex_subst(const char *input, size_t i)
+{
+    size_t depth = 0;
+    char quote = '\0';
+
+    for (i++; input[i] != '\0'; i++)
+    {
+        if (quote)
+        {
+            if (input[i] == quote)
+                quote = '\0';
+        }
+        else if (input[i] == '\'' || input[i] == '"')
+            quote = input[i];
+        else if (input[i] == '(')
+            depth++;
+        else if (input[i] == ')' && --depth == 0)
+            return i;
+    }
+
+    return 0;
+}
+
+int add_expansion(expansion_t **expansions, size_t *count, expansion_t *exp)
+{
+    expansion_t *new_expansions;
+
+    new_expansions = realloc(*expansions, (*count + 1) * sizeof(expansion_t));
+    if (!new_expansions)
+    {
+        free(exp->text);
+        return -1;
+    }
+
+    *expansions = new_expansions;
+    (*expansions)[(*count)++] = *exp;
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef ORACLE_H
+#define ORACLE_H
+
+#include "parser.h"
+
+/*
+ * Straightforward reference parser, lexes into a token list first and then
+ * builds the tree with plain mallocs. Slow but easy to check by eye.
+ */
+int oracle_parse(list_node_t **root, const char *input);
+
+void oracle_free(list_node_t *root);
+
+#endif
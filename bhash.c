@@ -0,0 +1,142 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+
+#include "bhash.h"
+#include "kai_plugin.h"
+
+#define INITIAL_CAPACITY 64
+
+static const char ERR_NO_SYMBOL[] = "Not a kai plugin";
+static const char ERR_ABI[] = "Plugin was built for a different version of kai";
+
+void bhash_init(bhash_t *hash)
+{
+    htab_init(&hash->tab, sizeof(bhash_entry_t), INITIAL_CAPACITY);
+}
+
+void bhash_free(bhash_t *hash)
+{
+    bhash_entry_t *entry;
+    size_t iter = 0;
+
+    while ((entry = htab_next(&hash->tab, &iter)))
+    {
+        if (entry->plugin)
+            plugin_release(entry->plugin);
+    }
+
+    htab_free(&hash->tab);
+}
+
+/*
+ * Names aren't copied, they stay owned by the builtin. Fails with EEXIST if
+ * the name is taken. Takes a reference to plugin on success.
+ */
+int bhash_add(bhash_t *hash, const kai_builtin_t *builtin, plugin_t *plugin)
+{
+    bhash_entry_t *entry;
+
+    entry = htab_insert(&hash->tab, builtin->name, strlen(builtin->name));
+    if (!entry)
+        return -1;
+
+    entry->builtin = builtin;
+    entry->plugin = plugin;
+
+    if (plugin)
+        plugin->refs++;
+
+    return 0;
+}
+
+const bhash_entry_t *bhash_lookup(bhash_t *hash, const char *name)
+{
+    return htab_find(&hash->tab, name, strlen(name));
+}
+
+// The plugin the builtin came from is unloaded with its last builtin
+void bhash_remove(bhash_t *hash, const char *name)
+{
+    bhash_entry_t *entry;
+
+    entry = htab_find(&hash->tab, name, strlen(name));
+    if (!entry)
+        return;
+
+    if (entry->plugin)
+        plugin_release(entry->plugin);
+
+    htab_remove(&hash->tab, entry);
+}
+
+bhash_entry_t *bhash_next(bhash_t *hash, size_t *iter)
+{
+    return htab_next(&hash->tab, iter);
+}
+
+/*
+ * Opens a plugin with no references yet, release it if none of its builtins
+ * end up being added. On failure *err_msg describes why.
+ */
+plugin_t *plugin_load(const char *path, const char **err_msg)
+{
+    plugin_t *plugin;
+
+    plugin = calloc(1, sizeof(plugin_t));
+    if (!plugin || !(plugin->path = strdup(path)))
+    {
+        free(plugin);
+
+        *err_msg = strerror(ENOMEM);
+        return NULL;
+    }
+
+    // Symbols of one plugin are kept away from the next
+    plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!plugin->handle)
+    {
+        *err_msg = dlerror();
+        goto fail;
+    }
+
+    plugin->desc = dlsym(plugin->handle, KAI_PLUGIN_SYMBOL);
+    if (!plugin->desc)
+    {
+        *err_msg = ERR_NO_SYMBOL;
+        goto fail;
+    }
+
+    if (plugin->desc->abi != KAI_PLUGIN_ABI || plugin->desc->ctx_size != sizeof(kai_ctx_t))
+    {
+        *err_msg = ERR_ABI;
+        goto fail;
+    }
+
+    return plugin;
+
+fail:
+    if (plugin->handle)
+        dlclose(plugin->handle);
+    free(plugin->path);
+    free(plugin);
+
+    return NULL;
+}
+
+void plugin_release(plugin_t *plugin)
+{
+    if (plugin->refs > 1)
+    {
+        plugin->refs--;
+        return;
+    }
+
+    dlclose(plugin->handle);
+    free(plugin->path);
+    free(plugin);
+}
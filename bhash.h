@@ -0,0 +1,48 @@
+#ifndef BHASH_H
+#define BHASH_H
+
+#include <stddef.h>
+
+#include "htab.h"
+
+struct kai_builtin;
+struct kai_plugin;
+
+// A shared object loaded with 'enable -f'
+typedef struct plugin
+{
+    char *path;
+    void *handle;
+    const struct kai_plugin *desc;
+    size_t refs; // Builtins of the library that are still enabled
+} plugin_t;
+
+typedef struct bhash_entry
+{
+    htab_key_t key; // The builtin's own name
+    const struct kai_builtin *builtin;
+    plugin_t *plugin; // NULL for builtins compiled into the shell
+} bhash_entry_t;
+
+typedef struct bhash
+{
+    htab_t tab;
+} bhash_t;
+
+void bhash_init(bhash_t *hash);
+
+void bhash_free(bhash_t *hash);
+
+int bhash_add(bhash_t *hash, const struct kai_builtin *builtin, plugin_t *plugin);
+
+const bhash_entry_t *bhash_lookup(bhash_t *hash, const char *name);
+
+void bhash_remove(bhash_t *hash, const char *name);
+
+bhash_entry_t *bhash_next(bhash_t *hash, size_t *iter);
+
+plugin_t *plugin_load(const char *path, const char **err_msg);
+
+void plugin_release(plugin_t *plugin);
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,62 +8,471 @@
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdio_ext.h>
 
 #include "builtin.h"
+#include "kai_plugin.h"
+#include "optimize.h"
+#include "heredoc.h"
+#include "utils.h"
 
 static const char ERR_TOO_MANY_ARGS[] = "Too many arguments";
 static const char ERR_NOT_ENOUGH_ARGS[] = "Not enough arguments";
 static const char ERR_NUM_ARG_REQ[] = "Numeric argument required";
 static const char ERR_PATH_TOO_BIG[] = "Path length exceeds max limit";
 static const char ERR_NO_HOME[] = "Failed to determine home directory";
+static const char ERR_NOT_FOUND[] = "Command not found";
+static const char ERR_NO_SUCH_JOB[] = "No such job";
+static const char ERR_NO_JOB_CONTROL[] = "No job control in this shell";
+static const char ERR_BAD_SIGNAL[] = "Invalid signal specification";
+static const char ERR_BAD_TARGET[] = "Arguments must be process or job IDs";
+static const char ERR_REDIR_FILE[] = "Failed to open file for redirection";
+static const char ERR_ENABLE_USAGE[] = "Usage: enable [-f file [name...]]";
+static const char ERR_EXISTS[] = "Builtin already exists";
+static const char ERR_NOT_IN_PLUGIN[] = "Not provided by the plugin";
+static const char ERR_NO_SUCH_BUILTIN[] = "No such builtin";
+static const char ERR_NOT_LOADED[] = "Not loaded from a plugin";
+static const char ERR_SYNTAX[] = "Invalid syntax";
+static const char ERR_ON_OFF[] = "Argument must be 'on' or 'off'";
+static const char ERR_BAD_SIZE[] = "Invalid size";
+static const char ERR_PIPE_MAX[] = "Size exceeds /proc/sys/fs/pipe-max-size";
+static const char ERR_BAD_NAME[] = "Invalid variable name";
+static const char ERR_NOT_SET[] = "Variable not set";
+static const char ERR_BG_BUILTIN[] = "Builtin changes the shell, it can't run in background";
 
 static const char HELP_MSG[] = "kai shell\n"
                                "Shell commands below are defined internally:\n\n"
                                " - cd <directory> : Change the current working directory\n"
                                "    (if directory is omitted, user's home directory is chosen)\n"
                                " - exec [cmd] : Replace shell with the given command\n"
-                               " - set [var] [value] : Set environment variable\n"
-                               " - get [var] : Get environment variable\n"
+                               " - set <-l> [var] [value] : Set variable, exported to programs unless -l is given\n"
+                               "    (a variable that is already exported stays so)\n"
+                               " - get [var] : Get variable\n"
+                               "    ('?', quoted as it's a pattern, gives the last exit status like $?,\n"
+                               "     PIPESTATUS the status of each pipeline stage)\n"
+                               " - export <var...> : Export variables to programs, or list the exported ones\n"
+                               " - unset [var...] : Remove variables\n"
+                               " - time [cmd] : Run pipeline and report resource usage of each stage\n"
+                               " - explain [\"cmd\"] : Show a command line the way it would be run\n"
+                               " - optimize <on|off> : Show or toggle rewriting pipelines into cheaper ones\n"
+                               "    (e.g. 'cat file | grep x' into 'grep x < file')\n"
+                               " - pipesize <size> : Show or set the buffer size of pipeline pipes\n"
+                               "    (e.g. 1M, 0 for the kernel default; 'cmd |[size] cmd' sets a single pipe)\n"
+                               " - echo, printf, test/[, true, false, cat : Run without starting a process\n"
+                               " - hash <-r> <cmd...> : List, clear (-r) or add to cached command paths\n"
+                               " - enable <-f file> <name...> : Load builtins from a plugin\n"
+                               "    (without names all of them, without arguments enabled builtins are listed)\n"
+                               " - disable [name...] : Unload builtins loaded from a plugin\n"
+                               " - jobs : List jobs\n"
+                               " - fg <%job> : Resume job in foreground\n"
+                               " - bg <%job> : Resume stopped job in background\n"
+                               " - wait <%job|pid...> : Wait for jobs to finish\n"
+                               "    (if no job is given, all running jobs are waited for)\n"
+                               " - kill <-signal> [%job|pid...] : Send signal to jobs or processes\n"
+                               "    (if signal is omitted, SIGTERM is sent)\n"
                                " - exit <status> : Exit from shell\n"
                                "    (if status is omitted, 0 is used)";
 
-static int cd(command_t *cmd, eval_res_t *result);
+static const kai_builtin_t *find_builtin(const char *name, kai_ctx_t *kai_ctx);
+
+static int cat_stage(command_t *cmd, int infd, int outfd, task_t **task);
+
+static int capture_stage(const kai_builtin_t *builtin, command_t *cmd, int infd, int outfd, task_t **task,
+                         kai_ctx_t *kai_ctx);
+
+static int swap_fd(int fd, int new_fd, int *saved_fd);
+
+static int redirect(command_t *cmd, int saved_fds[2]);
+
+static void restore_fds(int saved_fds[2]);
+
+static int cd(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int exec(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int set(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int get(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int export(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int unset(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static void var_changed(const char *name, kai_ctx_t *kai_ctx);
+
+static int hash(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int jobs(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int fg(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
 
-static int exec(command_t *cmd, eval_res_t *result);
+static int bg(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
 
-static int set(command_t *cmd, eval_res_t *result);
+static int b_wait(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
 
-static int get(command_t *cmd, eval_res_t *result);
+static int b_kill(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int parse_signal(const char *name);
 
 static int b_exit(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
 
-static int help(command_t *cmd, eval_res_t *result);
+static int enable(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int disable(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int explain(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static void optimize_node(list_node_t *node);
+
+static int optimize(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int pipesize(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+static int help(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+// Builtins that change the shell's own state or its job table can't be pipeline stages
+static const kai_builtin_t BUILTINS[] = {
+    {"cd", cd, 0},
+    {"exec", exec, 0},
+    {"set", set, 0},
+    {"get", get, KAI_BUILTIN_STAGE},
+    {"export", export, 0},
+    {"unset", unset, 0},
+    {"hash", hash, 0},
+    {"jobs", jobs, 0},
+    {"fg", fg, 0},
+    {"bg", bg, 0},
+    {"wait", b_wait, 0},
+    {"kill", b_kill, 0},
+    {"echo", util_echo, KAI_BUILTIN_STAGE},
+    {"printf", util_printf, KAI_BUILTIN_STAGE},
+    {"test", util_test, KAI_BUILTIN_STAGE},
+    {"[", util_test, KAI_BUILTIN_STAGE},
+    {"true", util_true, KAI_BUILTIN_STAGE},
+    {"false", util_false, KAI_BUILTIN_STAGE},
+    {"cat", util_cat, KAI_BUILTIN_STAGE},
+    {"enable", enable, 0},
+    {"disable", disable, 0},
+    {"explain", explain, KAI_BUILTIN_STAGE},
+    {"optimize", optimize, 0},
+    {"pipesize", pipesize, 0},
+    {"exit", b_exit, 0},
+    {"help", help, KAI_BUILTIN_STAGE},
+};
+
+// Registers the builtins compiled into the shell
+int builtin_init(kai_ctx_t *kai_ctx)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(BUILTINS) / sizeof(BUILTINS[0]); i++)
+    {
+        if (bhash_add(&kai_ctx->builtins, &BUILTINS[i], NULL) < 0)
+            return -1;
+    }
+
+    return 0;
+}
 
 int eval_builtin(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
+    const kai_builtin_t *builtin;
+    int saved_fds[2];
+    int ret;
+
+    builtin = find_builtin(cmd->argv[0], kai_ctx);
+    if (!builtin)
+        return 0;
+
     result->bg_pid = -1;
+    result->exit_status = 0;
+
+    // Those that can be pipeline stages run as one in a background job
+    if (cmd->in_bg)
+    {
+        if (builtin->flags & KAI_BUILTIN_STAGE)
+            return 0;
+
+        result->status = -1;
+        result->err_msg = ERR_BG_BUILTIN;
+
+        return -1;
+    }
+
+    if (redirect(cmd, saved_fds) < 0)
+    {
+        result->status = -1;
+        result->err_msg = ERR_REDIR_FILE;
+
+        return -1;
+    }
+
+    // Returns 0 if the builtin declined and the command should be run after all
+    ret = builtin->fn(cmd, result, kai_ctx);
+
+    restore_fds(saved_fds);
+
+    return ret;
+}
+
+/*
+ * Starts cmd as an in-process stage of a pipeline reading infd and writing
+ * outfd. prev is the in-process stage feeding infd, if there is one, and
+ * next_reads tells if the next stage is a builtin that reads its input.
+ * Returns 1 with *task set, 0 if cmd has to run as a process and -1 on
+ * failure.
+ */
+int builtin_stage(command_t *cmd, int infd, int outfd, task_t *prev, bool next_reads, task_t **task,
+                  kai_ctx_t *kai_ctx)
+{
+    const kai_builtin_t *builtin;
+    int ret;
+
+    builtin = find_builtin(cmd->argv[0], kai_ctx);
+    if (!builtin || !(builtin->flags & KAI_BUILTIN_STAGE))
+        return 0;
+
+    // What cat streams only gets written once we are back in the scheduler, which
+    // a builtin reading it right away would keep waiting, the real cat runs instead
+    if (builtin->fn == util_cat)
+        return (next_reads) ? 0 : cat_stage(cmd, infd, outfd, task);
+
+    // Without prev the input is the shell's own or a file, with one it can only be captured
+    if (!(builtin->flags & KAI_BUILTIN_READS_INPUT) || !prev)
+        return capture_stage(builtin, cmd, infd, outfd, task, kai_ctx);
+
+    // Captured output is complete already, read it from the memfd instead of the pipe
+    ret = capture_stage(builtin, cmd, prev->stdin_fd, outfd, task, kai_ctx);
+
+    // The offset is shared: once the builtin ran, leave nothing for prev to write to a
+    // pipe nobody reads, if it declined the process gets all of it through the pipe
+    lseek(prev->stdin_fd, 0, (ret == 0) ? SEEK_SET : SEEK_END);
+
+    return ret;
+}
+
+bool builtin_reads_input(command_t *cmd, kai_ctx_t *kai_ctx)
+{
+    const kai_builtin_t *builtin;
+
+    builtin = find_builtin(cmd->argv[0], kai_ctx);
+
+    return builtin && (builtin->flags & KAI_BUILTIN_STAGE) && (builtin->flags & KAI_BUILTIN_READS_INPUT);
+}
+
+/*
+ * Runs a builtin reading input in a forked copy of the shell, like sh runs
+ * pipeline builtins, for input that isn't all there when it starts. Returns
+ * like spawn_start().
+ */
+int builtin_fork(spawn_handle_t *stage, command_t *cmd, int infd, int outfd, const spawn_attr_t *sattr,
+                 kai_ctx_t *kai_ctx)
+{
+    const kai_builtin_t *builtin;
+    eval_res_t result = {.exit_status = 0};
+    pid_t pid;
+    int ret;
+
+    builtin = find_builtin(cmd->argv[0], kai_ctx);
+
+    // The child would write it a second time
+    fflush(stdout);
+
+    pid = spawn_fork(stage, infd, outfd, sattr);
+    if (pid != 0)
+        return (pid < 0) ? -1 : 0;
+
+    __fpurge(stdin);
+
+    ret = builtin->fn(cmd, &result, kai_ctx);
+    fflush(stdout);
+
+    if (ret == 0)
+    {
+        // Declined, run the program after all
+        execvpe(cmd->argv[0], cmd->argv, sattr->envp);
+        fprintf(stderr, "[!] Error: %s: %s\n", cmd->argv[0], strerror(errno));
+        _exit((errno == ENOENT) ? 127 : 126);
+    }
+
+    if (ret < 0 && result.err_msg)
+        fprintf(stderr, "[!] Error: %s\n", result.err_msg);
+
+    _exit((ret < 0 && result.exit_status == 0) ? 1 : result.exit_status);
+}
+
+const kai_builtin_t *find_builtin(const char *name, kai_ctx_t *kai_ctx)
+{
+    const bhash_entry_t *entry;
+
+    entry = bhash_lookup(&kai_ctx->builtins, name);
+
+    return (entry) ? entry->builtin : NULL;
+}
+
+// cat streams its input through the task, a buffer at a time
+int cat_stage(command_t *cmd, int infd, int outfd, task_t **task)
+{
+    bool reads_stdin = (cmd->argc == 1);
+    size_t i;
+
+    for (i = 1; i < cmd->argc; i++)
+        reads_stdin |= strcmp(cmd->argv[i], "-") == 0;
+
+    // Same as util_cat, typing into a builtin couldn't be interrupted
+    if (reads_stdin && isatty(infd))
+        return 0;
+
+    *task = task_new(&cmd->argv[1], cmd->argc - 1, reads_stdin ? infd : -1, outfd, 0);
+
+    return (*task) ? 1 : -1;
+}
+
+/*
+ * The other builtins run to completion right away, with output going into a
+ * memfd that the task then drains. Only those flagged as reading input get
+ * the stage input, they read it through before the task starts.
+ */
+int capture_stage(const kai_builtin_t *builtin, command_t *cmd, int infd, int outfd, task_t **task,
+                  kai_ctx_t *kai_ctx)
+{
+    eval_res_t result = {.exit_status = 0};
+    int saved_fds[2] = {-1, -1};
+    int memfd;
+    int status;
+    int ret;
+
+    memfd = memfd_create("kai-builtin", MFD_CLOEXEC);
+    if (memfd < 0)
+        return -1;
+
+    fflush(stdout);
+
+    if (swap_fd(STDOUT_FILENO, memfd, &saved_fds[STDOUT_FILENO]) < 0 ||
+        ((builtin->flags & KAI_BUILTIN_READS_INPUT) && swap_fd(STDIN_FILENO, infd, &saved_fds[STDIN_FILENO]) < 0))
+    {
+        restore_fds(saved_fds);
+        close(memfd);
+
+        return -1;
+    }
+
+    ret = builtin->fn(cmd, &result, kai_ctx);
+
+    // Whatever stdio read ahead belonged to the stage input
+    if (saved_fds[STDIN_FILENO] >= 0)
+    {
+        __fpurge(stdin);
+        clearerr(stdin);
+    }
+
+    restore_fds(saved_fds);
+
+    if (ret == 0)
+    {
+        close(memfd);
+        return 0; // Declined, run as a process after all
+    }
+
+    if (ret < 0 && result.err_msg)
+        fprintf(stderr, "[!] Error: %s\n", result.err_msg);
+
+    // Failures that leave no exit status of their own exit with 1
+    status = (ret < 0 && result.exit_status == 0) ? 1 : result.exit_status;
+
+    lseek(memfd, 0, SEEK_SET);
+    *task = task_new(NULL, 0, memfd, outfd, status);
+    close(memfd);
+
+    if (!*task)
+        return -1;
+
+    (*task)->captured = true;
+    return 1;
+}
+
+// Points fd at new_fd, keeping a copy of the original in *saved_fd
+int swap_fd(int fd, int new_fd, int *saved_fd)
+{
+    *saved_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (*saved_fd < 0)
+        return -1;
+
+    return dup2(new_fd, fd);
+}
+
+/*
+ * Points stdin and stdout at the command's redirections for the duration of
+ * the builtin, the originals are kept in saved_fds (-1 if untouched).
+ */
+int redirect(command_t *cmd, int saved_fds[2])
+{
+    const char *files[2] = {cmd->input_file, cmd->output_file};
+    int fd;
+    int i;
 
-    if (strcmp(cmd->argv[0], "cd") == 0)
-        return cd(cmd, result);
-    if (strcmp(cmd->argv[0], "exec") == 0)
-        return exec(cmd, result);
-    if (strcmp(cmd->argv[0], "set") == 0)
-        return set(cmd, result);
-    if (strcmp(cmd->argv[0], "get") == 0)
-        return get(cmd, result);
-    if (strcmp(cmd->argv[0], "exit") == 0)
-        return b_exit(cmd, result, kai_ctx);
-    if (strcmp(cmd->argv[0], "help") == 0)
-        return help(cmd, result);
+    saved_fds[0] = saved_fds[1] = -1;
+
+    // Output buffered so far belongs to the old stdout
+    if (cmd->output_file)
+        fflush(stdout);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (i == STDIN_FILENO && cmd->here_doc)
+            fd = heredoc_open(cmd->here_doc);
+        else if (!files[i])
+            continue;
+        else if (i == STDIN_FILENO)
+            fd = open(files[i], O_RDONLY | O_CLOEXEC);
+        else
+            fd = open(files[i], O_CREAT | O_WRONLY | O_CLOEXEC, 0664);
+        if (fd < 0)
+            goto fail;
+
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        if (saved_fds[i] < 0 || dup2(fd, i) < 0)
+        {
+            close(fd);
+            goto fail;
+        }
+
+        close(fd);
+    }
 
     return 0;
+
+fail:
+    restore_fds(saved_fds);
+    return -1;
+}
+
+void restore_fds(int saved_fds[2])
+{
+    int i;
+
+    if (saved_fds[STDOUT_FILENO] >= 0)
+        fflush(stdout);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (saved_fds[i] < 0)
+            continue;
+
+        dup2(saved_fds[i], i);
+        close(saved_fds[i]);
+        saved_fds[i] = -1;
+    }
 }
 
-int cd(command_t *cmd, eval_res_t *result)
+int cd(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
     char path[PATH_MAX];
     size_t plen, arglen;
-    char *homedir;
+    const char *homedir;
 
     int ret;
 
@@ -75,7 +486,7 @@ int cd(command_t *cmd, eval_res_t *result)
 
     if (cmd->argc == 1)
     {
-        homedir = getenv("HOME");
+        homedir = vars_get(&kai_ctx->vars, "HOME");
         if (!homedir)
         {
             result->status = -1;
@@ -125,14 +536,20 @@ int cd(command_t *cmd, eval_res_t *result)
         return -1;
     }
 
+    prompt_invalidate(&kai_ctx->prompt, PROMPT_EV_CD);
+
     result->status = 1;
     result->err_msg = NULL;
 
     return 1;
 }
 
-int exec(command_t *cmd, eval_res_t *result)
+int exec(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
+    const char *path;
+    char **envp;
+    sigset_t sigmask, oldmask;
+
     if (cmd->argc == 1)
     {
         result->status = -1;
@@ -141,7 +558,22 @@ int exec(command_t *cmd, eval_res_t *result)
         return -1;
     }
 
-    execvp(cmd->argv[1], &cmd->argv[1]);
+    path = cmdhash_lookup(&kai_ctx->cmdhash, cmd->argv[1], vars_get(&kai_ctx->vars, "PATH"));
+    envp = vars_envp(&kai_ctx->vars);
+    if (path && !envp)
+        errno = ENOMEM;
+    if (path && envp)
+    {
+        // Don't pass the shell's blocked or ignored signals on to the new program
+        sigemptyset(&sigmask);
+        sigprocmask(SIG_SETMASK, &sigmask, &oldmask);
+        signal(SIGPIPE, SIG_DFL);
+
+        execve(path, &cmd->argv[1], envp);
+
+        signal(SIGPIPE, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    }
 
     result->status = -1;
     result->err_msg = strerror(errno);
@@ -149,16 +581,22 @@ int exec(command_t *cmd, eval_res_t *result)
     return -1;
 }
 
-int set(command_t *cmd, eval_res_t *result)
+int set(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
-    if (cmd->argc < 3)
+    bool local;
+    char **args;
+
+    local = cmd->argc > 1 && strcmp(cmd->argv[1], "-l") == 0;
+    args = cmd->argv + local;
+
+    if (cmd->argc - local < 3)
     {
         result->status = -1;
         result->err_msg = ERR_NOT_ENOUGH_ARGS;
 
         return -1;
     }
-    if (cmd->argc > 3)
+    if (cmd->argc - local > 3)
     {
         result->status = -1;
         result->err_msg = ERR_TOO_MANY_ARGS;
@@ -166,7 +604,15 @@ int set(command_t *cmd, eval_res_t *result)
         return -1;
     }
 
-    if (setenv(cmd->argv[1], cmd->argv[2], 1) != 0)
+    if (!vars_valid_name(args[1], strlen(args[1])))
+    {
+        result->status = -1;
+        result->err_msg = ERR_BAD_NAME;
+
+        return -1;
+    }
+
+    if (vars_set(&kai_ctx->vars, args[1], args[2], !local) < 0)
     {
         result->status = -1;
         result->err_msg = strerror(errno);
@@ -174,15 +620,18 @@ int set(command_t *cmd, eval_res_t *result)
         return -1;
     }
 
+    var_changed(args[1], kai_ctx);
+
     result->status = 1;
     result->err_msg = NULL;
 
     return 1;
 }
 
-int get(command_t *cmd, eval_res_t *result)
+int get(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
-    char *val;
+    const char *val;
+    size_t i;
 
     if (cmd->argc < 2)
     {
@@ -199,17 +648,67 @@ int get(command_t *cmd, eval_res_t *result)
         return -1;
     }
 
-    val = getenv(cmd->argv[1]);
-    if (val)
+    // Exit status of the last command and of every stage of the last pipeline
+    if (strcmp(cmd->argv[1], "?") == 0)
+    {
+        printf("%d\n", kai_ctx->last_status);
+
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
+    }
+    if (strcmp(cmd->argv[1], "PIPESTATUS") == 0)
     {
+        for (i = 0; i < kai_ctx->pipestatus_count; i++)
+            printf((i > 0) ? " %d" : "%d", kai_ctx->pipestatus[i]);
+        putchar('\n');
+
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
+    }
+
+    val = vars_get(&kai_ctx->vars, cmd->argv[1]);
+    if (val)
         puts(val);
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int export(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    var_entry_t *entry;
+    size_t iter = 0;
+    size_t i;
+
+    if (cmd->argc == 1)
+    {
+        while ((entry = vars_next(&kai_ctx->vars, &iter)))
+        {
+            if (entry->exported)
+                puts(entry->key.name);
+        }
+
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
     }
-    else if (errno != 0)
+
+    for (i = 1; i < cmd->argc; i++)
     {
-        result->status = -1;
-        result->err_msg = strerror(errno);
+        if (vars_export(&kai_ctx->vars, cmd->argv[i]) < 0)
+        {
+            result->status = -1;
+            result->err_msg = ERR_NOT_SET;
 
-        return -1;
+            return -1;
+        }
     }
 
     result->status = 1;
@@ -218,45 +717,720 @@ int get(command_t *cmd, eval_res_t *result)
     return 1;
 }
 
-static int b_exit(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+int unset(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
-    int ecode;
-    char *endptr;
+    size_t i;
 
-    if (cmd->argc > 2)
+    if (cmd->argc < 2)
     {
         result->status = -1;
-        result->err_msg = ERR_TOO_MANY_ARGS;
+        result->err_msg = ERR_NOT_ENOUGH_ARGS;
 
         return -1;
     }
 
+    for (i = 1; i < cmd->argc; i++)
+    {
+        vars_unset(&kai_ctx->vars, cmd->argv[i]);
+        var_changed(cmd->argv[i], kai_ctx);
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+void var_changed(const char *name, kai_ctx_t *kai_ctx)
+{
+    // Cached command paths were resolved against the old PATH
+    if (strcmp(name, "PATH") == 0)
+        cmdhash_clear(&kai_ctx->cmdhash);
+}
+
+int hash(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    cmdhash_entry_t *entry;
+    size_t iter;
+    size_t i;
+
     if (cmd->argc == 1)
     {
-        ecode = kai_ctx->exit_code = 0;
+        if (kai_ctx->cmdhash.tab.count == 0)
+        {
+            puts("hash table empty");
+        }
+        else
+        {
+            puts("hits\tcommand");
+
+            iter = 0;
+            while ((entry = cmdhash_next(&kai_ctx->cmdhash, &iter)))
+                printf("%4zu\t%s\n", entry->hits, entry->path);
+        }
+
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
     }
-    else
+
+    i = 1;
+    if (strcmp(cmd->argv[1], "-r") == 0)
     {
-        ecode = strtol(cmd->argv[1], &endptr, 10);
-        if (*endptr != '\0')
+        cmdhash_clear(&kai_ctx->cmdhash);
+        i++;
+    }
+
+    // Pre-warm the table with the remaining names
+    for (; i < cmd->argc; i++)
+    {
+        if (!cmdhash_lookup(&kai_ctx->cmdhash, cmd->argv[i], vars_get(&kai_ctx->vars, "PATH")))
         {
             result->status = -1;
-            result->err_msg = ERR_NUM_ARG_REQ;
+            result->err_msg = ERR_NOT_FOUND;
 
             return -1;
         }
     }
 
-    kai_ctx->exit_code = ecode;
-    kai_ctx->running = false;
+    result->status = 1;
+    result->err_msg = NULL;
 
-    result->status = 0;
+    return 1;
+}
+
+int jobs(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    job_table_t *table = &kai_ctx->jobs;
+    job_t *job;
+    char mark;
+    size_t i;
+
+    if (cmd->argc > 1)
+    {
+        result->status = -1;
+        result->err_msg = ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+
+    job_table_poll(table);
+
+    for (i = 0; i < table->count;)
+    {
+        job = table->jobs[i];
+
+        if (i == table->count - 1)
+            mark = '+';
+        else if (i == table->count - 2)
+            mark = '-';
+        else
+            mark = ' ';
+
+        printf("[%d]%c %s\t%s\n", job->id, mark, job_state_str(job), job->cmdline);
+
+        // Finished jobs have been reported now
+        if (job->state == JOB_DONE)
+            job_table_remove(table, job);
+        else
+            i++;
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int fg(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    job_table_t *table = &kai_ctx->jobs;
+    job_t *job;
+
+    if (cmd->argc > 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+    if (!table->job_control)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NO_JOB_CONTROL;
+
+        return -1;
+    }
+
+    job = job_table_find(table, (cmd->argc == 2) ? cmd->argv[1] : NULL);
+    if (!job)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NO_SUCH_JOB;
+
+        return -1;
+    }
+
+    puts(job->cmdline);
+    fflush(stdout);
+
+    if (job_foreground(table, job, true) < 0)
+    {
+        result->status = -1;
+        result->err_msg = strerror(errno);
+
+        return -1;
+    }
+
+    result->exit_status = job_exit_status(job);
+    if (job->state == JOB_DONE)
+        job_table_remove(table, job);
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int bg(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    job_table_t *table = &kai_ctx->jobs;
+    job_t *job;
+
+    if (cmd->argc > 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+    if (!table->job_control)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NO_JOB_CONTROL;
+
+        return -1;
+    }
+
+    job = job_table_find(table, (cmd->argc == 2) ? cmd->argv[1] : NULL);
+    if (!job)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NO_SUCH_JOB;
+
+        return -1;
+    }
+
+    if (job_background(table, job) < 0)
+    {
+        result->status = -1;
+        result->err_msg = strerror(errno);
+
+        return -1;
+    }
+
+    printf("[%d] %s &\n", job->id, job->cmdline);
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int b_wait(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    job_table_t *table = &kai_ctx->jobs;
+    job_t *job;
+    char *endptr;
+    int status;
+    size_t i;
+
+    if (cmd->argc == 1)
+    {
+        // Stopped jobs would never finish, skip them
+        for (i = 0; i < table->count;)
+        {
+            job = table->jobs[i];
+
+            if (job->state == JOB_RUNNING && job_wait(table, job) < 0)
+            {
+                result->status = -1;
+                result->err_msg = strerror(errno);
+
+                return -1;
+            }
+
+            if (job->state == JOB_DONE)
+                job_table_remove(table, job);
+            else
+                i++;
+        }
+        job_table_forget(table);
+
+        result->exit_status = 0;
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
+    }
+
+    for (i = 1; i < cmd->argc; i++)
+    {
+        if (cmd->argv[i][0] == '%')
+            job = job_table_find(table, cmd->argv[i]);
+        else
+            job = job_table_find_pid(table, strtol(cmd->argv[i], &endptr, 10));
+
+        // Finished jobs that were already reported still have a status
+        if (!job)
+        {
+            if ((status = job_table_claim(table, cmd->argv[i])) < 0)
+            {
+                result->status = -1;
+                result->err_msg = ERR_NO_SUCH_JOB;
+
+                return -1;
+            }
+
+            result->exit_status = status;
+            continue;
+        }
+
+        if (job_wait(table, job) < 0)
+        {
+            result->status = -1;
+            result->err_msg = strerror(errno);
+
+            return -1;
+        }
+
+        result->exit_status = job_exit_status(job);
+        if (job->state == JOB_DONE)
+            job_table_remove(table, job);
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int b_kill(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    job_t *job;
+    int sig = SIGTERM;
+    pid_t pid;
+    char *endptr;
+    size_t i, j;
+
+    i = 1;
+    if (cmd->argc > 1 && cmd->argv[1][0] == '-')
+    {
+        sig = parse_signal(cmd->argv[1] + 1);
+        if (sig < 0)
+        {
+            result->status = -1;
+            result->err_msg = ERR_BAD_SIGNAL;
+
+            return -1;
+        }
+        i++;
+    }
+
+    if (i >= cmd->argc)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NOT_ENOUGH_ARGS;
+
+        return -1;
+    }
+
+    for (; i < cmd->argc; i++)
+    {
+        if (cmd->argv[i][0] == '%')
+        {
+            job = job_table_find(&kai_ctx->jobs, cmd->argv[i]);
+            if (!job)
+            {
+                result->status = -1;
+                result->err_msg = ERR_NO_SUCH_JOB;
+
+                return -1;
+            }
+
+            // Jobs without their own group are signalled one by one
+            if (job->pgid > 0)
+            {
+                kill(-job->pgid, sig);
+            }
+            else
+            {
+                for (j = 0; j < job->nprocs; j++)
+                {
+                    if (!job->procs[j].done)
+                        kill(job->procs[j].pid, sig);
+                }
+            }
+
+            continue;
+        }
+
+        pid = strtol(cmd->argv[i], &endptr, 10);
+        if (*endptr != '\0' || endptr == cmd->argv[i])
+        {
+            result->status = -1;
+            result->err_msg = ERR_BAD_TARGET;
+
+            return -1;
+        }
+
+        if (kill(pid, sig) < 0)
+        {
+            result->status = -1;
+            result->err_msg = strerror(errno);
+
+            return -1;
+        }
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int parse_signal(const char *name)
+{
+    const char *abbrev;
+    char *endptr;
+    long sig;
+
+    sig = strtol(name, &endptr, 10);
+    if (*name != '\0' && *endptr == '\0')
+        return (sig > 0 && sig < NSIG) ? sig : -1;
+
+    if (strncasecmp(name, "SIG", 3) == 0)
+        name += 3;
+
+    for (sig = 1; sig < NSIG; sig++)
+    {
+        abbrev = sigabbrev_np(sig);
+        if (abbrev && strcasecmp(abbrev, name) == 0)
+            return sig;
+    }
+
+    return -1;
+}
+
+static int b_exit(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    int ecode;
+    char *endptr;
+
+    if (cmd->argc > 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+
+    if (cmd->argc == 1)
+    {
+        ecode = kai_ctx->exit_code = 0;
+    }
+    else
+    {
+        ecode = strtol(cmd->argv[1], &endptr, 10);
+        if (*endptr != '\0')
+        {
+            result->status = -1;
+            result->err_msg = ERR_NUM_ARG_REQ;
+
+            return -1;
+        }
+    }
+
+    kai_ctx->exit_code = ecode;
+    kai_ctx->running = false;
+
+    result->status = 0;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+/*
+ * Loads builtins from a shared object, see kai_plugin.h. Builtins with a
+ * name that is already taken are skipped.
+ */
+int enable(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    const kai_builtin_t *builtin;
+    bhash_entry_t *entry;
+    plugin_t *plugin;
+    size_t iter, i;
+    int status = 0;
+
+    if (cmd->argc == 1)
+    {
+        iter = 0;
+        while ((entry = bhash_next(&kai_ctx->builtins, &iter)))
+        {
+            if (entry->plugin)
+                printf("%s\t%s\n", entry->builtin->name, entry->plugin->path);
+            else
+                printf("%s\n", entry->builtin->name);
+        }
+
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
+    }
+
+    if (cmd->argc < 3 || strcmp(cmd->argv[1], "-f") != 0)
+    {
+        result->status = -1;
+        result->err_msg = ERR_ENABLE_USAGE;
+
+        return -1;
+    }
+
+    plugin = plugin_load(cmd->argv[2], &result->err_msg);
+    if (!plugin)
+    {
+        result->status = -1;
+        return -1;
+    }
+
+    for (builtin = plugin->desc->builtins; builtin->name; builtin++)
+    {
+        // Without names everything the plugin has is enabled
+        for (i = 3; i < cmd->argc && strcmp(cmd->argv[i], builtin->name) != 0; i++)
+            ;
+        if (cmd->argc > 3 && i == cmd->argc)
+            continue;
+
+        if (bhash_add(&kai_ctx->builtins, builtin, plugin) < 0)
+        {
+            fprintf(stderr, "enable: %s: %s\n", builtin->name, (errno == EEXIST) ? ERR_EXISTS : strerror(errno));
+            status = 1;
+        }
+    }
+
+    for (i = 3; i < cmd->argc; i++)
+    {
+        for (builtin = plugin->desc->builtins; builtin->name && strcmp(cmd->argv[i], builtin->name) != 0; builtin++)
+            ;
+
+        if (!builtin->name)
+        {
+            fprintf(stderr, "enable: %s: %s\n", cmd->argv[i], ERR_NOT_IN_PLUGIN);
+            status = 1;
+        }
+    }
+
+    // Nothing was taken from it
+    if (plugin->refs == 0)
+        plugin_release(plugin);
+
+    result->status = 1;
+    result->err_msg = NULL;
+    result->exit_status = status;
+
+    return 1;
+}
+
+// Removes builtins added by 'enable', a plugin is unloaded with its last one
+int disable(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    const bhash_entry_t *entry;
+    int status = 0;
+    size_t i;
+
+    if (cmd->argc < 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NOT_ENOUGH_ARGS;
+
+        return -1;
+    }
+
+    for (i = 1; i < cmd->argc; i++)
+    {
+        entry = bhash_lookup(&kai_ctx->builtins, cmd->argv[i]);
+        if (!entry || !entry->plugin)
+        {
+            fprintf(stderr, "disable: %s: %s\n", cmd->argv[i], (entry) ? ERR_NOT_LOADED : ERR_NO_SUCH_BUILTIN);
+            status = 1;
+            continue;
+        }
+
+        bhash_remove(&kai_ctx->builtins, cmd->argv[i]);
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+    result->exit_status = status;
+
+    return 1;
+}
+
+// Prints the command line after the optimizer went over it
+int explain(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    list_node_t *root;
+    int ret;
+
+    if (cmd->argc != 2)
+    {
+        result->status = -1;
+        result->err_msg = (cmd->argc < 2) ? ERR_NOT_ENOUGH_ARGS : ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+
+    // Goes away together with the line explain is on
+    ret = parse_command_list(&root, cmd->argv[1], &kai_ctx->arena, NULL);
+    if (ret < 0)
+    {
+        result->status = -1;
+        result->err_msg = (ret == PARSER_RET_MEM) ? strerror(ENOMEM) : ERR_SYNTAX;
+
+        return -1;
+    }
+
+    if (ret != PARSER_RET_EMPTY)
+    {
+        if (kai_ctx->optimize)
+            optimize_node(root);
+
+        optimize_print(root);
+        putchar('\n');
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+void optimize_node(list_node_t *node)
+{
+    if (node->op == LIST_PIPELINE)
+    {
+        optimize_pipeline(&node->pipeline);
+        return;
+    }
+
+    optimize_node(node->left);
+    optimize_node(node->right);
+}
+
+int optimize(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    if (cmd->argc > 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+
+    if (cmd->argc == 1)
+    {
+        puts((kai_ctx->optimize) ? "on" : "off");
+    }
+    else if (strcmp(cmd->argv[1], "on") == 0 || strcmp(cmd->argv[1], "off") == 0)
+    {
+        kai_ctx->optimize = cmd->argv[1][1] == 'n';
+    }
+    else
+    {
+        result->status = -1;
+        result->err_msg = ERR_ON_OFF;
+
+        return -1;
+    }
+
+    result->status = 1;
+    result->err_msg = NULL;
+
+    return 1;
+}
+
+int pipesize(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    const char *end;
+    size_t size;
+    int probe[2];
+
+    if (cmd->argc > 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_TOO_MANY_ARGS;
+
+        return -1;
+    }
+
+    if (cmd->argc == 1)
+    {
+        if (kai_ctx->pipe_size)
+            printf("%zu\n", kai_ctx->pipe_size);
+        else
+            puts("default");
+
+        result->status = 1;
+        result->err_msg = NULL;
+
+        return 1;
+    }
+
+    end = parse_size(cmd->argv[1], &size);
+    if (!end || *end != '\0' || size > INT_MAX)
+    {
+        result->status = -1;
+        result->err_msg = ERR_BAD_SIZE;
+
+        return -1;
+    }
+
+    // Find out now rather than with every pipeline whether the kernel takes it
+    if (size > 0)
+    {
+        if (pipe2(probe, O_CLOEXEC) < 0)
+        {
+            result->status = -1;
+            result->err_msg = strerror(errno);
+
+            return -1;
+        }
+
+        if (fcntl(probe[1], F_SETPIPE_SZ, (int)size) < 0)
+        {
+            result->status = -1;
+            result->err_msg = (errno == EPERM) ? ERR_PIPE_MAX : strerror(errno);
+
+            close(probe[0]);
+            close(probe[1]);
+            return -1;
+        }
+
+        close(probe[0]);
+        close(probe[1]);
+    }
+
+    kai_ctx->pipe_size = size;
+
+    result->status = 1;
     result->err_msg = NULL;
 
     return 1;
 }
 
-int help(command_t *cmd, eval_res_t *result)
+int help(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
     puts(HELP_MSG);
 
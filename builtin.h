@@ -1,10 +1,24 @@
 #ifndef BUILTIN_H
 #define BUILTIN_H
 
+#include <stdbool.h>
+
 #include "parser.h"
 #include "eval.h"
 #include "kai.h"
+#include "task.h"
+#include "spawn.h"
+
+int builtin_init(kai_ctx_t *kai_ctx);
 
 int eval_builtin(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
 
+int builtin_stage(command_t *cmd, int infd, int outfd, task_t *prev, bool next_reads, task_t **task,
+                  kai_ctx_t *kai_ctx);
+
+bool builtin_reads_input(command_t *cmd, kai_ctx_t *kai_ctx);
+
+int builtin_fork(spawn_handle_t *stage, command_t *cmd, int infd, int outfd, const spawn_attr_t *sattr,
+                 kai_ctx_t *kai_ctx);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "cmdhash.h"
+
+#define INITIAL_CAPACITY 64
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+void cmdhash_init(cmdhash_t *hash)
+{
+    htab_init(&hash->tab, sizeof(cmdhash_entry_t), INITIAL_CAPACITY);
+}
+
+void cmdhash_free(cmdhash_t *hash)
+{
+    cmdhash_clear(hash);
+    htab_free(&hash->tab);
+}
+
+void cmdhash_clear(cmdhash_t *hash)
+{
+    cmdhash_entry_t *entry;
+    size_t iter = 0;
+
+    while ((entry = htab_next(&hash->tab, &iter)))
+    {
+        free((char *)entry->key.name);
+        free(entry->path);
+    }
+
+    htab_clear(&hash->tab);
+}
+
+// Searches dirs, a PATH value, for names that aren't cached yet
+const char *cmdhash_lookup(cmdhash_t *hash, const char *name, const char *dirs)
+{
+    size_t len = strlen(name);
+    cmdhash_entry_t *entry;
+    char *path, *key;
+
+    // Paths are never looked up
+    if (strchr(name, '/'))
+        return name;
+
+    entry = htab_find(&hash->tab, name, len);
+    if (entry)
+    {
+        entry->hits++;
+        return entry->path;
+    }
+
+    path = cmdhash_search(name, dirs);
+    if (!path)
+        return NULL;
+
+    key = strdup(name);
+    entry = (key) ? htab_insert(&hash->tab, key, len) : NULL;
+    if (!entry)
+    {
+        free(key);
+        free(path);
+        return NULL;
+    }
+
+    entry->path = path;
+    entry->hits = 1;
+
+    return path;
+}
+
+void cmdhash_forget(cmdhash_t *hash, const char *name)
+{
+    cmdhash_entry_t *entry;
+
+    entry = htab_find(&hash->tab, name, strlen(name));
+    if (!entry)
+        return;
+
+    free((char *)entry->key.name);
+    free(entry->path);
+
+    htab_remove(&hash->tab, entry);
+}
+
+cmdhash_entry_t *cmdhash_next(cmdhash_t *hash, size_t *iter)
+{
+    return htab_next(&hash->tab, iter);
+}
+
+// Looks name up in dirs without touching the cache, the path returned is malloc'd
+char *cmdhash_search(const char *name, const char *dirs)
+{
+    const char *end;
+    char path[PATH_MAX];
+    size_t dlen, nlen;
+    struct stat st;
+
+    if (!dirs)
+        dirs = DEFAULT_PATH;
+
+    nlen = strlen(name);
+
+    for (; *dirs; dirs = (*end) ? end + 1 : end)
+    {
+        end = strchrnul(dirs, ':');
+        dlen = end - dirs;
+
+        if (dlen + nlen + 2 > sizeof(path))
+            continue;
+
+        // Empty entry means current directory
+        if (dlen == 0)
+        {
+            path[0] = '.';
+            dlen = 1;
+        }
+        else
+        {
+            memcpy(path, dirs, dlen);
+        }
+        path[dlen] = '/';
+        memcpy(path + dlen + 1, name, nlen + 1);
+
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+            return strdup(path);
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
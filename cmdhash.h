@@ -0,0 +1,34 @@
+#ifndef CMDHASH_H
+#define CMDHASH_H
+
+#include <stddef.h>
+
+#include "htab.h"
+
+typedef struct cmdhash_entry
+{
+    htab_key_t key; // Name of the command, malloc'd
+    char *path;
+    size_t hits;
+} cmdhash_entry_t;
+
+typedef struct cmdhash
+{
+    htab_t tab;
+} cmdhash_t;
+
+void cmdhash_init(cmdhash_t *hash);
+
+void cmdhash_free(cmdhash_t *hash);
+
+void cmdhash_clear(cmdhash_t *hash);
+
+const char *cmdhash_lookup(cmdhash_t *hash, const char *name, const char *dirs);
+
+void cmdhash_forget(cmdhash_t *hash, const char *name);
+
+cmdhash_entry_t *cmdhash_next(cmdhash_t *hash, size_t *iter);
+
+char *cmdhash_search(const char *name, const char *dirs);
+
+#endif
@@ -4,320 +4,916 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <stdio.h>
 
 #include "eval.h"
 #include "parser.h"
 #include "builtin.h"
+#include "spawn.h"
+#include "optimize.h"
+#include "heredoc.h"
+#include "expand.h"
 #include "kai.h"
 
+#define INITIAL_MORE_LEN 4096
+
 static const char ERR_REDIR_FILE[] = "Failed to open file for redirection";
 static const char ERR_SYNTAX[] = "Invalid syntax";
-
-static void exec(command_list_t *cmds, eval_res_t *result);
-static int exec_single(command_t *cmd, int infd, int outfd, bool bg);
-static int exec_multi(command_list_t *cmds);
-
+static const char ERR_TIME_NO_CMD[] = "Nothing to time";
+static const char ERR_PIPE_SIZE[] = "Failed to set pipe size";
+static const char ERR_HEREDOC_EOF[] = "Heredoc not terminated before end of input";
+static const char ERR_EMPTY_STAGE[] = "Command substitution left a pipeline stage empty";
+
+static char err_buf[256];
+
+static int wait_more(const char *input, const parse_more_t *more, kai_ctx_t *kai_ctx);
+static int append_more(const char *line, kai_ctx_t *kai_ctx);
+static bool ends_more(const char *line, kai_ctx_t *kai_ctx);
+static void drop_more(kai_ctx_t *kai_ctx);
+static void eval_pipeline(command_list_t *cmds, eval_res_t *result, kai_ctx_t *kai_ctx);
+static void exec(command_list_t *cmds, const char *cmdline, bool timed, eval_res_t *result, kai_ctx_t *kai_ctx);
+static int exec_pipeline(command_list_t *cmds, job_t *job, bool bg, size_t *failed, kai_ctx_t *kai_ctx);
+static int open_redirs(const command_t *cmd, int fds[2]);
+static int start_fanout(command_t *cmd, int outfd, size_t pipe_size, int *stage_outfd, job_t *job);
+static int set_pipe_size(int fd, size_t size);
+static int start_stage(spawn_handle_t *stage, command_t *cmd, int infd, int outfd, const spawn_attr_t *sattr,
+                       kai_ctx_t *kai_ctx);
+static void set_status(int status, job_t *job, kai_ctx_t *kai_ctx);
+static void report_times(command_list_t *cmds, job_t *job);
+static double tv_secs(const struct timeval *tv);
+static double ts_diff(const struct timespec *start, const struct timespec *end);
+
+/*
+ * Runs a line of input. A line that opens a heredoc gives EVAL_STATUS_MORE,
+ * the lines after it are then only collected, and parsed together with it
+ * once one of them ends the body.
+ */
 void eval(eval_res_t *result, const char *input, kai_ctx_t *kai_ctx)
 {
-    command_list_t cmds;
+    list_node_t *root;
+    parse_more_t more;
     int ret;
 
-    ret = parse_command_list(&cmds, input);
+    if (kai_ctx->more.delim)
+    {
+        if (append_more(input, kai_ctx) < 0)
+        {
+            drop_more(kai_ctx);
+
+            result->status = EVAL_STATUS_FAIL;
+            result->err_msg = strerror(ENOMEM);
+            return;
+        }
+
+        if (!ends_more(input, kai_ctx))
+        {
+            result->status = EVAL_STATUS_MORE;
+            result->err_msg = NULL;
+            return;
+        }
+
+        input = kai_ctx->more.text;
+    }
+
+    ret = parse_command_list(&root, input, &kai_ctx->arena, &more);
+    if (ret == PARSER_RET_MORE)
+    {
+        ret = wait_more(input, &more, kai_ctx);
+        if (ret == 0)
+        {
+            result->status = EVAL_STATUS_MORE;
+            result->err_msg = NULL;
+            goto end;
+        }
+
+        ret = PARSER_RET_MEM;
+    }
+
+    // The tree has its own copy of everything
+    drop_more(kai_ctx);
+
     if (ret < 0)
     {
         result->status = EVAL_STATUS_FAIL;
-        result->err_msg = ERR_SYNTAX;
-        return;
+        result->err_msg = (ret == PARSER_RET_MEM) ? strerror(ENOMEM) : ERR_SYNTAX;
+        set_status(2, NULL, kai_ctx);
+        goto end;
     }
     if (ret == 0)
     {
         result->status = EVAL_STATUS_NO_EXEC;
         result->err_msg = NULL;
-        return;
+        goto end;
     }
 
-    if (cmds.count == 1)
+    eval_node(root, result, kai_ctx);
+
+end:
+    // Everything the parser produced lives in the arena
+    arena_reset(&kai_ctx->arena);
+}
+
+/*
+ * Called at the end of input or when the user gives up on it. A command
+ * still waiting for lines fails like one with a syntax error.
+ */
+void eval_end(eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    result->status = EVAL_STATUS_NO_EXEC;
+    result->err_msg = NULL;
+
+    if (kai_ctx->more.delim)
     {
-        ret = eval_builtin(&cmds.commands[0], result, kai_ctx);
-        if (ret != 0)
-            goto end;
+        result->status = EVAL_STATUS_FAIL;
+        result->err_msg = ERR_HEREDOC_EOF;
+        set_status(2, NULL, kai_ctx);
     }
 
-    exec(&cmds, result);
+    drop_more(kai_ctx);
+}
 
-end:
-    free_command_list(&cmds);
+// Keeps the input around until the line more names shows up
+int wait_more(const char *input, const parse_more_t *more, kai_ctx_t *kai_ctx)
+{
+    char *delim;
+
+    delim = strdup(more->delim);
+    if (!delim)
+        return -1;
+
+    free(kai_ctx->more.delim);
+    kai_ctx->more.delim = delim;
+    kai_ctx->more.strip_tabs = more->strip_tabs;
+
+    if (input != kai_ctx->more.text)
+    {
+        kai_ctx->more.len = 0;
+        if (append_more(input, kai_ctx) < 0)
+            return -1;
+    }
+
+    return 0;
 }
 
-void exec(command_list_t *cmds, eval_res_t *result)
+int append_more(const char *line, kai_ctx_t *kai_ctx)
 {
-    int outfd, infd;
+    size_t len = strlen(line);
+    size_t new_cap;
+    char *new_text;
+
+    // Line break and '\0'
+    if (kai_ctx->more.cap - kai_ctx->more.len < len + 2)
+    {
+        new_cap = (kai_ctx->more.cap) ? kai_ctx->more.cap : INITIAL_MORE_LEN;
+        while (new_cap - kai_ctx->more.len < len + 2)
+            new_cap *= 2;
 
-    pid_t pid;
-    command_t *cmd;
+        new_text = realloc(kai_ctx->more.text, new_cap);
+        if (!new_text)
+            return -1;
 
-    int ret;
+        kai_ctx->more.text = new_text;
+        kai_ctx->more.cap = new_cap;
+    }
 
-    result->bg_pid = -1;
-    result->err_msg = NULL;
+    memcpy(kai_ctx->more.text + kai_ctx->more.len, line, len);
+    kai_ctx->more.len += len;
+    kai_ctx->more.text[kai_ctx->more.len++] = '\n';
+    kai_ctx->more.text[kai_ctx->more.len] = '\0';
 
-    if (cmds->count == 1)
+    return 0;
+}
+
+// Only a line that ends the body can make the input complete
+bool ends_more(const char *line, kai_ctx_t *kai_ctx)
+{
+    while (kai_ctx->more.strip_tabs && *line == '\t')
+        line++;
+
+    return strcmp(line, kai_ctx->more.delim) == 0;
+}
+
+void drop_more(kai_ctx_t *kai_ctx)
+{
+    free(kai_ctx->more.text);
+    free(kai_ctx->more.delim);
+
+    kai_ctx->more.text = NULL;
+    kai_ctx->more.delim = NULL;
+    kai_ctx->more.len = 0;
+    kai_ctx->more.cap = 0;
+}
+
+/*
+ * Walks a command list, '&&' and '||' decide on the exit status the left
+ * side left behind. Only the outcome of the last pipeline run is handed back
+ * in result, errors of earlier ones are reported on the spot.
+ */
+void eval_node(list_node_t *node, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    while (node->op != LIST_PIPELINE)
     {
-        outfd = STDOUT_FILENO;
-        infd = STDIN_FILENO;
+        eval_node(node->left, result, kai_ctx);
 
-        cmd = &cmds->commands[0];
+        if (node->op != LIST_SEQ && (node->op == LIST_AND) != (kai_ctx->last_status == 0))
+            return; // Short-circuit
 
-        if (cmd->output_file)
-        {
-            outfd = open(cmd->output_file, O_CREAT | O_WRONLY, 0664);
-            if (outfd < 0)
-            {
-                result->status = EVAL_STATUS_FAIL;
-                result->err_msg = ERR_REDIR_FILE;
-                return;
-            }
-        }
-        if (cmd->input_file)
-        {
-            infd = open(cmd->input_file, O_RDONLY);
-            if (infd < 0)
-            {
-                result->status = EVAL_STATUS_FAIL;
-                result->err_msg = ERR_REDIR_FILE;
-                return;
-            }
-        }
+        if (!kai_ctx->running)
+            return; // exit was called
 
-        pid = exec_single(cmd, infd, outfd, cmd->in_bg);
-        if (pid < 0)
-        {
-            result->status = EVAL_STATUS_FAIL;
-            result->err_msg = strerror(errno);
+        if (result->status == EVAL_STATUS_FAIL)
+            fprintf(stderr, "[!] Error: %s\n", result->err_msg);
+
+        node = node->right;
+    }
+
+    eval_pipeline(&node->pipeline, result, kai_ctx);
+}
+
+void eval_pipeline(command_list_t *cmds, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    pathglob_cache_t cache;
+    command_t *first;
+    bool timed;
+    size_t i;
+    int ret;
 
-            if (infd != STDIN_FILENO)
-                close(infd);
-            if (outfd != STDOUT_FILENO)
-                close(outfd);
+    // Stages of a pipeline share directory reads, a later pipeline may see changes
+    pathglob_cache_init(&cache, &kai_ctx->arena);
 
+    // Substitutions run first, in order, the optimizer only sees their output
+    for (i = 0; i < cmds->count; i++)
+    {
+        if (cmds->commands[i].nexpansions == 0)
+            continue;
+
+        if (expand_command(&cmds->commands[i], &cache, result, kai_ctx) < 0)
+        {
+            set_status((kai_ctx->last_status != 0) ? kai_ctx->last_status : 1, NULL, kai_ctx);
             return;
         }
 
-        result->bg_pid = (cmd->in_bg) ? pid : 0;
-        result->status = EVAL_STATUS_OK;
+        if (cmds->commands[i].argc > 0)
+            continue;
 
-        if (infd != STDIN_FILENO)
-            close(infd);
-        if (outfd != STDOUT_FILENO)
-            close(outfd);
+        // Nothing left to run, only the status of the substitution is kept
+        if (cmds->count == 1)
+        {
+            result->status = EVAL_STATUS_NO_EXEC;
+            result->err_msg = NULL;
+            set_status(kai_ctx->last_status, NULL, kai_ctx);
+            return;
+        }
 
+        result->status = EVAL_STATUS_FAIL;
+        result->err_msg = ERR_EMPTY_STAGE;
+        set_status(1, NULL, kai_ctx);
         return;
     }
 
-    ret = exec_multi(cmds);
-    if (ret == 0)
+    // 'time' prefix reports resource usage of the pipeline once it's done
+    first = &cmds->commands[0];
+    timed = strcmp(first->argv[0], "time") == 0;
+    if (timed)
     {
-        result->status = EVAL_STATUS_OK;
-        return;
+        if (first->argc == 1)
+        {
+            result->status = EVAL_STATUS_FAIL;
+            result->err_msg = ERR_TIME_NO_CMD;
+            set_status(1, NULL, kai_ctx);
+            return;
+        }
+
+        memmove(first->argv, first->argv + 1, first->argc * sizeof(char *)); // Includes NULL
+        first->argc--;
     }
 
-    result->status = EVAL_STATUS_FAIL;
-    if (ret == -2)
-        result->err_msg = ERR_REDIR_FILE;
-    else
-        result->err_msg = strerror(errno);
+    if (kai_ctx->optimize)
+        optimize_pipeline(cmds);
+
+    // Timing needs a process to take resource usage from, fan-out a pipeline stage
+    if (cmds->count == 1 && !cmds->piped && !timed && first->tee_count == 0)
+    {
+        ret = eval_builtin(first, result, kai_ctx);
 
-    return;
+        // Output of later commands mustn't overtake what the builtin printed
+        fflush(stdout);
+
+        if (ret != 0)
+        {
+            if (result->status < 0 && result->exit_status == 0)
+                result->exit_status = 1;
+
+            set_status(result->exit_status, NULL, kai_ctx);
+            return;
+        }
+    }
+
+    exec(cmds, cmds->text, timed, result, kai_ctx);
 }
 
-int exec_single(command_t *cmd, int infd, int outfd, bool bg)
+void exec(command_list_t *cmds, const char *cmdline, bool timed, eval_res_t *result, kai_ctx_t *kai_ctx)
 {
-    pid_t fpid;
-    int exec_errno;
-    int pipefd[2];
+    job_table_t *jobs = &kai_ctx->jobs;
+    job_t *job;
+    bool bg;
+    size_t failed = 0;
+    size_t i;
 
-    int ret;
+    int ret, err;
 
-    if (pipe2(pipefd, O_CLOEXEC) < 0)
-        return -1;
+    result->bg_pid = -1;
+    result->err_msg = NULL;
+
+    // Ampersand at the end puts the whole pipeline in background
+    bg = cmds->commands[cmds->count - 1].in_bg;
 
-    fpid = fork();
-    if (fpid < 0)
+    job = job_table_add(jobs, cmdline, cmds->count);
+    if (!job)
     {
-        return -1;
+        result->status = EVAL_STATUS_FAIL;
+        result->err_msg = strerror(errno);
+        return;
     }
-    else if (fpid == 0)
+
+    ret = exec_pipeline(cmds, job, bg, &failed, kai_ctx);
+    err = errno;
+    if (ret < 0)
     {
-        // Close reading end of pipe on child
-        close(pipefd[0]);
+        // A failed stage might have taken the terminal already
+        if (jobs->job_control && !bg)
+            tcsetpgrp(jobs->tty_fd, jobs->shell_pgid);
+
+        job_table_remove(jobs, job);
+
+        // Same codes as other shells for commands that couldn't be run, 1 for anything else
+        if (ret == -3)
+            set_status((err == ENOENT) ? 127 : 126, NULL, kai_ctx);
+        else
+            set_status(1, NULL, kai_ctx);
 
-        if (dup2(outfd, STDOUT_FILENO) < 0)
+        result->status = EVAL_STATUS_FAIL;
+        if (ret == -2)
         {
-            close(outfd);
-            goto error;
+            result->err_msg = ERR_REDIR_FILE;
         }
-        if (dup2(infd, STDIN_FILENO) < 0)
+        else if (ret == -4)
         {
-            close(infd);
-            goto error;
+            snprintf(err_buf, sizeof(err_buf), "%s: %s", ERR_PIPE_SIZE, strerror(err));
+            result->err_msg = err_buf;
+        }
+        else if (ret == -3 && cmds->count > 1)
+        {
+            snprintf(err_buf, sizeof(err_buf), "Pipeline stage %zu (%s): %s",
+                     failed + 1, cmds->commands[failed].argv[0], strerror(err));
+            result->err_msg = err_buf;
+        }
+        else
+        {
+            result->err_msg = strerror(err);
         }
 
-        if (outfd != STDOUT_FILENO)
-            close(outfd);
-        if (infd != STDIN_FILENO)
-            close(infd);
-
-        execvp(cmd->argv[0], cmd->argv);
-
-    error:
-        ret = write(pipefd[1], &errno, sizeof(errno));
-        close(pipefd[1]);
-        exit(-1);
+        return;
     }
 
-    // Close writing end of pipe on parent
-    close(pipefd[1]);
+    result->status = EVAL_STATUS_OK;
 
-    ret = read(pipefd[0], &exec_errno, sizeof(exec_errno));
-    if (ret < 0)
-        return -1;
-    else if (ret == 0)
-        exec_errno = 0;
+    if (bg)
+    {
+        job_watch(jobs, job);
 
-    close(pipefd[0]);
+        // In-process stages have no pid to show
+        result->bg_pid = -1;
+        for (i = 0; i < job->nprocs && result->bg_pid <= 0; i++)
+            result->bg_pid = job->procs[i].pid;
 
-    if (!bg)
-    {
-        ret = waitpid(fpid, NULL, 0);
-        if (ret < 0)
-            return -1;
+        set_status(0, NULL, kai_ctx);
+
+        return;
     }
 
-    if (exec_errno != 0)
+    if (job_foreground(jobs, job, false) < 0)
     {
-        errno = exec_errno;
-        return -1;
+        result->status = EVAL_STATUS_FAIL;
+        result->err_msg = strerror(errno);
     }
 
-    return fpid;
+    set_status(job_exit_status(job), job, kai_ctx);
+    kai_ctx->interrupted |= job->interrupted;
+
+    if (timed && job->state == JOB_DONE)
+        report_times(cmds, job);
+
+    // Stopped jobs stay around for fg/bg, the main loop announces them
+    if (job->state == JOB_DONE)
+        job_table_remove(jobs, job);
+    else
+        job_watch(jobs, job);
+
+    result->bg_pid = 0;
 }
 
-int exec_multi(command_list_t *cmds)
+int exec_pipeline(command_list_t *cmds, job_t *job, bool bg, size_t *failed, kai_ctx_t *kai_ctx)
 {
-    int pipes[2];
+    job_table_t *jobs = &kai_ctx->jobs;
+    spawn_handle_t *stages;
+    task_t **tasks;
+    spawn_attr_t sattr;
+    int *pipes = NULL;
+    int *redir_fds; // Each stage's own input and output files, -1 where it has none
     int infd, outfd;
-    int in_file_fd = -1, out_file_fd = -1;
+    int fanout_fd;
+    bool fanned = false; // The stage before fans out, its copies only move on in the scheduler
+    task_t *prev;
+    bool forked;
+    size_t pipe_size;
     size_t i;
 
-    int ret;
-    size_t spawned = 0;
+    int ret = 0;
+    int stage_ret;
+    int err = 0;
+    size_t started = 0;
 
-    if (cmds->count < 2)
+    stages = malloc(cmds->count * sizeof(spawn_handle_t));
+    tasks = calloc(cmds->count, sizeof(task_t *));
+    redir_fds = malloc(cmds->count * 2 * sizeof(int));
+    if (!stages || !tasks || !redir_fds)
+    {
+        free(stages);
+        free(tasks);
+        free(redir_fds);
         return -1;
+    }
 
-    if (cmds->commands[0].input_file)
-    {
-        in_file_fd = open(cmds->commands[0].input_file, O_RDONLY);
-        if (in_file_fd < 0)
-            return -2;
+    for (i = 0; i < cmds->count * 2; i++)
+        redir_fds[i] = -1;
 
-        infd = in_file_fd;
+    if (cmds->count > 1)
+    {
+        pipes = malloc((cmds->count - 1) * 2 * sizeof(int));
+        if (!pipes)
+        {
+            free(stages);
+            free(tasks);
+            free(redir_fds);
+            return -1;
+        }
     }
-    else
+
+    // A stage's own redirections take the place of the pipes around it, like in sh
+    for (i = 0; i < cmds->count; i++)
     {
-        infd = STDIN_FILENO;
+        ret = open_redirs(&cmds->commands[i], &redir_fds[i * 2]);
+        if (ret < 0)
+        {
+            if (ret == -1)
+                err = errno;
+            goto end;
+        }
     }
-    if (cmds->commands[cmds->count - 1].output_file)
+
+    // Set up all pipes first so every stage can be started back to back
+    for (i = 0; i < cmds->count - 1; i++)
     {
-        out_file_fd = open(cmds->commands[cmds->count - 1].output_file, O_CREAT | O_WRONLY, 0664);
-        if (out_file_fd < 0)
+        if (pipe2(&pipes[i * 2], O_CLOEXEC) < 0)
         {
-            if (in_file_fd > 0)
-                close(in_file_fd);
+            err = errno;
 
-            return -2;
+            while (i-- > 0)
+            {
+                close(pipes[i * 2]);
+                close(pipes[i * 2 + 1]);
+            }
+
+            ret = -1;
+            goto end;
         }
+    }
 
-        outfd = out_file_fd;
+    for (i = 0; i < cmds->count - 1; i++)
+    {
+        pipe_size = (cmds->commands[i].pipe_size) ? cmds->commands[i].pipe_size : kai_ctx->pipe_size;
+        if (set_pipe_size(pipes[i * 2 + 1], pipe_size) < 0)
+        {
+            err = errno;
+            ret = -4;
+            break;
+        }
     }
-    else
+    if (ret < 0)
     {
-        outfd = STDOUT_FILENO;
+        for (i = 0; i < cmds->count - 1; i++)
+        {
+            close(pipes[i * 2]);
+            close(pipes[i * 2 + 1]);
+        }
+
+        goto end;
     }
 
-    for (i = 0; i < cmds->count - 1; i++)
+    for (i = 0; i < cmds->count; i++)
     {
-        if (pipe(pipes) < 0)
+        if (i == 0)
         {
-            close(infd);
+            infd = STDIN_FILENO;
+        }
+        else
+        {
+            infd = pipes[(i - 1) * 2];
 
-            goto error;
+            // The previous stage has its copy, a builtin reading infd needs to see EOF
+            close(pipes[(i - 1) * 2 + 1]);
+            pipes[(i - 1) * 2 + 1] = -1;
         }
 
-        ret = exec_single(&cmds->commands[i], infd, pipes[1], true);
-        if (ret < 0)
+        if (i == cmds->count - 1)
+            outfd = STDOUT_FILENO;
+        else
+            outfd = pipes[i * 2 + 1];
+
+        if (redir_fds[i * 2] >= 0)
+            infd = redir_fds[i * 2];
+        if (redir_fds[i * 2 + 1] >= 0)
+            outfd = redir_fds[i * 2 + 1];
+
+        // The stage writes to a pipe of its own, the shell copies that to every destination
+        fanout_fd = -1;
+        if (cmds->commands[i].tee_count > 0)
+        {
+            pipe_size = (cmds->commands[i].pipe_size) ? cmds->commands[i].pipe_size : kai_ctx->pipe_size;
+
+            stage_ret = start_fanout(&cmds->commands[i], outfd, pipe_size, &fanout_fd, job);
+            if (stage_ret < 0)
+            {
+                err = errno;
+                ret = stage_ret;
+                break;
+            }
+
+            outfd = fanout_fd;
+        }
+
+        prev = (i > 0 && redir_fds[i * 2] < 0) ? tasks[i - 1] : NULL;
+
+        // Reading right away, a builtin would keep the shell from moving along what feeds it,
+        // unless that is captured output which is all there already
+        forked = i > 0 && redir_fds[i * 2] < 0 && builtin_reads_input(&cmds->commands[i], kai_ctx) &&
+                 (fanned || !prev || !prev->captured);
+        fanned = fanout_fd >= 0;
+
+        // Builtins in a pipeline or in background run inside the shell next to the processes
+        if (!forked && (cmds->count > 1 || cmds->piped || fanout_fd >= 0 || bg))
         {
-            close(infd);
-            close(pipes[0]);
-            close(pipes[1]);
+            stage_ret = builtin_stage(&cmds->commands[i], infd, outfd, prev,
+                                      i + 1 < cmds->count && builtin_reads_input(&cmds->commands[i + 1], kai_ctx),
+                                      &tasks[i], kai_ctx);
+            if (stage_ret != 0)
+            {
+                stages[i].pid = 0;
+                stages[i].status_fd = -1;
+                stages[i].err = (stage_ret < 0) ? errno : 0;
+                started++;
+
+                if (fanout_fd >= 0)
+                    close(fanout_fd);
+
+                if (stage_ret < 0)
+                    break;
+                continue;
+            }
+        }
 
-            goto error;
+        // The first process leads a new process group, which the rest join
+        sattr.pgid = -1;
+        sattr.tty_fd = -1;
+        sattr.envp = vars_envp(&kai_ctx->vars); // Only rebuilt after exported variables changed
+        if (jobs->job_control)
+        {
+            sattr.pgid = job->pgid;
+            if (!bg && job->pgid == 0)
+                sattr.tty_fd = jobs->tty_fd;
         }
-        spawned++;
 
-        close(pipes[1]);
+        if (forked)
+            builtin_fork(&stages[i], &cmds->commands[i], infd, outfd, &sattr, kai_ctx);
+        else
+            start_stage(&stages[i], &cmds->commands[i], infd, outfd, &sattr, kai_ctx);
+        started++;
+
+        // Only the stage may hold the write end or the fan-out never sees EOF
+        if (fanout_fd >= 0)
+            close(fanout_fd);
+
+        if (stages[i].err != 0)
+            break; // No point in starting the rest
+
+        if (jobs->job_control && job->pgid == 0)
+            job->pgid = stages[i].pid;
+    }
 
-        infd = pipes[0];
+    // Children hold their own copies now
+    for (i = 0; i < cmds->count - 1; i++)
+    {
+        close(pipes[i * 2]);
+        if (pipes[i * 2 + 1] >= 0)
+            close(pipes[i * 2 + 1]);
     }
 
-    ret = exec_single(&cmds->commands[i], infd, outfd, true);
+    // Collect exec reports of all stages together
+    for (i = 0; i < started; i++)
+    {
+        if (stages[i].pid == 0 && stages[i].err == 0)
+        {
+            // The job owns the task from here on
+            job_task_started(job, i, tasks[i]);
+            continue;
+        }
+
+        if (stages[i].pid == 0 || spawn_finish(&stages[i]) < 0)
+        {
+            if (stages[i].pid == 0)
+                errno = stages[i].err;
+
+            // With fork a missing program is only known here
+            if (errno == ENOENT)
+                cmdhash_forget(&kai_ctx->cmdhash, cmds->commands[i].argv[0]);
+
+            if (ret == 0)
+            {
+                err = errno;
+                *failed = i;
+                ret = -3;
+            }
+
+            continue;
+        }
+
+        // Found elsewhere in PATH, cache where it is now
+        if (stages[i].stale)
+            cmdhash_forget(&kai_ctx->cmdhash, cmds->commands[i].argv[0]);
+
+        job_proc_started(job, i, stages[i].pid);
+    }
+
+    // Don't leave the rest of a broken pipeline running
     if (ret < 0)
     {
-        close(infd);
-        goto error;
+        for (i = 0; i < started; i++)
+        {
+            if (stages[i].pid > 0)
+            {
+                kill(stages[i].pid, SIGTERM);
+                waitpid(stages[i].pid, NULL, 0);
+            }
+        }
     }
-    spawned++;
 
-    close(infd);
+end:
+    for (i = 0; i < cmds->count * 2; i++)
+    {
+        if (redir_fds[i] >= 0)
+            close(redir_fds[i]);
+    }
 
-    if (in_file_fd > 0)
-        close(in_file_fd);
-    if (out_file_fd > 0)
-        close(out_file_fd);
+    free(pipes);
+    free(redir_fds);
+    free(stages);
+    free(tasks);
 
-    while (spawned > 0)
+    errno = err;
+    return ret;
+}
+
+// Returns -2 if a file couldn't be opened, -1 for other failures
+int open_redirs(const command_t *cmd, int fds[2])
+{
+    if (cmd->here_doc)
     {
-        ret = wait(NULL);
-        if (ret < 0)
+        fds[0] = heredoc_open(cmd->here_doc);
+        if (fds[0] < 0)
             return -1;
+    }
+    else if (cmd->input_file)
+    {
+        fds[0] = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (fds[0] < 0)
+            return -2;
+    }
 
-        spawned--;
+    if (cmd->output_file)
+    {
+        fds[1] = open(cmd->output_file, O_CREAT | O_WRONLY | O_CLOEXEC, 0664);
+        if (fds[1] < 0)
+            return -2;
     }
 
     return 0;
+}
 
-error:
-    if (in_file_fd > 0)
-        close(in_file_fd);
-    if (out_file_fd > 0)
-        close(out_file_fd);
+/*
+ * Sets up the copies for a stage with several outputs. The stage writes to
+ * *stage_outfd, a task of the job copies that to outfd and every tee file.
+ */
+int start_fanout(command_t *cmd, int outfd, size_t pipe_size, int *stage_outfd, job_t *job)
+{
+    int *outfds;
+    int fan_pipe[2] = {-1, -1};
+    task_t *task = NULL;
+    size_t i, nout = 1;
+    int ret = -1;
+
+    outfds = malloc((cmd->tee_count + 1) * sizeof(int));
+    if (!outfds)
+        return -1;
 
-    while (spawned > 0)
+    outfds[0] = outfd;
+    for (i = 0; i < cmd->tee_count; i++)
     {
-        ret = wait(NULL);
-        if (ret < 0)
-            return -1;
+        outfds[nout] = open(cmd->tee_files[i], O_CREAT | O_WRONLY | O_CLOEXEC, 0664);
+        if (outfds[nout] < 0)
+        {
+            ret = -2;
+            goto end;
+        }
+        nout++;
+    }
+
+    if (pipe2(fan_pipe, O_CLOEXEC) < 0)
+        goto end;
+
+    if (set_pipe_size(fan_pipe[1], pipe_size) < 0)
+    {
+        ret = -4;
+        goto end;
+    }
+
+    task = task_fanout(fan_pipe[0], outfds, nout);
+    if (!task || job_add_helper(job, task) < 0)
+        goto end;
+
+    *stage_outfd = fan_pipe[1];
+    fan_pipe[1] = -1;
+    ret = 0;
+
+end:
+    // The task has its own copies
+    for (i = 1; i < nout; i++)
+        close(outfds[i]);
+    if (fan_pipe[0] >= 0)
+        close(fan_pipe[0]);
+    if (fan_pipe[1] >= 0)
+        close(fan_pipe[1]);
+
+    free(outfds);
+    return ret;
+}
+
+// A size of 0 keeps what the kernel gave the pipe
+int set_pipe_size(int fd, size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    if (size > INT_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return (fcntl(fd, F_SETPIPE_SZ, (int)size) < 0) ? -1 : 0;
+}
+
+int start_stage(spawn_handle_t *stage, command_t *cmd, int infd, int outfd, const spawn_attr_t *sattr,
+                kai_ctx_t *kai_ctx)
+{
+    const char *path;
+
+    path = cmdhash_lookup(&kai_ctx->cmdhash, cmd->argv[0], vars_get(&kai_ctx->vars, "PATH"));
+    if (!path || !sattr->envp)
+    {
+        if (path)
+            errno = ENOMEM;
+
+        stage->pid = -1;
+        stage->status_fd = -1;
+        stage->err = errno;
+
+        return -1;
+    }
 
-        spawned--;
+    if (spawn_start(stage, cmd, path, infd, outfd, sattr) == 0)
+        return 0;
+
+    // Cached binary is gone, search PATH again
+    if (stage->err == ENOENT && path != cmd->argv[0])
+    {
+        cmdhash_forget(&kai_ctx->cmdhash, cmd->argv[0]);
+
+        path = cmdhash_lookup(&kai_ctx->cmdhash, cmd->argv[0], vars_get(&kai_ctx->vars, "PATH"));
+        if (path)
+            return spawn_start(stage, cmd, path, infd, outfd, sattr);
     }
 
     return -1;
-}
\ No newline at end of file
+}
+
+void set_status(int status, job_t *job, kai_ctx_t *kai_ctx)
+{
+    size_t count = (job) ? job->nprocs : 1;
+    int *new_buf;
+    size_t i;
+
+    kai_ctx->last_status = status;
+
+    if (kai_ctx->pipestatus_count < count)
+    {
+        new_buf = realloc(kai_ctx->pipestatus, count * sizeof(int));
+        if (!new_buf)
+        {
+            kai_ctx->pipestatus_count = 0;
+            return;
+        }
+
+        kai_ctx->pipestatus = new_buf;
+    }
+    kai_ctx->pipestatus_count = count;
+
+    if (!job)
+    {
+        kai_ctx->pipestatus[0] = status;
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+        kai_ctx->pipestatus[i] = job_proc_exit_status(&job->procs[i]);
+}
+
+void report_times(command_list_t *cmds, job_t *job)
+{
+    const job_proc_t *proc;
+    const struct timespec *first_start, *last_end;
+    struct rusage total = {0};
+    size_t i;
+
+    fprintf(stderr, "%-6s %9s %9s %9s %10s %7s %7s %8s %7s %5s  %s\n",
+            "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "minflt", "majflt", "exit", "command");
+
+    first_start = &job->procs[0].start;
+    last_end = &job->procs[0].end;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        proc = &job->procs[i];
+
+        fprintf(stderr, "%-6zu %8.3fs %8.3fs %8.3fs %8ldkB %7ld %7ld %8ld %7ld %5d  %s\n",
+                i + 1, ts_diff(&proc->start, &proc->end),
+                tv_secs(&proc->rusage.ru_utime), tv_secs(&proc->rusage.ru_stime),
+                proc->rusage.ru_maxrss, proc->rusage.ru_nvcsw, proc->rusage.ru_nivcsw,
+                proc->rusage.ru_minflt, proc->rusage.ru_majflt,
+                job_proc_exit_status(proc), cmds->commands[i].argv[0]);
+
+        timeradd(&total.ru_utime, &proc->rusage.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &proc->rusage.ru_stime, &total.ru_stime);
+        total.ru_nvcsw += proc->rusage.ru_nvcsw;
+        total.ru_nivcsw += proc->rusage.ru_nivcsw;
+        total.ru_minflt += proc->rusage.ru_minflt;
+        total.ru_majflt += proc->rusage.ru_majflt;
+
+        // Stages run concurrently, so the peak of one is the best we know
+        if (proc->rusage.ru_maxrss > total.ru_maxrss)
+            total.ru_maxrss = proc->rusage.ru_maxrss;
+
+        if (ts_diff(last_end, &proc->end) > 0)
+            last_end = &proc->end;
+    }
+
+    if (job->nprocs > 1)
+    {
+        fprintf(stderr, "%-6s %8.3fs %8.3fs %8.3fs %8ldkB %7ld %7ld %8ld %7ld %5d\n",
+                "total", ts_diff(first_start, last_end),
+                tv_secs(&total.ru_utime), tv_secs(&total.ru_stime),
+                total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw,
+                total.ru_minflt, total.ru_majflt, job_exit_status(job));
+    }
+}
+
+double tv_secs(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+double ts_diff(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
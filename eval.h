@@ -1,8 +1,10 @@
 #ifndef EVAL_H
 #define EVAL_H
 
+#include "parser.h"
 #include "kai.h"
 
+#define EVAL_STATUS_MORE 2 // Input ended inside a heredoc, the next line goes on with it
 #define EVAL_STATUS_OK 1
 #define EVAL_STATUS_NO_EXEC 0
 #define EVAL_STATUS_FAIL -1
@@ -10,10 +12,15 @@
 typedef struct eval_res {
     int status;
     char const *err_msg;
+    int exit_status; // Builtins only, failures that leave it at 0 exit with 1
 
     int bg_pid;
 } eval_res_t;
 
 void eval(eval_res_t *result, const char *input, kai_ctx_t *kai_ctx);
 
+void eval_end(eval_res_t *result, kai_ctx_t *kai_ctx);
+
+void eval_node(list_node_t *node, eval_res_t *result, kai_ctx_t *kai_ctx);
+
 #endif
\ No newline at end of file
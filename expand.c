@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <stdio.h>
+
+#include "expand.h"
+#include "parser.h"
+#include "eval.h"
+#include "pathglob.h"
+#include "kai_plugin.h"
+#include "kai.h"
+
+#define READ_CHUNK 65536
+#define INITIAL_ARGV 8
+
+static const char ERR_SUBST_SYNTAX[] = "Invalid syntax in command substitution";
+
+typedef struct output
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} output_t;
+
+// Arguments of the command being expanded
+typedef struct fields
+{
+    arena_t *arena;
+    char **argv;
+    size_t argc;
+    size_t cap;
+
+    output_t cur;
+    bool started; // cur is a field even if it's empty
+
+    // cur as a pattern, only kept once it has a wildcard to match with
+    pathglob_cache_t *cache;
+    output_t pat;
+    bool glob;
+} fields_t;
+
+static const char *var_value(const char *name, char *buf, kai_ctx_t *kai_ctx);
+static int capture(const char *text, output_t *out, eval_res_t *result, kai_ctx_t *kai_ctx);
+static bool needs_subshell(const list_node_t *node, kai_ctx_t *kai_ctx);
+static int capture_inline(list_node_t *root, output_t *out, kai_ctx_t *kai_ctx);
+static int capture_subshell(list_node_t *root, output_t *out, kai_ctx_t *kai_ctx);
+static void run_subshell(list_node_t *root, int outfd, kai_ctx_t *kai_ctx);
+static int read_all(int fd, output_t *out);
+static int append(output_t *out, const char *data, size_t len);
+static int add_text(fields_t *fields, const char *data, size_t len, bool active);
+static int add_pattern(output_t *pat, const char *data, size_t len, bool active);
+static int add_split(fields_t *fields, const char *data, size_t len);
+static int end_field(fields_t *fields);
+static int push_field(fields_t *fields, char *field);
+static bool is_sep(char c);
+static bool is_wildcard(char c);
+
+/*
+ * Runs the '$(...)' of cmd and looks up its variables, and puts what they
+ * stand for in its arguments. Values outside of double quotes are split into
+ * fields on blanks and newlines, trailing newlines of output are dropped
+ * either way. Fields with unquoted wildcards are then replaced by the paths
+ * they match, if any, reading directories through cache. A word left without
+ * text and fields disappears, so argc may become 0.
+ */
+int expand_command(command_t *cmd, pathglob_cache_t *cache, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    fields_t fields = {&kai_ctx->arena, NULL, 0, 0, {NULL, 0, 0}, false, cache, {NULL, 0, 0}, false};
+    output_t out = {NULL, 0, 0};
+    const expansion_t *exp;
+    const char *word;
+    const char *value;
+    char status_buf[16];
+    size_t w, offset, len;
+    int ret = -1;
+
+    fields.argv = arena_alloc(fields.arena, INITIAL_ARGV * sizeof(char *));
+    if (!fields.argv)
+        goto mem;
+    fields.cap = INITIAL_ARGV;
+
+    exp = cmd->expansions;
+    for (w = 0; w < cmd->argc; w++)
+    {
+        word = cmd->argv[w];
+        offset = 0;
+
+        for (; exp < cmd->expansions + cmd->nexpansions && exp->word == w; exp++)
+        {
+            if (add_text(&fields, word + offset, exp->offset - offset, false) < 0)
+                goto mem;
+            offset = exp->offset;
+
+            // The wildcard is still in the word, unlike other expansions
+            if (exp->kind == EXPANSION_GLOB)
+            {
+                if (add_text(&fields, word + offset, 1, true) < 0)
+                    goto mem;
+                offset++;
+                continue;
+            }
+
+            if (exp->kind == EXPANSION_VAR)
+            {
+                value = var_value(exp->text, status_buf, kai_ctx);
+                len = strlen(value);
+            }
+            else
+            {
+                out.len = 0;
+                kai_ctx->interrupted = false;
+                if (capture(exp->text, &out, result, kai_ctx) < 0)
+                    goto end;
+
+                // Ctrl-C gives up on the whole command, a plain 'exit 130' doesn't
+                if (kai_ctx->interrupted)
+                {
+                    result->status = EVAL_STATUS_NO_EXEC;
+                    result->err_msg = NULL;
+                    goto end;
+                }
+
+                while (out.len > 0 && out.data[out.len - 1] == '\n')
+                    out.len--;
+
+                value = out.data;
+                len = out.len;
+            }
+
+            if (exp->quoted)
+                ret = add_text(&fields, value, len, false);
+            else
+                ret = add_split(&fields, value, len);
+            if (ret < 0)
+                goto mem;
+            ret = -1;
+
+            // Quotes keep the field even if nothing came out
+            fields.started |= exp->quoted;
+        }
+
+        if (add_text(&fields, word + offset, strlen(word + offset), false) < 0 || end_field(&fields) < 0)
+            goto mem;
+    }
+
+    fields.argv[fields.argc] = NULL;
+
+    cmd->argv = fields.argv;
+    cmd->argc = fields.argc;
+    cmd->nexpansions = 0;
+    ret = 0;
+    goto end;
+
+mem:
+    result->status = EVAL_STATUS_FAIL;
+    result->err_msg = strerror(ENOMEM);
+end:
+    free(out.data);
+    free(fields.cur.data);
+    free(fields.pat.data);
+
+    return ret;
+}
+
+// Unset variables are empty, buf has to fit an exit status for '$?'
+const char *var_value(const char *name, char *buf, kai_ctx_t *kai_ctx)
+{
+    const char *value;
+
+    if (strcmp(name, "?") == 0)
+    {
+        sprintf(buf, "%d", kai_ctx->last_status);
+        return buf;
+    }
+
+    value = vars_get(&kai_ctx->vars, name);
+
+    return (value) ? value : "";
+}
+
+// Runs text with its stdout going to out, the exit status is left in kai_ctx
+int capture(const char *text, output_t *out, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    list_node_t *root;
+    int ret;
+
+    // Same arena as the command, it's only reset once the whole line is done
+    ret = parse_command_list(&root, text, &kai_ctx->arena, NULL);
+    if (ret < 0)
+    {
+        result->status = EVAL_STATUS_FAIL;
+        result->err_msg = (ret == PARSER_RET_MEM) ? strerror(ENOMEM) : ERR_SUBST_SYNTAX;
+        kai_ctx->last_status = 2;
+        return -1;
+    }
+    if (ret == 0)
+    {
+        kai_ctx->last_status = 0;
+        return 0;
+    }
+
+    if (needs_subshell(root, kai_ctx))
+        ret = capture_subshell(root, out, kai_ctx);
+    else
+        ret = capture_inline(root, out, kai_ctx);
+
+    if (ret < 0)
+    {
+        result->status = EVAL_STATUS_FAIL;
+        result->err_msg = strerror(errno);
+        kai_ctx->last_status = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Commands that change the shell, like 'cd' or 'exit', have to be kept away
+ * from it in a process of their own. So do background jobs, which would
+ * outlive the capture. Anything else runs right here: builtins write into the
+ * capture themselves, programs are spawned with it as their stdout.
+ */
+bool needs_subshell(const list_node_t *node, kai_ctx_t *kai_ctx)
+{
+    const bhash_entry_t *entry;
+    const command_t *cmd;
+    const char *name;
+    size_t i;
+
+    if (node->op != LIST_PIPELINE)
+        return needs_subshell(node->left, kai_ctx) || (node->right && needs_subshell(node->right, kai_ctx));
+
+    for (i = 0; i < node->pipeline.count; i++)
+    {
+        cmd = &node->pipeline.commands[i];
+        if (cmd->in_bg)
+            return true;
+
+        // Not known until it runs, a wildcard like '[' may still be the name
+        if (cmd->nexpansions > 0 && cmd->expansions[0].word == 0 && cmd->expansions[0].kind != EXPANSION_GLOB)
+            return true;
+
+        name = cmd->argv[0];
+        if (strcmp(name, "time") == 0 && cmd->argc > 1)
+            name = cmd->argv[1];
+
+        entry = bhash_lookup(&kai_ctx->builtins, name);
+        if (entry && !(entry->builtin->flags & KAI_BUILTIN_STAGE))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Points stdout at a memfd for as long as the commands run. A pipe would
+ * fill up with nobody reading it while a builtin writes into it.
+ */
+int capture_inline(list_node_t *root, output_t *out, kai_ctx_t *kai_ctx)
+{
+    eval_res_t result = {0};
+    int fd, saved_fd;
+    int ret = -1;
+
+    fd = memfd_create("kai-subst", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    saved_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (saved_fd < 0)
+        goto end;
+
+    fflush(stdout);
+    if (dup2(fd, STDOUT_FILENO) < 0)
+    {
+        close(saved_fd);
+        goto end;
+    }
+
+    eval_node(root, &result, kai_ctx);
+    if (result.status == EVAL_STATUS_FAIL)
+        fprintf(stderr, "[!] Error: %s\n", result.err_msg);
+
+    fflush(stdout);
+    dup2(saved_fd, STDOUT_FILENO);
+    close(saved_fd);
+
+    if (lseek(fd, 0, SEEK_SET) == 0)
+        ret = read_all(fd, out);
+
+end:
+    close(fd);
+
+    return ret;
+}
+
+int capture_subshell(list_node_t *root, output_t *out, kai_ctx_t *kai_ctx)
+{
+    int pipefd[2];
+    int status;
+    pid_t pid;
+    int ret, err;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -1;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0)
+    {
+        err = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = err;
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(pipefd[0]);
+        run_subshell(root, pipefd[1], kai_ctx);
+    }
+
+    close(pipefd[1]);
+
+    ret = read_all(pipefd[0], out);
+    err = errno;
+    close(pipefd[0]);
+
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    if (WIFEXITED(status))
+        kai_ctx->last_status = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        kai_ctx->last_status = 128 + WTERMSIG(status);
+
+    kai_ctx->interrupted |= WIFSIGNALED(status) && WTERMSIG(status) == SIGINT;
+
+    errno = err;
+
+    return ret;
+}
+
+/*
+ * Child side of a subshell. It stays in our process group, so Ctrl-C reaches
+ * it, and runs its commands without job control or the event loop.
+ */
+void run_subshell(list_node_t *root, int outfd, kai_ctx_t *kai_ctx)
+{
+    eval_res_t result = {0};
+    sigset_t sigmask;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+
+    sigemptyset(&sigmask);
+    sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+    kai_ctx->jobs.job_control = false;
+    kai_ctx->jobs.epfd = -1;
+    kai_ctx->jobs.sigfd = -1;
+
+    if (dup2(outfd, STDOUT_FILENO) < 0)
+        _exit(1);
+    close(outfd);
+
+    eval_node(root, &result, kai_ctx);
+    if (result.status == EVAL_STATUS_FAIL)
+        fprintf(stderr, "[!] Error: %s\n", result.err_msg);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    _exit((kai_ctx->running) ? kai_ctx->last_status : kai_ctx->exit_code);
+}
+
+int read_all(int fd, output_t *out)
+{
+    ssize_t nread;
+
+    for (;;)
+    {
+        if (out->cap - out->len < READ_CHUNK && append(out, NULL, READ_CHUNK) < 0)
+            return -1;
+
+        nread = read(fd, out->data + out->len, out->cap - out->len);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nread == 0)
+            return 0;
+
+        out->len += nread;
+    }
+}
+
+// Copies data to the end of out, a NULL data only makes room for len bytes
+int append(output_t *out, const char *data, size_t len)
+{
+    size_t new_cap;
+    char *new_data;
+
+    if (out->cap - out->len < len)
+    {
+        new_cap = (out->cap) ? out->cap * 2 : READ_CHUNK;
+        while (new_cap - out->len < len)
+            new_cap *= 2;
+
+        new_data = realloc(out->data, new_cap);
+        if (!new_data)
+            return -1;
+
+        out->data = new_data;
+        out->cap = new_cap;
+    }
+
+    if (data)
+    {
+        memcpy(out->data + out->len, data, len);
+        out->len += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Wildcards in active text match paths, in any other text they are plain
+ * characters. The pattern is only started at the first active one.
+ */
+int add_text(fields_t *fields, const char *data, size_t len, bool active)
+{
+    size_t i;
+
+    if (len == 0)
+        return 0;
+
+    fields->started = true;
+
+    if (active && !fields->glob)
+    {
+        for (i = 0; i < len && !is_wildcard(data[i]); i++)
+            ;
+
+        if (i < len)
+        {
+            fields->glob = true;
+            fields->pat.len = 0;
+            if (add_pattern(&fields->pat, fields->cur.data, fields->cur.len, false) < 0)
+                return -1;
+        }
+    }
+
+    if (fields->glob && add_pattern(&fields->pat, data, len, active) < 0)
+        return -1;
+
+    return append(&fields->cur, data, len);
+}
+
+// Inactive wildcards and backslashes are escaped for pathglob()
+int add_pattern(output_t *pat, const char *data, size_t len, bool active)
+{
+    size_t i, n;
+
+    if (active)
+        return append(pat, data, len);
+
+    for (i = 0; i < len; i = n + 1)
+    {
+        for (n = i; n < len && !is_wildcard(data[n]) && data[n] != '\\'; n++)
+            ;
+        if (append(pat, data + i, n - i) < 0)
+            return -1;
+
+        if (n == len)
+            break;
+        if (append(pat, "\\", 1) < 0 || append(pat, data + n, 1) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int add_split(fields_t *fields, const char *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0)
+    {
+        for (n = 0; n < len && !is_sep(data[n]); n++)
+            ;
+        if (add_text(fields, data, n, true) < 0)
+            return -1;
+
+        data += n;
+        len -= n;
+        if (len == 0)
+            break;
+
+        if (end_field(fields) < 0)
+            return -1;
+
+        while (len > 0 && is_sep(*data))
+        {
+            data++;
+            len--;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Moves the field collected so far into argv, or the paths it matches if it
+ * is a pattern. A pattern that matches nothing is kept as it is.
+ */
+int end_field(fields_t *fields)
+{
+    pathglob_res_t res = {NULL, 0, 0};
+    char *field;
+    size_t i;
+
+    if (!fields->started)
+        return 0;
+
+    if (fields->glob)
+    {
+        fields->glob = false;
+
+        if (add_pattern(&fields->pat, "", 1, true) < 0 || pathglob(fields->pat.data, fields->cache, &res) < 0)
+            return -1;
+
+        for (i = 0; i < res.count; i++)
+        {
+            if (push_field(fields, res.paths[i]) < 0)
+                return -1;
+        }
+    }
+
+    if (res.count == 0)
+    {
+        field = arena_alloc(fields->arena, fields->cur.len + 1);
+        if (!field)
+            return -1;
+
+        if (fields->cur.len > 0)
+            memcpy(field, fields->cur.data, fields->cur.len);
+        field[fields->cur.len] = '\0';
+
+        if (push_field(fields, field) < 0)
+            return -1;
+    }
+
+    fields->cur.len = 0;
+    fields->started = false;
+
+    return 0;
+}
+
+// Keeps room for the NULL
+int push_field(fields_t *fields, char *field)
+{
+    char **new_argv;
+
+    if (fields->argc + 1 == fields->cap)
+    {
+        new_argv = arena_grow(fields->arena, fields->argv, fields->cap * sizeof(char *),
+                              fields->cap * 2 * sizeof(char *));
+        if (!new_argv)
+            return -1;
+
+        fields->argv = new_argv;
+        fields->cap *= 2;
+    }
+
+    fields->argv[fields->argc++] = field;
+
+    return 0;
+}
+
+bool is_sep(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+bool is_wildcard(char c)
+{
+    return c == '*' || c == '?' || c == '[';
+}
@@ -0,0 +1,11 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include "parser.h"
+#include "pathglob.h"
+#include "eval.h"
+#include "kai.h"
+
+int expand_command(command_t *cmd, pathglob_cache_t *cache, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+#endif
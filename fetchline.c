@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stddef.h>
 #include <stdbool.h>
@@ -7,10 +8,16 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "fetchline.h"
 #include "history.h"
 
+// Bracketed paste, the terminal wraps pasted text in \e[200~ and PASTE_END
+static const char PASTE_ON[] = "\e[?2004h";
+static const char PASTE_OFF[] = "\e[?2004l";
+static const char PASTE_END[] = "\e[201~";
+
 typedef enum ctrl_code
 {
     CTRL_BKSP,
@@ -24,29 +31,77 @@ typedef enum ctrl_code
     CTRL_ANSI_LEFT,
     CTRL_ANSI_DEL,
     CTRL_ANSI_INS,
-    CTRL_ANSI_UNKNOWN
+    CTRL_ANSI_PASTE,
+    CTRL_ANSI_UNKNOWN,
+    CTRL_INCOMPLETE
 } ctrl_code_t;
 
 static int term_set_raw(fetchline_ctx_t *ctx);
 
 static int term_reset(fetchline_ctx_t *ctx);
 
-static ctrl_code_t parse_ctrl(char c);
+static ssize_t process_input(fetchline_ctx_t *ctx);
+
+static ssize_t handle_ctrl(fetchline_ctx_t *ctx, ctrl_code_t cc);
+
+static ssize_t finish(fetchline_ctx_t *ctx, ssize_t ret);
+
+static ctrl_code_t parse_ctrl(fetchline_ctx_t *ctx);
+
+static ctrl_code_t parse_ansi(fetchline_ctx_t *ctx);
+
+static bool process_paste(fetchline_ctx_t *ctx, int *err);
+
+static size_t partial_end(const char *data, size_t len);
+
+static int draw(fetchline_ctx_t *ctx);
 
-static ctrl_code_t parse_ansi();
+static int move_cursor(fetchline_ctx_t *ctx, size_t from, size_t to);
 
-static void move_cursor(int offset);
+static int out_csi(fetchline_ctx_t *ctx, size_t count, char final);
+
+static int out_append(fetchline_ctx_t *ctx, const char *data, size_t len);
+
+static int out_flush(fetchline_ctx_t *ctx);
 
 static void erase_line();
 
-static int charcat(char **dest, size_t *destlen, size_t slen, char c, size_t index);
+static int gap_insert(fetchline_ctx_t *ctx, const char *data, size_t len);
+
+static void gap_move(fetchline_ctx_t *ctx, size_t pos);
+
+static int gap_set(fetchline_ctx_t *ctx, const char *data, size_t len);
 
-static void delchar(char *str, size_t index);
+static char gap_at(const fetchline_ctx_t *ctx, size_t index);
+
+static int flatten(fetchline_ctx_t *ctx);
+
+static int out_text(fetchline_ctx_t *ctx, size_t from, size_t to);
+
+static int out_visible(fetchline_ctx_t *ctx, const char *data, size_t len);
 
 int fetchline_ctx_init(fetchline_ctx_t *context)
 {
     history_init(&context->hist);
 
+    context->active = false;
+    context->in_start = 0;
+    context->in_end = 0;
+
+    context->text = NULL;
+    context->text_cap = 0;
+    context->gap_end = 0;
+
+    context->shown_valid = false;
+    context->shown = NULL;
+    context->shown_len = 0;
+    context->shown_cap = 0;
+    context->shown_cursor = 0;
+
+    context->out = NULL;
+    context->out_len = 0;
+    context->out_cap = 0;
+
     if (tcgetattr(STDIN_FILENO, &context->old_opts) != 0)
         return -1;
 
@@ -56,155 +111,263 @@ int fetchline_ctx_init(fetchline_ctx_t *context)
 void fetchline_ctx_free(fetchline_ctx_t *context)
 {
     history_free(&context->hist);
+    free(context->text);
+    free(context->shown);
+    free(context->out);
 }
 
-ssize_t fetchline(fetchline_ctx_t *context, const char *prompt, char **buffer, size_t *buflen)
+ssize_t fetchline_begin(fetchline_ctx_t *context, const char *prompt, size_t prompt_width, char **buffer,
+                        size_t *buflen)
 {
-    ssize_t ret;
+    if (term_set_raw(context) < 0)
+        return FL_RET_SYS_FAIL;
 
-    char c;
-    ctrl_code_t cc;
-    bool end = false;
+    context->active = true;
+    context->prompt = prompt;
+    context->prompt_len = strlen(prompt);
+    context->prompt_width = prompt_width;
+    context->buffer = buffer;
+    context->buflen = buflen;
+    context->cursor_pos = 0;
+    context->slen = 0;
+    context->gap_end = context->text_cap;
+    context->pasting = false;
+    context->shown_valid = false;
 
-    size_t cursor_pos = 0;
-    size_t slen = 0;
-    ssize_t histlen;
+    fputs(PASTE_ON, stdout);
 
-    if (term_set_raw(context) < 0)
+    // Make sure buffer is clear
+    (*buffer)[0] = '\0';
+
+    // Input typed ahead of the prompt may already hold a full line
+    return process_input(context);
+}
+
+ssize_t fetchline_feed(fetchline_ctx_t *context)
+{
+    ssize_t nread;
+
+    if (!context->active)
         return FL_RET_SYS_FAIL;
 
-    // Make sure buffer is clear
-    *buffer[0] = '\0';
+    // Move unconsumed input to the front
+    if (context->in_start > 0)
+    {
+        memmove(context->inbuf, context->inbuf + context->in_start, context->in_end - context->in_start);
+        context->in_end -= context->in_start;
+        context->in_start = 0;
+    }
+
+    nread = read(STDIN_FILENO, context->inbuf + context->in_end, sizeof(context->inbuf) - context->in_end);
+    if (nread < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+            return FL_RET_AGAIN;
 
-    while (!end)
+        return finish(context, FL_RET_SYS_FAIL);
+    }
+    if (nread == 0)
     {
-        erase_line();
-        fputs(prompt, stdout);
-        fputs(*buffer, stdout);
-        move_cursor(-1 * slen);
-        move_cursor(cursor_pos);
-
-        c = getchar();
-        if (iscntrl(c))
+        fputc('\n', stdout);
+        return finish(context, FL_RET_EOF);
+    }
+
+    context->in_end += nread;
+
+    return process_input(context);
+}
+
+void fetchline_hide(fetchline_ctx_t *context)
+{
+    if (!context->active)
+        return;
+
+    erase_line();
+    fflush(stdout);
+    context->shown_valid = false;
+}
+
+// Takes effect with the next redraw
+void fetchline_set_prompt(fetchline_ctx_t *context, const char *prompt, size_t prompt_width)
+{
+    context->prompt = prompt;
+    context->prompt_len = strlen(prompt);
+    context->prompt_width = prompt_width;
+    context->shown_valid = false;
+}
+
+void fetchline_redraw(fetchline_ctx_t *context)
+{
+    if (!context->active)
+        return;
+
+    draw(context);
+}
+
+ssize_t process_input(fetchline_ctx_t *ctx)
+{
+    const char *start;
+    size_t avail, n;
+    ctrl_code_t cc;
+    ssize_t ret;
+    int err = 0;
+
+    while (ctx->in_start < ctx->in_end)
+    {
+        if (ctx->pasting)
+        {
+            if (!process_paste(ctx, &err))
+                break; // Rest of the paste hasn't arrived yet
+
+            continue;
+        }
+
+        start = ctx->inbuf + ctx->in_start;
+        avail = ctx->in_end - ctx->in_start;
+
+        if (iscntrl((unsigned char)*start))
         {
-            cc = parse_ctrl(c);
-            switch (cc)
+            cc = parse_ctrl(ctx);
+            if (cc == CTRL_INCOMPLETE)
+                break; // Rest of the sequence hasn't arrived yet
+
+            if (cc == CTRL_ANSI_PASTE)
             {
-            case CTRL_ENTER:
-                fputc('\n', stdout);
-
-                if (strcmp("!!", *buffer) == 0)
-                {
-                    histlen = history_peek_last(&context->hist, buffer, buflen);
-                    if (histlen == 0)
-                    {
-                        fputs("[!] No entries in history\n", stderr);
-                        return FL_RET_EMPTY;
-                    }
-                    else if (histlen < 0)
-                    {
-                        return FL_RET_MEM_FAIL; // Memory failure
-                    }
-
-                    puts(*buffer);
-                    return histlen;
-                }
-
-                if (history_add(&context->hist, *buffer) < 0)
-                    return FL_RET_MEM_FAIL;
-
-                end = true;
-                ret = slen;
-
-                break;
-            case CTRL_C:
-                end = true;
-                ret = FL_RET_INTERRUPT;
-                fputc('\n', stdout);
-
-                break;
-            case CTRL_D:
-                if (*buffer[0] == '\0')
-                {
-                    end = true;
-                    ret = FL_RET_EOF;
-                    fputc('\n', stdout);
-                }
-
-                break;
-            case CTRL_BKSP:
-                if (cursor_pos > 0)
-                {
-                    delchar(*buffer, cursor_pos - 1);
-                    cursor_pos--;
-                    slen--;
-                }
-
-                break;
-            case CTRL_ANSI_DEL:
-                if (cursor_pos < slen)
-                {
-                    delchar(*buffer, cursor_pos);
-                    slen--;
-                }
-
-                break;
-            case CTRL_ANSI_LEFT:
-                if (cursor_pos > 0)
-                    cursor_pos--;
-
-                break;
-            case CTRL_ANSI_RIGHT:
-                if (cursor_pos < slen)
-                    cursor_pos++;
-
-                break;
-            case CTRL_ANSI_UP:
-                histlen = history_get_prev(&context->hist, buffer, buflen);
-                if (histlen < 0)
-                    return FL_RET_MEM_FAIL;
-
-                if (histlen != 0)
-                {
-                    slen = histlen;
-                    cursor_pos = slen;
-                }
-
-                break;
-            case CTRL_ANSI_DOWN:
-                histlen = history_get_next(&context->hist, buffer, buflen);
-                if (histlen < 0)
-                    return FL_RET_MEM_FAIL;
-
-                if (histlen != 0)
-                {
-                    slen = histlen;
-                    cursor_pos = slen;
-                }
-                else
-                {
-                    // Clear line
-                    cursor_pos = 0;
-                    *buffer[0] = '\0';
-                    slen = 0;
-                }
-
-                break;
-            default:
-                break;
+                ctx->pasting = true;
+                continue;
             }
+
+            ret = handle_ctrl(ctx, cc);
+            if (ret != FL_RET_AGAIN)
+                return finish(ctx, ret);
         }
         else
         {
-            charcat(buffer, buflen, slen, c, cursor_pos);
-            slen++;
-            cursor_pos++;
+            // Insert the whole run of plain characters at once
+            for (n = 1; n < avail && !iscntrl((unsigned char)start[n]); n++)
+                ;
+
+            ctx->in_start += n;
+
+            if (gap_insert(ctx, start, n) < 0)
+                return finish(ctx, FL_RET_MEM_FAIL);
+        }
+    }
+
+    if (err < 0)
+        return finish(ctx, FL_RET_MEM_FAIL);
+
+    // A paste is only drawn once all of it is in
+    if (!ctx->pasting && draw(ctx) < 0)
+        return finish(ctx, FL_RET_MEM_FAIL);
+
+    return FL_RET_AGAIN;
+}
+
+ssize_t handle_ctrl(fetchline_ctx_t *ctx, ctrl_code_t cc)
+{
+    char **buffer = ctx->buffer;
+    ssize_t histlen;
+
+    switch (cc)
+    {
+    case CTRL_ENTER:
+        fputc('\n', stdout);
+
+        if (flatten(ctx) < 0)
+            return FL_RET_MEM_FAIL;
+
+        if (strcmp("!!", *buffer) == 0)
+        {
+            histlen = history_peek_last(&ctx->hist, buffer, ctx->buflen);
+            if (histlen == 0)
+            {
+                fputs("[!] No entries in history\n", stderr);
+                return FL_RET_EMPTY;
+            }
+            else if (histlen < 0)
+            {
+                return FL_RET_MEM_FAIL; // Memory failure
+            }
+
+            puts(*buffer);
+            return histlen;
+        }
+
+        if (history_add(&ctx->hist, *buffer) < 0)
+            return FL_RET_MEM_FAIL;
+
+        return ctx->slen;
+    case CTRL_C:
+        fputc('\n', stdout);
+
+        return FL_RET_INTERRUPT;
+    case CTRL_D:
+        if (ctx->slen == 0)
+        {
+            fputc('\n', stdout);
+            return FL_RET_EOF;
         }
 
-        fflush(stdout);
+        break;
+    case CTRL_BKSP:
+        // Deleting only widens the gap
+        if (ctx->cursor_pos > 0)
+        {
+            ctx->cursor_pos--;
+            ctx->slen--;
+        }
+
+        break;
+    case CTRL_ANSI_DEL:
+        if (ctx->cursor_pos < ctx->slen)
+        {
+            ctx->gap_end++;
+            ctx->slen--;
+        }
+
+        break;
+    case CTRL_ANSI_LEFT:
+        if (ctx->cursor_pos > 0)
+            gap_move(ctx, ctx->cursor_pos - 1);
+
+        break;
+    case CTRL_ANSI_RIGHT:
+        if (ctx->cursor_pos < ctx->slen)
+            gap_move(ctx, ctx->cursor_pos + 1);
+
+        break;
+    case CTRL_ANSI_UP:
+        histlen = history_get_prev(&ctx->hist, buffer, ctx->buflen);
+        if (histlen < 0 || (histlen != 0 && gap_set(ctx, *buffer, histlen) < 0))
+            return FL_RET_MEM_FAIL;
+
+        break;
+    case CTRL_ANSI_DOWN:
+        histlen = history_get_next(&ctx->hist, buffer, ctx->buflen);
+        if (histlen < 0)
+            return FL_RET_MEM_FAIL;
+
+        // Past the newest entry the line is cleared
+        if (gap_set(ctx, *buffer, histlen) < 0)
+            return FL_RET_MEM_FAIL;
+
+        break;
+    default:
+        break;
     }
 
-    if (term_reset(context) < 0)
+    return FL_RET_AGAIN;
+}
+
+ssize_t finish(fetchline_ctx_t *ctx, ssize_t ret)
+{
+    ctx->active = false;
+    ctx->pasting = false;
+    fputs(PASTE_OFF, stdout);
+    fflush(stdout);
+
+    if (term_reset(ctx) < 0)
         return FL_RET_SYS_FAIL;
 
     return ret;
@@ -232,8 +395,15 @@ int term_reset(fetchline_ctx_t *ctx)
     return 0;
 }
 
-ctrl_code_t parse_ctrl(char c)
+ctrl_code_t parse_ctrl(fetchline_ctx_t *ctx)
 {
+    char c = ctx->inbuf[ctx->in_start];
+
+    if (c == '\e')
+        return parse_ansi(ctx);
+
+    ctx->in_start++;
+
     switch (c)
     {
     case '\n':
@@ -244,54 +414,330 @@ ctrl_code_t parse_ctrl(char c)
         return CTRL_D;
     case 0x7f:
         return CTRL_BKSP;
-    case '\e':
-        return parse_ansi();
     default:
         return CTRL_UNKNOWN;
     }
 }
 
-ctrl_code_t parse_ansi()
+ctrl_code_t parse_ansi(fetchline_ctx_t *ctx)
 {
-    if (getchar() != '[')
+    const char *seq = ctx->inbuf + ctx->in_start;
+    size_t avail = ctx->in_end - ctx->in_start;
+    size_t len;
+    ctrl_code_t cc;
+
+    if (avail < 2)
+        return CTRL_INCOMPLETE;
+    if (seq[1] != '[')
+    {
+        ctx->in_start += 2;
         return CTRL_ANSI_UNKNOWN;
+    }
 
-    switch (getchar())
+    if (avail < 3)
+        return CTRL_INCOMPLETE;
+
+    len = 3;
+    switch (seq[2])
     {
     case 'A':
-        return CTRL_ANSI_UP;
+        cc = CTRL_ANSI_UP;
+        break;
     case 'B':
-        return CTRL_ANSI_DOWN;
+        cc = CTRL_ANSI_DOWN;
+        break;
     case 'D':
-        return CTRL_ANSI_LEFT;
+        cc = CTRL_ANSI_LEFT;
+        break;
     case 'C':
-        return CTRL_ANSI_RIGHT;
+        cc = CTRL_ANSI_RIGHT;
+        break;
     case '3':
-        switch (getchar())
-        {
-        case '~':
-            return CTRL_ANSI_DEL;
-        default:
-            return CTRL_ANSI_UNKNOWN;
-        }
     case '2':
-        switch (getchar())
+        if (avail < 4)
+            return CTRL_INCOMPLETE;
+
+        if (seq[2] == '2' && seq[3] == '0')
         {
-        case '~':
-            return CTRL_ANSI_INS;
-        default:
-            return CTRL_ANSI_UNKNOWN;
+            // \e[200~ starts a paste, a stray \e[201~ is dropped
+            if (avail < 6)
+                return CTRL_INCOMPLETE;
+
+            len = 6;
+            if (seq[4] == '0' && seq[5] == '~')
+                cc = CTRL_ANSI_PASTE;
+            else
+                cc = CTRL_ANSI_UNKNOWN;
+            break;
         }
+
+        len = 4;
+        if (seq[3] != '~')
+            cc = CTRL_ANSI_UNKNOWN;
+        else
+            cc = (seq[2] == '3') ? CTRL_ANSI_DEL : CTRL_ANSI_INS;
+        break;
     default:
-        return CTRL_ANSI_UNKNOWN;
+        cc = CTRL_ANSI_UNKNOWN;
+        break;
     }
+
+    ctx->in_start += len;
+    return cc;
 }
 
-void move_cursor(int offset)
+/*
+ * Inserts what arrived of a paste as one block, control characters included,
+ * so a pasted newline doesn't run the line. Returns false once it needs more
+ * input, a PASTE_END split across reads is left in inbuf until it's whole.
+ */
+bool process_paste(fetchline_ctx_t *ctx, int *err)
 {
-    if (offset == 0)
-        return;
-    printf("\e[%d%c", abs(offset), (offset > 0) ? 'C' : 'D');
+    const char *start = ctx->inbuf + ctx->in_start;
+    size_t avail = ctx->in_end - ctx->in_start;
+    const char *end;
+    size_t len;
+
+    end = memmem(start, avail, PASTE_END, sizeof(PASTE_END) - 1);
+    len = (end) ? (size_t)(end - start) : avail - partial_end(start, avail);
+
+    if (gap_insert(ctx, start, len) < 0)
+    {
+        *err = -1;
+        return false;
+    }
+    ctx->in_start += len;
+
+    if (!end)
+        return false;
+
+    ctx->in_start += sizeof(PASTE_END) - 1;
+    ctx->pasting = false;
+    return true;
+}
+
+// Length of the start of PASTE_END data ends with
+size_t partial_end(const char *data, size_t len)
+{
+    size_t n = sizeof(PASTE_END) - 2;
+
+    if (n > len)
+        n = len;
+    for (; n > 0; n--)
+        if (memcmp(data + len - n, PASTE_END, n) == 0)
+            return n;
+
+    return 0;
+}
+
+/*
+ * Brings the terminal from what it shows to the line being edited. Only the
+ * part between what stayed the same at both ends is sent: appended text as
+ * it is, inserted text after opening room with ICH, deleted text with DCH,
+ * anything else rewritten up to the end. Nothing is written if nothing
+ * changed, the whole line only after the prompt did.
+ */
+int draw(fetchline_ctx_t *ctx)
+{
+    size_t len = ctx->slen;
+    size_t tail = ctx->text_cap - ctx->gap_end;
+    size_t pre, suf, old_mid, new_mid;
+    size_t col; // Position of the terminal cursor in the line
+    char *new_shown;
+    int ret = 0;
+
+    ctx->out_len = 0;
+
+    if (!ctx->shown_valid)
+    {
+        ret |= out_append(ctx, "\r", 1);
+        ret |= out_append(ctx, ctx->prompt, ctx->prompt_len);
+        ret |= out_text(ctx, 0, len);
+        ret |= out_append(ctx, "\e[K", 3);
+        col = len;
+    }
+    else
+    {
+        for (pre = 0; pre < len && pre < ctx->shown_len && gap_at(ctx, pre) == ctx->shown[pre]; pre++)
+            ;
+        for (suf = 0; suf < len - pre && suf < ctx->shown_len - pre &&
+                      gap_at(ctx, len - 1 - suf) == ctx->shown[ctx->shown_len - 1 - suf];
+             suf++)
+            ;
+
+        old_mid = ctx->shown_len - pre - suf;
+        new_mid = len - pre - suf;
+        col = ctx->shown_cursor;
+
+        if (old_mid > 0 || new_mid > 0)
+        {
+            ret |= move_cursor(ctx, col, pre);
+            col = pre;
+
+            if (old_mid == 0 && suf > 0)
+                ret |= out_csi(ctx, new_mid, '@');
+            else if (new_mid == 0)
+                ret |= out_csi(ctx, old_mid, 'P');
+
+            if (old_mid == new_mid || old_mid == 0)
+            {
+                ret |= out_text(ctx, pre, pre + new_mid);
+                col += new_mid;
+            }
+            else if (new_mid > 0)
+            {
+                ret |= out_text(ctx, pre, len);
+                ret |= out_append(ctx, "\e[K", 3);
+                col = len;
+            }
+        }
+    }
+
+    ret |= move_cursor(ctx, col, ctx->cursor_pos);
+    if (ret < 0)
+    {
+        ctx->shown_valid = false;
+        return -1;
+    }
+
+    // Whatever went through stdio has to come first
+    fflush(stdout);
+    if (out_flush(ctx) < 0)
+    {
+        ctx->shown_valid = false;
+        return 0; // Nothing to do about the terminal, the next draw starts over
+    }
+
+    if (ctx->shown_cap < len)
+    {
+        new_shown = realloc(ctx->shown, len);
+        if (!new_shown)
+        {
+            ctx->shown_valid = false;
+            return -1;
+        }
+
+        ctx->shown = new_shown;
+        ctx->shown_cap = len;
+    }
+
+    if (ctx->cursor_pos > 0)
+        memcpy(ctx->shown, ctx->text, ctx->cursor_pos);
+    if (tail > 0)
+        memcpy(ctx->shown + ctx->cursor_pos, ctx->text + ctx->gap_end, tail);
+    ctx->shown_len = len;
+    ctx->shown_cursor = ctx->cursor_pos;
+    ctx->shown_valid = true;
+
+    return 0;
+}
+
+// Goes to the column of to, counted past the prompt, so the terminal's idea of from doesn't matter
+int move_cursor(fetchline_ctx_t *ctx, size_t from, size_t to)
+{
+    if (to == from)
+        return 0;
+
+    return out_csi(ctx, ctx->prompt_width + to + 1, 'G');
+}
+
+// The count is left out when it's 1, which is the default
+int out_csi(fetchline_ctx_t *ctx, size_t count, char final)
+{
+    char seq[32];
+    int len;
+
+    if (count == 1)
+        len = snprintf(seq, sizeof(seq), "\e[%c", final);
+    else
+        len = snprintf(seq, sizeof(seq), "\e[%zu%c", count, final);
+
+    return out_append(ctx, seq, len);
+}
+
+// Part of the line between from and to, on either side of the gap
+int out_text(fetchline_ctx_t *ctx, size_t from, size_t to)
+{
+    size_t split = (to < ctx->cursor_pos) ? to : ctx->cursor_pos;
+    const char *after = ctx->text + ctx->gap_end - ctx->cursor_pos;
+
+    if (from < split && out_visible(ctx, ctx->text + from, split - from) < 0)
+        return -1;
+    if (from > split)
+        split = from;
+    if (split < to && out_visible(ctx, after + split, to - split) < 0)
+        return -1;
+
+    return 0;
+}
+
+// Pasted control characters are shown as one column each to keep the cursor right
+int out_visible(fetchline_ctx_t *ctx, const char *data, size_t len)
+{
+    size_t i, run = 0;
+    const char *sub;
+
+    for (i = 0; i < len; i++)
+    {
+        if (!iscntrl((unsigned char)data[i]))
+            continue;
+
+        sub = (data[i] == '\n') ? "\u21b5" : (data[i] == '\t') ? " " : "?";
+        if (out_append(ctx, data + run, i - run) < 0 || out_append(ctx, sub, strlen(sub)) < 0)
+            return -1;
+        run = i + 1;
+    }
+
+    return out_append(ctx, data + run, len - run);
+}
+
+int out_append(fetchline_ctx_t *ctx, const char *data, size_t len)
+{
+    size_t new_cap;
+    char *new_out;
+
+    if (ctx->out_cap - ctx->out_len < len)
+    {
+        new_cap = (ctx->out_cap) ? ctx->out_cap : FL_OUT_LEN;
+        while (new_cap - ctx->out_len < len)
+            new_cap *= 2;
+
+        new_out = realloc(ctx->out, new_cap);
+        if (!new_out)
+            return -1;
+
+        ctx->out = new_out;
+        ctx->out_cap = new_cap;
+    }
+
+    if (len > 0)
+        memcpy(ctx->out + ctx->out_len, data, len);
+    ctx->out_len += len;
+
+    return 0;
+}
+
+int out_flush(fetchline_ctx_t *ctx)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < ctx->out_len)
+    {
+        n = write(STDOUT_FILENO, ctx->out + off, ctx->out_len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        off += n;
+    }
+
+    ctx->out_len = 0;
+
+    return 0;
 }
 
 void erase_line()
@@ -299,49 +745,107 @@ void erase_line()
     fputs("\e[2K\r", stdout);
 }
 
-int charcat(char **dest, size_t *destlen, size_t slen, char c, size_t index)
+// Inserts at the cursor, the gap doubles when it's used up
+int gap_insert(fetchline_ctx_t *ctx, const char *data, size_t len)
 {
-    size_t new_size;
-    char *new_buf;
+    size_t tail = ctx->text_cap - ctx->gap_end;
+    size_t new_cap;
+    char *new_text;
+
+    if (len == 0)
+        return 0;
 
-    if (*destlen < slen + 1)
+    if (ctx->gap_end - ctx->cursor_pos < len)
     {
-        new_size = *destlen * 2 / 3;
-        if (new_size < slen)
-            new_size = slen + 1;
+        new_cap = (ctx->text_cap) ? ctx->text_cap * 2 : FL_LINE_LEN;
+        while (new_cap - ctx->slen < len)
+            new_cap *= 2;
 
-        new_buf = realloc(*dest, new_size);
-        if (!new_buf)
+        new_text = realloc(ctx->text, new_cap);
+        if (!new_text)
             return -1;
 
-        *destlen = new_size;
-        *dest = new_buf;
+        // The text after the gap stays at the end
+        if (tail > 0)
+            memmove(new_text + new_cap - tail, new_text + ctx->gap_end, tail);
+
+        ctx->text = new_text;
+        ctx->text_cap = new_cap;
+        ctx->gap_end = new_cap - tail;
     }
 
-    if (slen == index)
+    memcpy(ctx->text + ctx->cursor_pos, data, len);
+    ctx->cursor_pos += len;
+    ctx->slen += len;
+
+    return 0;
+}
+
+// Moves the gap to pos, which costs the text in between
+void gap_move(fetchline_ctx_t *ctx, size_t pos)
+{
+    size_t n;
+
+    if (pos < ctx->cursor_pos)
     {
-        (*dest)[slen] = c;
-        (*dest)[slen + 1] = '\0';
+        n = ctx->cursor_pos - pos;
+        memmove(ctx->text + ctx->gap_end - n, ctx->text + pos, n);
+        ctx->gap_end -= n;
     }
-    else
+    else if (pos > ctx->cursor_pos)
     {
-        memmove(*dest + index + 1, *dest + index, slen - index + 1); // + 1 in length for '\0'
-        (*dest)[index] = c;
+        n = pos - ctx->cursor_pos;
+        memmove(ctx->text + ctx->cursor_pos, ctx->text + ctx->gap_end, n);
+        ctx->gap_end += n;
     }
-    return 0;
+
+    ctx->cursor_pos = pos;
 }
 
-void delchar(char *str, size_t index)
+// Replaces the line, with the cursor at its end
+int gap_set(fetchline_ctx_t *ctx, const char *data, size_t len)
 {
-    size_t slen;
+    ctx->cursor_pos = 0;
+    ctx->slen = 0;
+    ctx->gap_end = ctx->text_cap;
 
-    slen = strlen(str);
+    return gap_insert(ctx, data, len);
+}
 
-    if (index == slen - 1)
+char gap_at(const fetchline_ctx_t *ctx, size_t index)
+{
+    if (index < ctx->cursor_pos)
+        return ctx->text[index];
+
+    return ctx->text[ctx->gap_end + index - ctx->cursor_pos];
+}
+
+// Copies the line out to the caller's buffer, once it's done
+int flatten(fetchline_ctx_t *ctx)
+{
+    size_t tail = ctx->text_cap - ctx->gap_end;
+    size_t new_len;
+    char *new_buf;
+
+    if (*ctx->buflen < ctx->slen + 1)
     {
-        str[index] = '\0';
-        return;
+        new_len = *ctx->buflen * 2;
+        if (new_len < ctx->slen + 1)
+            new_len = ctx->slen + 1;
+
+        new_buf = realloc(*ctx->buffer, new_len);
+        if (!new_buf)
+            return -1;
+
+        *ctx->buffer = new_buf;
+        *ctx->buflen = new_len;
     }
 
-    memmove(str + index, str + index + 1, slen - index);
-}
\ No newline at end of file
+    if (ctx->cursor_pos > 0)
+        memcpy(*ctx->buffer, ctx->text, ctx->cursor_pos);
+    if (tail > 0)
+        memcpy(*ctx->buffer + ctx->cursor_pos, ctx->text + ctx->gap_end, tail);
+    (*ctx->buffer)[ctx->slen] = '\0';
+
+    return 0;
+}
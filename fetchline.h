@@ -2,6 +2,7 @@
 #define FETCHLINE_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <termios.h>
 
@@ -12,17 +13,64 @@
 #define FL_RET_MEM_FAIL -2
 #define FL_RET_SYS_FAIL -3
 #define FL_RET_EOF -4
+#define FL_RET_AGAIN -5
+
+#define FL_INBUF_LEN 65536
+#define FL_OUT_LEN 256
+#define FL_LINE_LEN 256
 
 typedef struct fetchline_ctx
 {
     history_t hist;
     struct termios old_opts;
+
+    // State of the line being edited
+    bool active;
+    const char *prompt;
+    size_t prompt_len;
+    size_t prompt_width; // Columns, the line starts right after them
+    char **buffer; // Only filled in once the line is done
+    size_t *buflen;
+    size_t cursor_pos;
+    size_t slen;
+
+    // The line as a gap buffer, the gap starts at cursor_pos
+    char *text;
+    size_t text_cap;
+    size_t gap_end; // Text after the cursor starts here
+    bool pasting; // Inside a bracketed paste, input is inserted as it is
+
+    // Input read from the terminal but not yet consumed
+    char inbuf[FL_INBUF_LEN];
+    size_t in_start;
+    size_t in_end;
+
+    // What the terminal shows, draws only send the difference
+    bool shown_valid; // Cleared when the prompt has to be printed again
+    char *shown;
+    size_t shown_len;
+    size_t shown_cap;
+    size_t shown_cursor;
+
+    // Escape sequences and text of a draw, sent with one write()
+    char *out;
+    size_t out_len;
+    size_t out_cap;
 } fetchline_ctx_t;
 
 int fetchline_ctx_init(fetchline_ctx_t *context);
 
 void fetchline_ctx_free(fetchline_ctx_t *context);
 
-ssize_t fetchline(fetchline_ctx_t *context, const char *prompt, char **buffer, size_t *buflen);
+ssize_t fetchline_begin(fetchline_ctx_t *context, const char *prompt, size_t prompt_width, char **buffer,
+                        size_t *buflen);
+
+ssize_t fetchline_feed(fetchline_ctx_t *context);
+
+void fetchline_hide(fetchline_ctx_t *context);
+
+void fetchline_set_prompt(fetchline_ctx_t *context, const char *prompt, size_t prompt_width);
+
+void fetchline_redraw(fetchline_ctx_t *context);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,56 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "heredoc.h"
+
+/*
+ * Puts the body in a sealed memfd, ready to be read from the start. No
+ * temporary file or writer process is needed, and the command gets a stdin
+ * it can seek in and map like a regular file, which nothing can change
+ * under it.
+ */
+int heredoc_open(const here_doc_t *doc)
+{
+    size_t off = 0;
+    ssize_t nwritten;
+    int fd, err;
+
+    fd = memfd_create("kai-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+
+    while (off < doc->len)
+    {
+        nwritten = write(fd, doc->data + off, doc->len - off);
+        if (nwritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+
+        off += nwritten;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+        goto fail;
+
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        goto fail;
+
+    return fd;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return -1;
+}
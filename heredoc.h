@@ -0,0 +1,8 @@
+#ifndef HEREDOC_H
+#define HEREDOC_H
+
+#include "parser.h"
+
+int heredoc_open(const here_doc_t *doc);
+
+#endif
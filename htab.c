@@ -0,0 +1,194 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <errno.h>
+
+#include "htab.h"
+
+// Marks a slot whose entry was removed, so probing continues past it
+static const char TOMBSTONE[] = "";
+
+static uint32_t hash_name(const char *name, size_t len);
+
+static htab_key_t *slot(const htab_t *tab, size_t index);
+
+static htab_key_t *find_slot(htab_t *tab, const char *name, size_t len, bool insert);
+
+static int grow(htab_t *tab);
+
+void htab_init(htab_t *tab, size_t entry_size, size_t initial)
+{
+    tab->capacity = 0;
+    tab->count = 0;
+    tab->used = 0;
+    tab->entry_size = entry_size;
+    tab->initial = initial;
+    tab->entries = NULL;
+}
+
+// Only the slots are freed, what the entries point to is up to the caller
+void htab_free(htab_t *tab)
+{
+    free(tab->entries);
+    htab_init(tab, tab->entry_size, tab->initial);
+}
+
+void htab_clear(htab_t *tab)
+{
+    if (tab->capacity > 0)
+        memset(tab->entries, 0, tab->capacity * tab->entry_size);
+
+    tab->count = 0;
+    tab->used = 0;
+}
+
+void *htab_find(htab_t *tab, const char *name, size_t len)
+{
+    if (tab->capacity == 0)
+        return NULL;
+
+    return find_slot(tab, name, len, false);
+}
+
+/*
+ * Adds an entry for the key, name is stored as it is and has to stay valid
+ * while the entry does. The rest of the entry is zeroed for the caller to
+ * fill in. Fails with EEXIST if the key is taken.
+ */
+void *htab_insert(htab_t *tab, const char *name, size_t len)
+{
+    htab_key_t *key;
+
+    // Keep load factor under 3/4 including tombstones
+    if ((tab->used + 1) * 4 > tab->capacity * 3 && grow(tab) < 0)
+        return NULL;
+
+    key = find_slot(tab, name, len, true);
+    if (!key)
+    {
+        errno = EEXIST;
+        return NULL;
+    }
+
+    memset(key, 0, tab->entry_size);
+    key->name = name;
+    key->len = len;
+
+    tab->count++;
+    tab->used++;
+
+    return key;
+}
+
+// Whatever the entry points to has to be released first
+void htab_remove(htab_t *tab, void *entry)
+{
+    htab_key_t *key = entry;
+
+    memset(key, 0, tab->entry_size);
+    key->name = TOMBSTONE;
+
+    tab->count--;
+}
+
+void *htab_next(htab_t *tab, size_t *iter)
+{
+    htab_key_t *key;
+
+    while (*iter < tab->capacity)
+    {
+        key = slot(tab, (*iter)++);
+        if (key->name && key->name != TOMBSTONE)
+            return key;
+    }
+
+    return NULL;
+}
+
+uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+
+    while (len-- > 0)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+htab_key_t *slot(const htab_t *tab, size_t index)
+{
+    return (htab_key_t *)((char *)tab->entries + index * tab->entry_size);
+}
+
+htab_key_t *find_slot(htab_t *tab, const char *name, size_t len, bool insert)
+{
+    size_t mask = tab->capacity - 1;
+    size_t i;
+    htab_key_t *key;
+    htab_key_t *free_slot = NULL;
+
+    for (i = hash_name(name, len) & mask;; i = (i + 1) & mask)
+    {
+        key = slot(tab, i);
+
+        if (!key->name)
+            break;
+
+        if (key->name == TOMBSTONE)
+        {
+            if (!free_slot)
+                free_slot = key;
+        }
+        else if (key->len == len && memcmp(key->name, name, len) == 0)
+        {
+            return (insert) ? NULL : key;
+        }
+    }
+
+    if (!insert)
+        return NULL;
+
+    if (free_slot)
+    {
+        tab->used--; // Reusing a tombstone
+        return free_slot;
+    }
+
+    return key;
+}
+
+int grow(htab_t *tab)
+{
+    void *old = tab->entries;
+    size_t old_cap = tab->capacity;
+    htab_key_t *key;
+    size_t i;
+
+    tab->capacity = (old_cap) ? old_cap * 2 : tab->initial;
+    tab->entries = calloc(tab->capacity, tab->entry_size);
+    if (!tab->entries)
+    {
+        tab->entries = old;
+        tab->capacity = old_cap;
+        return -1;
+    }
+
+    tab->used = tab->count;
+
+    // Rehash live entries, dropping tombstones
+    for (i = 0; i < old_cap; i++)
+    {
+        key = (htab_key_t *)((char *)old + i * tab->entry_size);
+        if (key->name && key->name != TOMBSTONE)
+            memcpy(find_slot(tab, key->name, key->len, true), key, tab->entry_size);
+    }
+
+    free(old);
+    return 0;
+}
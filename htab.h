@@ -0,0 +1,42 @@
+#ifndef HTAB_H
+#define HTAB_H
+
+#include <stddef.h>
+
+// Every entry starts with one, the key is the first len bytes of name
+typedef struct htab_key
+{
+    const char *name; // NULL for an empty slot
+    size_t len;
+} htab_key_t;
+
+/*
+ * Open addressing with linear probing, for the command, builtin and variable
+ * tables. Entries are entry_size bytes each, removed ones stay behind as
+ * tombstones until the next grow.
+ */
+typedef struct htab
+{
+    size_t capacity;
+    size_t count;
+    size_t used; // Live entries + tombstones
+    size_t entry_size;
+    size_t initial; // Capacity of the first allocation
+    void *entries;
+} htab_t;
+
+void htab_init(htab_t *tab, size_t entry_size, size_t initial);
+
+void htab_free(htab_t *tab);
+
+void htab_clear(htab_t *tab);
+
+void *htab_find(htab_t *tab, const char *name, size_t len);
+
+void *htab_insert(htab_t *tab, const char *name, size_t len);
+
+void htab_remove(htab_t *tab, void *entry);
+
+void *htab_next(htab_t *tab, size_t *iter);
+
+#endif
@@ -0,0 +1,815 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <termios.h>
+#include <errno.h>
+
+#include "jobs.h"
+
+#define INITIAL_CAPACITY 8
+#define TASK_POLL_MS 100
+
+static void update_proc(job_t *job, pid_t pid, int status, const struct rusage *rusage);
+
+static void update_state(job_t *job);
+
+static bool step_tasks(job_t *job);
+
+static void cancel_tasks(job_t *job);
+
+static bool procs_running(const job_t *job);
+
+static void reap_procs(job_t *job);
+
+static int wait_tasks(job_table_t *table, job_t *job);
+
+static int pidfd_open(pid_t pid);
+
+static bool unlink_job(job_table_t *table, job_t *job);
+
+static void release_stages(job_t *job);
+
+static int drop_finished(job_table_t *table, size_t index);
+
+void job_table_init(job_table_t *table)
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->jobs = NULL;
+    table->nfinished = 0;
+
+    table->job_control = false;
+    table->tty_fd = -1;
+    table->shell_pgid = getpgrp();
+    table->epfd = -1;
+    table->sigfd = -1;
+}
+
+void job_table_free(job_table_t *table)
+{
+    while (table->count > 0)
+        job_table_remove(table, table->jobs[table->count - 1]);
+
+    job_table_forget(table);
+
+    free(table->jobs);
+    table->jobs = NULL;
+    table->capacity = 0;
+}
+
+int job_control_init(job_table_t *table, int tty_fd)
+{
+    pid_t pgid;
+
+    if (!isatty(tty_fd))
+        return -1;
+
+    // Wait until we are put in the foreground
+    while (tcgetpgrp(tty_fd) != (pgid = getpgrp()))
+        kill(-pgid, SIGTTIN);
+
+    // Keyboard signals are meant for the foreground job, not for us
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    // Fails harmlessly if we already lead a session
+    setpgid(0, 0);
+
+    table->shell_pgid = getpgrp();
+    if (tcsetpgrp(tty_fd, table->shell_pgid) < 0)
+        return -1;
+
+    table->job_control = true;
+    table->tty_fd = tty_fd;
+
+    return 0;
+}
+
+job_t *job_table_add(job_table_t *table, const char *cmdline, size_t nprocs)
+{
+    size_t new_cap;
+    job_t **new_jobs;
+    job_t *job;
+    size_t i;
+
+    if (table->count == table->capacity)
+    {
+        new_cap = (table->capacity) ? table->capacity * 2 : INITIAL_CAPACITY;
+
+        new_jobs = realloc(table->jobs, new_cap * sizeof(job_t *));
+        if (!new_jobs)
+            return NULL;
+
+        table->jobs = new_jobs;
+        table->capacity = new_cap;
+    }
+
+    job = malloc(sizeof(job_t));
+    if (!job)
+        return NULL;
+
+    job->procs = malloc(nprocs * sizeof(job_proc_t));
+    job->cmdline = strdup(cmdline);
+    if (!job->procs || !job->cmdline)
+    {
+        free(job->procs);
+        free(job->cmdline);
+        free(job);
+
+        return NULL;
+    }
+
+    // Numbering continues after the most recent job
+    job->id = (table->count > 0) ? table->jobs[table->count - 1]->id + 1 : 1;
+    job->pgid = 0;
+    job->state = JOB_RUNNING;
+    job->notify = false;
+    job->interrupted = false;
+    job->has_tmodes = false;
+    job->helpers = NULL;
+    job->nhelpers = 0;
+
+    job->nprocs = nprocs;
+    for (i = 0; i < nprocs; i++)
+    {
+        job->procs[i].pid = -1;
+        job->procs[i].pidfd = -1;
+        job->procs[i].task = NULL;
+        job->procs[i].status = 0;
+        job->procs[i].done = true; // Until it is actually started
+        job->procs[i].stopped = false;
+        memset(&job->procs[i].rusage, 0, sizeof(struct rusage));
+    }
+
+    table->jobs[table->count++] = job;
+
+    return job;
+}
+
+void job_table_remove(job_table_t *table, job_t *job)
+{
+    if (!unlink_job(table, job))
+        return;
+
+    release_stages(job);
+    free(job->procs);
+    free(job->cmdline);
+    free(job);
+}
+
+/*
+ * Keeps a finished job's status around for wait after the job has left the
+ * table, dropping the oldest one once there are too many.
+ */
+void job_table_retire(job_table_t *table, job_t *job)
+{
+    if (!unlink_job(table, job))
+        return;
+
+    release_stages(job);
+
+    if (table->nfinished == JOB_FINISHED_MAX)
+        drop_finished(table, 0);
+
+    table->finished[table->nfinished++] = job;
+}
+
+/*
+ * Returns the exit status of the retired job named by a %id or a pid and
+ * forgets the job, -1 if there is no such job.
+ */
+int job_table_claim(job_table_t *table, const char *spec)
+{
+    char *endptr;
+    long id = -1, pid = 0;
+    size_t i, j;
+
+    if (*spec == '%')
+        id = strtol(spec + 1, &endptr, 10);
+    else
+        pid = strtol(spec, &endptr, 10);
+
+    if (endptr == spec || *endptr != '\0')
+        return -1;
+
+    for (i = table->nfinished; i-- > 0;)
+    {
+        if (table->finished[i]->id == id)
+            return drop_finished(table, i);
+
+        for (j = 0; pid > 0 && j < table->finished[i]->nprocs; j++)
+        {
+            if (table->finished[i]->procs[j].pid == pid)
+                return drop_finished(table, i);
+        }
+    }
+
+    return -1;
+}
+
+void job_table_forget(job_table_t *table)
+{
+    while (table->nfinished > 0)
+        drop_finished(table, table->nfinished - 1);
+}
+
+/*
+ * Looks up a job by "%n" or "n". A missing spec, "%%" or "%+" refers to the
+ * most recent job and "%-" to the one before it.
+ */
+job_t *job_table_find(job_table_t *table, const char *spec)
+{
+    char *endptr;
+    long id;
+    size_t i;
+
+    if (table->count == 0)
+        return NULL;
+
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+        return table->jobs[table->count - 1];
+    if (strcmp(spec, "%-") == 0)
+        return (table->count > 1) ? table->jobs[table->count - 2] : NULL;
+
+    if (*spec == '%')
+        spec++;
+
+    id = strtol(spec, &endptr, 10);
+    if (*spec == '\0' || *endptr != '\0')
+        return NULL;
+
+    for (i = 0; i < table->count; i++)
+    {
+        if (table->jobs[i]->id == id)
+            return table->jobs[i];
+    }
+
+    return NULL;
+}
+
+job_t *job_table_find_pid(job_table_t *table, pid_t pid)
+{
+    size_t i, j;
+
+    for (i = 0; i < table->count; i++)
+    {
+        for (j = 0; j < table->jobs[i]->nprocs; j++)
+        {
+            if (table->jobs[i]->procs[j].pid == pid)
+                return table->jobs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Collects state changes of all jobs without blocking. Called whenever a
+ * pidfd turns readable or SIGCHLD arrives, so it has to cope with being
+ * woken up for children that were already reaped.
+ */
+void job_table_poll(job_table_t *table)
+{
+    size_t i;
+
+    for (i = 0; i < table->count; i++)
+    {
+        // In-process stages of background jobs move along here too
+        step_tasks(table->jobs[i]);
+        reap_procs(table->jobs[i]);
+        update_state(table->jobs[i]);
+    }
+}
+
+job_t *job_table_next_notify(job_table_t *table, size_t *iter)
+{
+    job_t *job;
+
+    while (*iter < table->count)
+    {
+        job = table->jobs[(*iter)++];
+        if (job->notify)
+        {
+            job->notify = false;
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+void job_watch(job_table_t *table, job_t *job)
+{
+    struct epoll_event ev;
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].task && !job->procs[i].done && table->epfd >= 0)
+            task_watch(job->procs[i].task, table->epfd);
+
+        if (job->procs[i].done || job->procs[i].task)
+            continue;
+
+        // job_wait may have opened it already, adding it twice fails harmlessly
+        if (job->procs[i].pidfd < 0)
+            job->procs[i].pidfd = pidfd_open(job->procs[i].pid);
+        if (job->procs[i].pidfd < 0 || table->epfd < 0)
+            continue;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = job->procs[i].pidfd;
+        epoll_ctl(table->epfd, EPOLL_CTL_ADD, job->procs[i].pidfd, &ev);
+    }
+
+    for (i = 0; i < job->nhelpers; i++)
+    {
+        if (!job->helpers[i]->done && table->epfd >= 0)
+            task_watch(job->helpers[i], table->epfd);
+    }
+}
+
+/*
+ * Blocks until every process of the job has exited or the job is stopped.
+ * In-process stages are run from here, the shell sleeps in poll() until one
+ * of them can move again or a process exits. Processes are reaped as they
+ * exit rather than in pipeline order, so each gets its own end time.
+ */
+int job_wait(job_table_t *table, job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (!job->procs[i].done && !job->procs[i].task && job->procs[i].pidfd < 0)
+            job->procs[i].pidfd = pidfd_open(job->procs[i].pid);
+    }
+
+    for (;;)
+    {
+        step_tasks(job);
+        reap_procs(job);
+
+        // Ctrl-C killed a process, in sh it would have reached every stage
+        if (job->interrupted)
+            cancel_tasks(job);
+
+        update_state(job);
+        if (job->state != JOB_RUNNING)
+            return 0; // Done, or processes were stopped and the stages wait for them
+
+        // Only in-process stages are left, Ctrl-C has to reach the shell to stop them
+        if (table->job_control && job->pgid > 0 && !procs_running(job) &&
+            tcgetpgrp(table->tty_fd) == job->pgid)
+            tcsetpgrp(table->tty_fd, table->shell_pgid);
+
+        if (wait_tasks(table, job) < 0)
+            return -1;
+    }
+}
+
+int job_foreground(job_table_t *table, job_t *job, bool cont)
+{
+    int ret;
+
+    // Jobs made only of in-process stages leave the terminal with us
+    if (table->job_control && job->pgid > 0)
+    {
+        tcsetpgrp(table->tty_fd, job->pgid);
+
+        if (cont && job->has_tmodes)
+            tcsetattr(table->tty_fd, TCSADRAIN, &job->tmodes);
+    }
+
+    if (cont && job_background(table, job) < 0)
+        return -1;
+
+    ret = job_wait(table, job);
+
+    if (table->job_control)
+    {
+        if (job->state == JOB_STOPPED)
+            job->has_tmodes = tcgetattr(table->tty_fd, &job->tmodes) == 0;
+
+        tcsetpgrp(table->tty_fd, table->shell_pgid);
+    }
+
+    return ret;
+}
+
+int job_background(job_table_t *table, job_t *job)
+{
+    size_t i;
+
+    if (job->pgid <= 0)
+    {
+        errno = EPERM; // Job shares our process group
+        return -1;
+    }
+
+    if (job->state == JOB_STOPPED && kill(-job->pgid, SIGCONT) < 0)
+        return -1;
+
+    for (i = 0; i < job->nprocs; i++)
+        job->procs[i].stopped = false;
+    update_state(job);
+    job->notify = false;
+
+    return 0;
+}
+
+void job_proc_started(job_t *job, size_t index, pid_t pid)
+{
+    job_proc_t *proc = &job->procs[index];
+
+    proc->pid = pid;
+    proc->done = false;
+    proc->stopped = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &proc->start);
+    proc->end = proc->start;
+}
+
+void job_task_started(job_t *job, size_t index, task_t *task)
+{
+    job_proc_started(job, index, 0);
+    job->procs[index].task = task;
+}
+
+// The job takes task over, it is freed with the job even on failure
+int job_add_helper(job_t *job, task_t *task)
+{
+    task_t **new_helpers;
+
+    new_helpers = realloc(job->helpers, (job->nhelpers + 1) * sizeof(task_t *));
+    if (!new_helpers)
+    {
+        task_free(task);
+        return -1;
+    }
+
+    job->helpers = new_helpers;
+    job->helpers[job->nhelpers++] = task;
+
+    return 0;
+}
+
+int job_exit_status(job_t *job)
+{
+    if (job->nprocs == 0)
+        return 0;
+
+    return job_proc_exit_status(&job->procs[job->nprocs - 1]);
+}
+
+int job_proc_exit_status(const job_proc_t *proc)
+{
+    if (WIFSIGNALED(proc->status))
+        return 128 + WTERMSIG(proc->status);
+
+    return WEXITSTATUS(proc->status);
+}
+
+const char *job_state_str(job_t *job)
+{
+    switch (job->state)
+    {
+    case JOB_RUNNING:
+        return "Running";
+    case JOB_STOPPED:
+        return "Stopped";
+    default:
+        return "Done";
+    }
+}
+
+void update_proc(job_t *job, pid_t pid, int status, const struct rusage *rusage)
+{
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].pid != pid)
+            continue;
+
+        if (WIFSTOPPED(status))
+        {
+            job->procs[i].stopped = true;
+        }
+        else if (WIFCONTINUED(status))
+        {
+            job->procs[i].stopped = false;
+        }
+        else
+        {
+            job->procs[i].done = true;
+            job->procs[i].status = status;
+            job->interrupted |= WIFSIGNALED(status) && WTERMSIG(status) == SIGINT;
+
+            clock_gettime(CLOCK_MONOTONIC, &job->procs[i].end);
+            if (rusage)
+                job->procs[i].rusage = *rusage;
+        }
+
+        break;
+    }
+
+    update_state(job);
+}
+
+void update_state(job_t *job)
+{
+    job_state_t state = JOB_DONE;
+    bool tasks = false;
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].done)
+            continue;
+
+        // In-process stages can't be stopped, they keep the job running
+        // only when there are no stopped processes
+        if (job->procs[i].task)
+        {
+            tasks = true;
+            continue;
+        }
+
+        if (!job->procs[i].stopped)
+        {
+            state = JOB_RUNNING;
+            break;
+        }
+
+        state = JOB_STOPPED;
+    }
+
+    for (i = 0; i < job->nhelpers; i++)
+        tasks |= !job->helpers[i]->done;
+
+    if (state == JOB_DONE && tasks)
+        state = JOB_RUNNING;
+
+    if (state != job->state)
+    {
+        job->state = state;
+        job->notify = true;
+    }
+}
+
+// Runs in-process stages until they block or yield, true if any are still going
+bool step_tasks(job_t *job)
+{
+    job_proc_t *proc;
+    bool live = false;
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        proc = &job->procs[i];
+        if (!proc->task || proc->done)
+            continue;
+
+        if (!task_step(proc->task))
+        {
+            live = true;
+            continue;
+        }
+
+        proc->done = true;
+        proc->status = W_EXITCODE(proc->task->status, 0);
+        clock_gettime(CLOCK_MONOTONIC, &proc->end);
+    }
+
+    for (i = 0; i < job->nhelpers; i++)
+    {
+        if (!job->helpers[i]->done && !task_step(job->helpers[i]))
+            live = true;
+    }
+
+    return live;
+}
+
+// Collects state changes of the job's processes without blocking
+void reap_procs(job_t *job)
+{
+    int status;
+    struct rusage rusage;
+    pid_t pid;
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].done || job->procs[i].task)
+            continue;
+
+        pid = wait4(job->procs[i].pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &rusage);
+        if (pid > 0)
+            update_proc(job, pid, status, &rusage);
+        else if (pid < 0 && errno == ECHILD)
+            update_proc(job, job->procs[i].pid, 0, NULL); // No longer ours to wait for
+    }
+}
+
+/*
+ * Sleeps until a stage of the job can make progress or one of its processes
+ * exits. Without a pidfd or signalfd a process is only noticed through a
+ * timeout.
+ */
+int wait_tasks(job_table_t *table, job_t *job)
+{
+    struct pollfd *fds;
+    struct signalfd_siginfo info;
+    task_t *task;
+    bool interrupted = false;
+    int timeout = -1;
+    size_t i, nfds = 0;
+    int ret;
+
+    fds = malloc((job->nprocs + job->nhelpers + 1) * sizeof(struct pollfd));
+    if (!fds)
+        return -1;
+
+    for (i = 0; i < job->nprocs + job->nhelpers; i++)
+    {
+        if (i < job->nprocs && job->procs[i].done)
+            continue;
+
+        task = (i < job->nprocs) ? job->procs[i].task : job->helpers[i - job->nprocs];
+        if (!task)
+        {
+            // A stop only shows through SIGCHLD, which needs job control to happen
+            if (job->procs[i].pidfd < 0 || (table->sigfd < 0 && table->job_control))
+                timeout = TASK_POLL_MS;
+            if (job->procs[i].pidfd < 0)
+                continue;
+
+            fds[nfds].fd = job->procs[i].pidfd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+            continue;
+        }
+        if (task->done)
+            continue;
+
+        fds[nfds].fd = task->wait_fd;
+        fds[nfds].events = (task->wait_events & EPOLLOUT) ? POLLOUT : POLLIN;
+        nfds++;
+    }
+
+    if (table->sigfd >= 0)
+    {
+        fds[nfds].fd = table->sigfd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    ret = poll(fds, nfds, timeout);
+    free(fds);
+
+    if (ret < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    // Ctrl-C only reaches us when no process of the job has the terminal
+    while (table->sigfd >= 0 && read(table->sigfd, &info, sizeof(info)) == sizeof(info))
+        interrupted |= info.ssi_signo == SIGINT;
+
+    if (interrupted)
+    {
+        job->interrupted = true;
+        cancel_tasks(job);
+    }
+
+    return 0;
+}
+
+/*
+ * Ends in-process stages with the status SIGINT would have given them. A
+ * stage reading the output of one Ctrl-C ended may have seen EOF and
+ * finished first, it gets that status too.
+ */
+void cancel_tasks(job_t *job)
+{
+    job_proc_t *proc;
+    bool fed = false; // The stage before was ended by Ctrl-C
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        proc = &job->procs[i];
+
+        if (!proc->task)
+        {
+            fed = proc->done && WIFSIGNALED(proc->status) && WTERMSIG(proc->status) == SIGINT;
+            continue;
+        }
+
+        task_cancel(proc->task, 128 + SIGINT);
+
+        // Captured stages and those reading only files never waited on their input
+        if (proc->done && fed && !proc->task->captured && proc->task->reads_input)
+            proc->status = W_EXITCODE(128 + SIGINT, 0);
+
+        // Cancelled ones are only marked done by the next step
+        fed = ((proc->done) ? job_proc_exit_status(proc) : proc->task->status) == 128 + SIGINT;
+    }
+
+    for (i = 0; i < job->nhelpers; i++)
+        task_cancel(job->helpers[i], 128 + SIGINT);
+}
+
+bool procs_running(const job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (!job->procs[i].task && !job->procs[i].done && !job->procs[i].stopped)
+            return true;
+    }
+
+    return false;
+}
+
+int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+bool unlink_job(job_table_t *table, job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < table->count; i++)
+    {
+        if (table->jobs[i] == job)
+            break;
+    }
+    if (i == table->count)
+        return false;
+
+    // Keep jobs ordered by id
+    memmove(&table->jobs[i], &table->jobs[i + 1], (table->count - i - 1) * sizeof(job_t *));
+    table->count--;
+
+    return true;
+}
+
+void release_stages(job_t *job)
+{
+    size_t i;
+
+    // Closing a pidfd also drops it from the epoll set
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].pidfd >= 0)
+            close(job->procs[i].pidfd);
+
+        task_free(job->procs[i].task);
+        job->procs[i].pidfd = -1;
+        job->procs[i].task = NULL;
+    }
+
+    for (i = 0; i < job->nhelpers; i++)
+        task_free(job->helpers[i]);
+
+    free(job->helpers);
+    job->helpers = NULL;
+    job->nhelpers = 0;
+}
+
+int drop_finished(job_table_t *table, size_t index)
+{
+    job_t *job = table->finished[index];
+    int status = job_exit_status(job);
+
+    memmove(&table->finished[index], &table->finished[index + 1],
+            (table->nfinished - index - 1) * sizeof(job_t *));
+    table->nfinished--;
+
+    free(job->procs);
+    free(job->cmdline);
+    free(job);
+
+    return status;
+}
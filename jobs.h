@@ -0,0 +1,118 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <termios.h>
+#include <time.h>
+
+#include "task.h"
+
+#define JOB_FINISHED_MAX 16
+
+typedef enum job_state
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} job_state_t;
+
+typedef struct job_proc
+{
+    pid_t pid;
+    int pidfd; // -1 if not watched or pidfds are unsupported
+    task_t *task; // In-process stage, pid is 0 then
+    int status;
+    bool done;
+    bool stopped;
+
+    // Filled in by wait4() once the process has exited
+    struct rusage rusage;
+    struct timespec start;
+    struct timespec end;
+} job_proc_t;
+
+typedef struct job
+{
+    int id;
+    pid_t pgid;
+    job_state_t state;
+    bool notify; // State changed since the user was last told
+    bool interrupted; // A stage was ended by Ctrl-C
+    char *cmdline;
+
+    size_t nprocs;
+    job_proc_t *procs;
+
+    // Run by the shell next to the stages, like fan-out copies
+    task_t **helpers;
+    size_t nhelpers;
+
+    struct termios tmodes; // Terminal modes the job was stopped with
+    bool has_tmodes;
+} job_t;
+
+typedef struct job_table
+{
+    size_t count;
+    size_t capacity;
+    job_t **jobs;
+
+    // Background jobs reported done but not yet collected by wait
+    job_t *finished[JOB_FINISHED_MAX];
+    size_t nfinished;
+
+    bool job_control;
+    int tty_fd;
+    pid_t shell_pgid;
+    int epfd; // pidfds of watched jobs are added here, -1 for none
+    int sigfd; // Delivers SIGCHLD and SIGINT while in-process stages run, -1 for none
+} job_table_t;
+
+void job_table_init(job_table_t *table);
+
+void job_table_free(job_table_t *table);
+
+int job_control_init(job_table_t *table, int tty_fd);
+
+job_t *job_table_add(job_table_t *table, const char *cmdline, size_t nprocs);
+
+void job_table_remove(job_table_t *table, job_t *job);
+
+void job_table_retire(job_table_t *table, job_t *job);
+
+int job_table_claim(job_table_t *table, const char *spec);
+
+void job_table_forget(job_table_t *table);
+
+job_t *job_table_find(job_table_t *table, const char *spec);
+
+job_t *job_table_find_pid(job_table_t *table, pid_t pid);
+
+void job_table_poll(job_table_t *table);
+
+job_t *job_table_next_notify(job_table_t *table, size_t *iter);
+
+void job_watch(job_table_t *table, job_t *job);
+
+int job_wait(job_table_t *table, job_t *job);
+
+int job_foreground(job_table_t *table, job_t *job, bool cont);
+
+int job_background(job_table_t *table, job_t *job);
+
+void job_proc_started(job_t *job, size_t index, pid_t pid);
+
+void job_task_started(job_t *job, size_t index, task_t *task);
+
+int job_add_helper(job_t *job, task_t *task);
+
+int job_exit_status(job_t *job);
+
+int job_proc_exit_status(const job_proc_t *proc);
+
+const char *job_state_str(job_t *job);
+
+#endif
@@ -1,32 +1,135 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #include <unistd.h>
-#include <limits.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <errno.h>
 
 #include "kai.h"
 #include "fetchline.h"
 #include "eval.h"
+#include "script.h"
+#include "builtin.h"
 
 #define INITIAL_LINE_LEN 64
-#define INITIAL_PROMPT_LEN 128
+#define MAX_EVENTS 16
 
-static const char PROMPT_FMT[] = "\e[1m\e[34m%s\e[39m@\e[33m%s\e[39m \e[32m%s\e[39m%s ";
-static const char PROMPT_USER_SYM[] = "\e[1m%\e[0m";
-static const char PROMPT_ROOT_SYM[] = "\e[31m\e[1m#\e[0m";
+static const char PROMPT_MORE[] = "> ";
 
-static int gen_prompt(char **prompt, size_t *length);
+extern char **environ;
 
-int main()
+static const char USAGE[] = "Usage: %s [-c command | script]\n";
+
+static int interactive(kai_ctx_t *kai_ctx);
+
+static ssize_t wait_events(int epfd, int sigfd, kai_ctx_t *kai_ctx, fetchline_ctx_t *fctx);
+
+static void reap_jobs(kai_ctx_t *kai_ctx, fetchline_ctx_t *fctx);
+
+static void update_prompt(kai_ctx_t *kai_ctx, fetchline_ctx_t *fctx);
+
+int main(int argc, char *argv[])
 {
-    kai_ctx_t context = {.running = true, .jobs = 0, .exit_code = 0};
+    kai_ctx_t context = {.running = true, .exit_code = 0, .optimize = true};
+    int fd;
+    int ret = 0;
+    bool script = true;
+
+    cmdhash_init(&context.cmdhash);
+    job_table_init(&context.jobs);
+    arena_init(&context.arena);
+    bhash_init(&context.builtins);
+    vars_init(&context.vars);
+
+    if (vars_import(&context.vars, environ) < 0)
+    {
+        fputs("[!] Failed to read the environment\n", stderr);
+        return 1;
+    }
+
+    if (builtin_init(&context) < 0)
+    {
+        fputs("[!] Failed to set up builtins\n", stderr);
+        return 1;
+    }
+
+    // In-process pipeline stages see EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
-    char *prompt;
-    size_t plen;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc != 3)
+        {
+            fprintf(stderr, USAGE, argv[0]);
+            return 2;
+        }
+
+        ret = script_run_string(argv[2], &context);
+    }
+    else if (argc > 1)
+    {
+        if (argc != 2 || argv[1][0] == '-')
+        {
+            fprintf(stderr, USAGE, argv[0]);
+            return 2;
+        }
+
+        fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fprintf(stderr, "[!] Failed to open %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+
+        ret = script_run_fd(fd, &context);
+        close(fd);
+    }
+    else if (!isatty(STDIN_FILENO))
+    {
+        ret = script_run_fd(STDIN_FILENO, &context);
+    }
+    else
+    {
+        script = false;
+
+        if (interactive(&context) < 0)
+            context.exit_code = 1;
+    }
+
+    if (script)
+    {
+        if (ret < 0)
+        {
+            fprintf(stderr, "[!] Failed to read input: %s\n", strerror(errno));
+            context.exit_code = 1;
+        }
+        else if (context.running)
+        {
+            // Scripts that don't call 'exit' end with the status of their last command
+            context.exit_code = context.last_status;
+        }
+    }
+
+    job_table_free(&context.jobs);
+    cmdhash_free(&context.cmdhash);
+    bhash_free(&context.builtins);
+    vars_free(&context.vars);
+    arena_free(&context.arena);
+    free(context.pipestatus);
+
+    return context.exit_code;
+}
+
+int interactive(kai_ctx_t *kai_ctx)
+{
     char *buffer;
     size_t buflen;
 
@@ -34,68 +137,110 @@ int main()
     ssize_t slen;
 
     eval_res_t evresult;
-    pid_t jpid;
+    job_t *job;
+    bool more = false; // Inside a heredoc body
+
+    sigset_t sigmask;
+    int epfd, sigfd;
+    struct epoll_event ev;
 
-    plen = INITIAL_PROMPT_LEN;
-    prompt = malloc(sizeof(char) * plen);
-    if (!prompt)
+    // Host, user and directory are looked up here, then only when they change
+    if (prompt_init(&kai_ctx->prompt, kai_ctx) < 0)
     {
-        fputs("[!] Failed to allocate memory for prompt text", stderr);
-        return 1;
+        fputs("[!] Failed to generate prompt", stderr);
+        return -1;
     }
 
     buflen = INITIAL_LINE_LEN;
     buffer = malloc(sizeof(char) * buflen);
     if (!buffer)
     {
-        free(prompt);
+        prompt_free(&kai_ctx->prompt);
 
         fputs("[!] Failed to allocate memory for line buffer", stderr);
-        return 1;
+        return -1;
     }
 
+    // SIGCHLD is only ever received through the signalfd, as is SIGINT
+    // while in-process pipeline stages hold the terminal
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGCHLD);
+    sigaddset(&sigmask, SIGINT);
+    sigprocmask(SIG_BLOCK, &sigmask, NULL);
+
+    sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigfd < 0 || epfd < 0)
+    {
+        prompt_free(&kai_ctx->prompt);
+        free(buffer);
+
+        fputs("[!] Failed to set up event loop", stderr);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    ev.data.fd = sigfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+    // Slow prompt segments finished in the background
+    if (kai_ctx->prompt.efd >= 0)
+    {
+        ev.data.fd = kai_ctx->prompt.efd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, kai_ctx->prompt.efd, &ev);
+    }
+
+    kai_ctx->jobs.epfd = epfd;
+    kai_ctx->jobs.sigfd = sigfd;
+    if (job_control_init(&kai_ctx->jobs, STDIN_FILENO) < 0)
+        fputs("[!] Failed to enable job control\n", stderr);
+
     fetchline_ctx_init(&fctx);
 
-    while (context.running)
+    while (kai_ctx->running)
     {
-        if (context.jobs > 0)
-        {
-            jpid = waitpid(-1, NULL, WNOHANG);
-            if (jpid < -1)
-            {
-                fputs("[!] waitpid() failed", stderr);
-                context.exit_code = 1;
-                break;
-            }
-            else if (jpid > 0)
-            {
-                context.jobs--;
-                printf("[%d] job finished - total jobs: %zu\n", jpid, context.jobs);
-            }
-        }
+        reap_jobs(kai_ctx, &fctx);
 
-        if (gen_prompt(&prompt, &plen) < 0)
+        if (!more && prompt_render(&kai_ctx->prompt, kai_ctx) < 0)
         {
             fputs("[!] Failed to generate prompt", stderr);
-            context.exit_code = 1;
+            kai_ctx->exit_code = 1;
             break;
         }
 
-        slen = fetchline(&fctx, prompt, &buffer, &buflen);
-        if (slen == FL_RET_EMPTY || slen == FL_RET_INTERRUPT)
+        if (more)
+            slen = fetchline_begin(&fctx, PROMPT_MORE, sizeof(PROMPT_MORE) - 1, &buffer, &buflen);
+        else
+            slen = fetchline_begin(&fctx, kai_ctx->prompt.text, kai_ctx->prompt.width, &buffer, &buflen);
+        while (slen == FL_RET_AGAIN)
+            slen = wait_events(epfd, sigfd, kai_ctx, &fctx);
+
+        // Ctrl-C drops a heredoc that is being typed, blank lines are part of it
+        if (slen == FL_RET_INTERRUPT)
+        {
+            eval_end(&evresult, kai_ctx);
+            prompt_invalidate(&kai_ctx->prompt, PROMPT_EV_EVAL);
+            more = false;
+            continue;
+        }
+        if (slen == FL_RET_EMPTY && !more)
             continue;
         if (slen < 0)
         {
             if (slen != FL_RET_EOF)
             {
                 fputs("[!] Failed to process input\n", stderr);
-                context.exit_code = 1;
+                kai_ctx->exit_code = 1;
             }
 
             break;
         }
 
-        eval(&evresult, buffer, &context);
+        eval(&evresult, buffer, kai_ctx);
+        prompt_invalidate(&kai_ctx->prompt, PROMPT_EV_EVAL);
+        more = evresult.status == EVAL_STATUS_MORE;
         if (evresult.status < 0)
         {
             printf("[!] Error: %s\n", evresult.err_msg);
@@ -104,60 +249,109 @@ int main()
 
         if (evresult.bg_pid > 0)
         {
-            context.jobs++;
-            printf("[%d] job started - total jobs: %zu\n", evresult.bg_pid, context.jobs);
+            job = job_table_find_pid(&kai_ctx->jobs, evresult.bg_pid);
+            if (job)
+                printf("[%d] %d job started - total jobs: %zu\n", job->id, evresult.bg_pid, kai_ctx->jobs.count);
         }
     }
 
-    free(prompt);
+    eval_end(&evresult, kai_ctx);
+    if (evresult.status < 0)
+        printf("[!] Error: %s\n", evresult.err_msg);
+
+    prompt_free(&kai_ctx->prompt);
     free(buffer);
 
     fetchline_ctx_free(&fctx);
 
-    return context.exit_code;
+    close(epfd);
+    close(sigfd);
+
+    return 0;
 }
 
-int gen_prompt(char **prompt, size_t *length)
+ssize_t wait_events(int epfd, int sigfd, kai_ctx_t *kai_ctx, fetchline_ctx_t *fctx)
 {
-    char host[HOST_NAME_MAX + 1];
-    char path[PATH_MAX + 1];
-    char user[LOGIN_NAME_MAX + 1];
-    uid_t uid;
-    char const *sym;
+    struct epoll_event events[MAX_EVENTS];
+    struct signalfd_siginfo info;
+    ssize_t ret = FL_RET_AGAIN;
+    int n, i;
 
-    size_t len;
-    char *newbuf;
+    n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0)
+        return (errno == EINTR) ? FL_RET_AGAIN : FL_RET_SYS_FAIL;
 
-    if (gethostname(host, sizeof(host)) != 0)
-        return -1;
+    for (i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == STDIN_FILENO)
+        {
+            ret = fetchline_feed(fctx);
+            continue;
+        }
 
-    if (!getcwd(path, sizeof(path)))
-        return -1;
+        if (events[i].data.fd == kai_ctx->prompt.efd)
+        {
+            if (prompt_collect(&kai_ctx->prompt) > 0)
+            {
+                update_prompt(kai_ctx, fctx);
+                fetchline_redraw(fctx);
+            }
+            continue;
+        }
 
-    uid = geteuid();
-    if (uid == 0)
-    {
-        strcpy(user, "root");
-        sym = PROMPT_ROOT_SYM;
+        if (events[i].data.fd == sigfd)
+        {
+            while (read(sigfd, &info, sizeof(info)) > 0)
+                ;
+        }
+
+        // SIGCHLD or a job's pidfd turned readable
+        reap_jobs(kai_ctx, fctx);
     }
-    else
+
+    return ret;
+}
+
+void reap_jobs(kai_ctx_t *kai_ctx, fetchline_ctx_t *fctx)
+{
+    job_t *job;
+    size_t iter;
+    bool hidden = false;
+
+    job_table_poll(&kai_ctx->jobs);
+
+    iter = 0;
+    while ((job = job_table_next_notify(&kai_ctx->jobs, &iter)))
     {
-        if (getlogin_r(user, sizeof(user)) != 0)
-            return -1;
-        sym = PROMPT_USER_SYM;
+        // Print notices above the line that is being edited
+        if (!hidden)
+        {
+            fetchline_hide(fctx);
+            hidden = true;
+        }
+
+        printf("[%d] %s\t%s\n", job->id, job_state_str(job), job->cmdline);
+
+        if (job->state == JOB_DONE)
+        {
+            job_table_retire(&kai_ctx->jobs, job);
+            prompt_invalidate(&kai_ctx->prompt, PROMPT_EV_JOBS);
+            iter--;
+        }
     }
 
-    len = snprintf(NULL, 0, PROMPT_FMT, user, host, path, sym) + 1;
-    if (*length < len)
+    if (hidden)
     {
-        newbuf = realloc(*prompt, len);
-        if (!newbuf)
-            return -1;
-
-        *length = len;
-        *prompt = newbuf;
+        update_prompt(kai_ctx, fctx);
+        fetchline_redraw(fctx);
     }
-    snprintf(*prompt, len, PROMPT_FMT, user, host, path, sym);
+}
 
-    return 0;
+// Gives the line being edited the current prompt, heredoc lines keep theirs
+void update_prompt(kai_ctx_t *kai_ctx, fetchline_ctx_t *fctx)
+{
+    if (kai_ctx->more.delim || prompt_render(&kai_ctx->prompt, kai_ctx) < 0)
+        return;
+
+    fetchline_set_prompt(fctx, kai_ctx->prompt.text, kai_ctx->prompt.width);
 }
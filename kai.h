@@ -4,10 +4,44 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "arena.h"
+#include "bhash.h"
+#include "cmdhash.h"
+#include "jobs.h"
+#include "prompt.h"
+#include "vars.h"
+
 typedef struct kai_ctx {
     bool running;
-    size_t jobs;
+    job_table_t jobs;
     int exit_code;
+
+    // Exit status of the last command and of each stage of the last pipeline
+    int last_status;
+    int *pipestatus;
+    size_t pipestatus_count;
+    bool interrupted; // Ctrl-C ended a foreground job, cleared by whoever checks it
+
+    bool optimize; // Rewrite pipelines before running them, see optimize.c
+    size_t pipe_size; // Capacity of pipeline pipes, 0 for the kernel default
+
+    cmdhash_t cmdhash;
+    vars_t vars; // Shell variables, the exported ones make up the environment of programs
+    bhash_t builtins; // Compiled in ones and those enabled from plugins
+    prompt_t prompt; // Interactive only, see prompt.c
+
+    // Per-line parser allocations, reset after every eval()
+    arena_t arena;
+
+    // Lines of a command waiting for the end of a heredoc body, see eval()
+    struct
+    {
+        char *text;
+        size_t len;
+        size_t cap;
+        char *delim; // NULL if nothing is waiting
+        bool strip_tabs;
+    } more;
 } kai_ctx_t;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+#ifndef KAI_PLUGIN_H
+#define KAI_PLUGIN_H
+
+/*
+ * Interface for builtins loaded with 'enable -f'. A plugin is a shared object
+ * exporting a kai_plugin_t named kai_plugin, most easily defined with
+ * KAI_PLUGIN(). It has to be built against the headers of the same shell
+ * build it is loaded into.
+ *
+ * Builtins follow the rules of the ones compiled in: they print to stdout
+ * and stderr, return 1 once done with result->status and exit_status set, -1
+ * with result->err_msg on failure, or 0 to have the command run as a program
+ * after all.
+ */
+
+#include <stddef.h>
+
+#include "parser.h"
+#include "eval.h"
+#include "kai.h"
+
+#define KAI_PLUGIN_ABI 1
+
+#define KAI_BUILTIN_STAGE 0x1       // May run inside the shell as a pipeline stage
+#define KAI_BUILTIN_READS_INPUT 0x2 // Reads stdin as a stage, anything streaming into it runs apart from the shell
+
+typedef int (*kai_builtin_fn_t)(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+typedef struct kai_builtin
+{
+    const char *name;
+    kai_builtin_fn_t fn;
+    int flags;
+} kai_builtin_t;
+
+typedef struct kai_plugin
+{
+    int abi;
+    size_t ctx_size; // Catches plugins built against different headers
+
+    const kai_builtin_t *builtins; // Ends with an entry without a name
+} kai_plugin_t;
+
+#define KAI_PLUGIN_SYMBOL "kai_plugin"
+
+#define KAI_PLUGIN(builtins) const kai_plugin_t kai_plugin = {KAI_PLUGIN_ABI, sizeof(kai_ctx_t), (builtins)}
+
+#endif
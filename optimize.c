@@ -0,0 +1,359 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "optimize.h"
+#include "scan.h"
+
+// Option letters of sort that leave sorted input as it is
+#define SORT_IDEMPOTENT_OPTS "bdfghinrV"
+
+static bool is_cat(const command_t *cmd);
+
+static bool is_idempotent(const command_t *cmd);
+
+static bool same_argv(const command_t *a, const command_t *b);
+
+static bool plain_file(const char *path);
+
+static void drop_stage(command_list_t *cmds, size_t index);
+
+static bool bg_last(const list_node_t *node);
+
+static void print_pipeline(const command_list_t *cmds);
+
+static void print_word(const char *word);
+
+static void print_arg(const command_t *cmd, size_t index);
+
+static void print_here_doc(const here_doc_t *doc);
+
+/*
+ * Rewrites a pipeline into a cheaper one with the same output, returns the
+ * number of stages removed. Only exit statuses of the removed stages are
+ * lost, which shows in PIPESTATUS.
+ *
+ *   x | cat | y        =>  x | y
+ *   x | sort | sort    =>  x | sort         (same for uniq, head, tail)
+ *   cat FILE | x       =>  x < FILE
+ *   cat <<EOF | x      =>  x <<EOF
+ *
+ * A trailing or leading bare cat is kept, it decides whether the stage next
+ * to it talks to a terminal.
+ */
+size_t optimize_pipeline(command_list_t *cmds)
+{
+    size_t count = cmds->count;
+    command_t *first, *next;
+    const char *file;
+    size_t i;
+
+    // Arguments aren't known before their substitutions have run
+    for (i = 0; i < cmds->count; i++)
+    {
+        if (cmds->commands[i].nexpansions > 0)
+            return 0;
+    }
+
+    for (i = 1; i + 1 < cmds->count;)
+    {
+        // A size given for the pipe after the cat would be lost
+        if (is_cat(&cmds->commands[i]) && cmds->commands[i].argc == 1 && !cmds->commands[i].input_file &&
+            !cmds->commands[i].here_doc && !cmds->commands[i].pipe_size)
+            drop_stage(cmds, i);
+        else
+            i++;
+    }
+
+    // The later stage is kept, it may carry the '&'
+    for (i = 0; i + 1 < cmds->count;)
+    {
+        if (is_idempotent(&cmds->commands[i]) && same_argv(&cmds->commands[i], &cmds->commands[i + 1]) &&
+            !cmds->commands[i + 1].input_file && !cmds->commands[i + 1].here_doc &&
+            !cmds->commands[i + 1].output_file)
+            drop_stage(cmds, i);
+        else
+            i++;
+    }
+
+    while (cmds->count > 1)
+    {
+        first = &cmds->commands[0];
+        next = &cmds->commands[1];
+
+        if (!is_cat(first) || next->input_file || next->here_doc)
+            break;
+
+        // 'cat <<EOF' hands its body on as it is
+        if (first->argc == 1 && first->here_doc)
+        {
+            next->here_doc = first->here_doc;
+            drop_stage(cmds, 0);
+            continue;
+        }
+
+        // Either 'cat FILE' or 'cat < FILE'
+        if (first->argc == 2 && !first->input_file)
+            file = first->argv[1];
+        else if (first->argc == 1 && first->input_file)
+            file = first->input_file;
+        else
+            break;
+
+        // A missing file has to be reported by cat, with the rest still run
+        if (file[0] == '-' || !plain_file(file))
+            break;
+
+        next->input_file = (char *)file;
+        drop_stage(cmds, 0);
+    }
+
+    return count - cmds->count;
+}
+
+// Prints the list as it would be run, without a trailing newline
+void optimize_print(const list_node_t *node)
+{
+    switch (node->op)
+    {
+    case LIST_PIPELINE:
+        print_pipeline(&node->pipeline);
+        break;
+    case LIST_SEQ:
+        optimize_print(node->left);
+        fputs(bg_last(node->left) ? " " : "; ", stdout);
+        optimize_print(node->right);
+        break;
+    default:
+        optimize_print(node->left);
+        fputs((node->op == LIST_AND) ? " && " : " || ", stdout);
+        optimize_print(node->right);
+        break;
+    }
+}
+
+// A cat without options or redirected output
+bool is_cat(const command_t *cmd)
+{
+    if (strcmp(cmd->argv[0], "cat") != 0 || cmd->output_file || cmd->tee_count)
+        return false;
+
+    return cmd->argc == 1 || cmd->argv[1][0] != '-' || cmd->argv[1][1] == '\0';
+}
+
+/*
+ * Filters that give the same output when run twice. Options that change the
+ * shape of the output (uniq -c, head -n -N, tail -n +N...) aren't.
+ */
+bool is_idempotent(const command_t *cmd)
+{
+    const char *name = cmd->argv[0];
+    const char *arg;
+    size_t i;
+
+    if (cmd->input_file || cmd->here_doc || cmd->output_file || cmd->tee_count)
+        return false;
+
+    if (strcmp(name, "sort") == 0)
+    {
+        for (i = 1; i < cmd->argc; i++)
+        {
+            arg = cmd->argv[i];
+            if (arg[0] != '-' || arg[1] == '\0' || strspn(arg + 1, SORT_IDEMPOTENT_OPTS "u") != strlen(arg + 1))
+                return false;
+        }
+
+        return true;
+    }
+
+    if (strcmp(name, "uniq") == 0)
+        return cmd->argc == 1 || (cmd->argc == 2 && strcmp(cmd->argv[1], "-i") == 0);
+
+    if (strcmp(name, "head") == 0 || strcmp(name, "tail") == 0)
+    {
+        // -N, -n N or -c N with a plain count
+        if (cmd->argc == 2)
+            arg = (cmd->argv[1][0] == '-') ? cmd->argv[1] + 1 : "";
+        else if (cmd->argc == 3 && (strcmp(cmd->argv[1], "-n") == 0 || strcmp(cmd->argv[1], "-c") == 0))
+            arg = cmd->argv[2];
+        else
+            return cmd->argc == 1;
+
+        return *arg != '\0' && strspn(arg, "0123456789") == strlen(arg);
+    }
+
+    return false;
+}
+
+bool same_argv(const command_t *a, const command_t *b)
+{
+    size_t i;
+
+    if (a->argc != b->argc)
+        return false;
+
+    for (i = 0; i < a->argc; i++)
+    {
+        if (strcmp(a->argv[i], b->argv[i]) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+bool plain_file(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, R_OK) == 0;
+}
+
+// What's left still runs as a pipeline, so a lone 'cd' or 'exit' doesn't change the shell
+void drop_stage(command_list_t *cmds, size_t index)
+{
+    memmove(&cmds->commands[index], &cmds->commands[index + 1], (cmds->count - index - 1) * sizeof(command_t));
+    cmds->count--;
+    cmds->piped = true;
+}
+
+bool bg_last(const list_node_t *node)
+{
+    while (node->op != LIST_PIPELINE)
+        node = node->right;
+
+    return node->pipeline.commands[node->pipeline.count - 1].in_bg;
+}
+
+void print_pipeline(const command_list_t *cmds)
+{
+    const command_t *cmd;
+    size_t i, j;
+
+    for (i = 0; i < cmds->count; i++)
+    {
+        cmd = &cmds->commands[i];
+
+        if (i > 0 && cmds->commands[i - 1].pipe_size)
+            printf(" |[%zu] ", cmds->commands[i - 1].pipe_size);
+        else if (i > 0)
+            fputs(" | ", stdout);
+
+        for (j = 0; j < cmd->argc; j++)
+        {
+            if (j > 0)
+                putchar(' ');
+            print_arg(cmd, j);
+        }
+
+        if (cmd->input_file)
+        {
+            fputs(" < ", stdout);
+            print_word(cmd->input_file);
+        }
+        if (cmd->here_doc)
+            print_here_doc(cmd->here_doc);
+        if (cmd->output_file)
+        {
+            fputs(" > ", stdout);
+            print_word(cmd->output_file);
+        }
+
+        // Copies on top of an output file are just more of them
+        for (j = 0; j < cmd->tee_count; j++)
+        {
+            fputs((cmd->output_file) ? " > " : " |> ", stdout);
+            print_word(cmd->tee_files[j]);
+        }
+    }
+
+    if (cmds->commands[cmds->count - 1].in_bg)
+        fputs(" &", stdout);
+}
+
+// Heredocs are shown as here-strings, the body quoted like any other word
+void print_here_doc(const here_doc_t *doc)
+{
+    char *body;
+    size_t len = doc->len;
+
+    // Without the line break the here-string adds back
+    if (len > 0 && doc->data[len - 1] == '\n')
+        len--;
+
+    body = strndup(doc->data, len);
+    if (!body)
+        return;
+
+    fputs(" <<< ", stdout);
+    print_word(body);
+    free(body);
+}
+
+// The word with its expansions put back in between the text around them
+void print_arg(const command_t *cmd, size_t index)
+{
+    const char *word = cmd->argv[index];
+    const expansion_t *exp;
+    size_t i, offset = 0;
+    bool printed = false;
+    char *part;
+
+    for (i = 0; i < cmd->nexpansions; i++)
+    {
+        exp = &cmd->expansions[i];
+        if (exp->word != index)
+            continue;
+
+        if (exp->offset > offset)
+        {
+            part = strndup(word + offset, exp->offset - offset);
+            if (!part)
+                return;
+            print_word(part);
+            free(part);
+        }
+        offset = exp->offset;
+
+        printed = true;
+
+        // Unquoted wildcard, part of the word
+        if (exp->kind == EXPANSION_GLOB)
+        {
+            putchar(word[offset++]);
+            continue;
+        }
+
+        if (exp->quoted)
+            putchar('"');
+        if (exp->kind == EXPANSION_COMMAND)
+            printf("$(%s)", exp->text);
+        else
+            printf((strcmp(exp->text, "?") == 0) ? "$%s" : "${%s}", exp->text);
+        if (exp->quoted)
+            putchar('"');
+    }
+
+    if (!printed || word[offset])
+        print_word(word + offset);
+}
+
+// Quotes the word if the parser would split it otherwise
+void print_word(const char *word)
+{
+    const char *p;
+
+    for (p = word; *p && scan_class[(unsigned char)*p] == SCAN_WORD; p++)
+        ;
+
+    if (*word && !*p)
+        fputs(word, stdout);
+    else if (!strchr(word, '\''))
+        printf("'%s'", word);
+    else
+        printf("\"%s\"", word);
+}
@@ -0,0 +1,12 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stddef.h>
+
+#include "parser.h"
+
+size_t optimize_pipeline(command_list_t *cmds);
+
+void optimize_print(const list_node_t *node);
+
+#endif
@@ -2,313 +2,927 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-
-#include <unistd.h>
+#include <stdint.h>
 
 #include "parser.h"
+#include "arena.h"
+#include "scan.h"
+
+#define INITIAL_COMMANDS 4
+#define INITIAL_ARGS 8
+#define INITIAL_TEES 2
+#define INITIAL_HEREDOCS 2
+#define INITIAL_EXPANSIONS 2
+#define TEXT_SLACK 16
+
+// A heredoc on the current line, its body starts on the next one
+typedef struct heredoc
+{
+    here_doc_t *doc;
+    char *delim;
+    bool strip_tabs; // '<<-', leading tabs are dropped from every line
+} heredoc_t;
 
-#define QUOTE_DOUBLE (1U << 1)
-#define QUOTE_SINGLE (1U << 2)
-
-int parse_command_list(command_list_t *list, const char *input)
+typedef struct parser
 {
-    size_t len;
-    char *copy;
-    char *cmd;
-    unsigned int quotes;
-    size_t offset;
+    const char *pos;
+    const char *end; // Of the current line
+    arena_t *arena;
 
-    size_t i;
+    // Words are unquoted into this region back to back
+    char *out;
+    char *out_end;
 
-    // Skip beginning whitespaces
-    while (isspace(*input))
-        input++;
+    heredoc_t *heredocs;
+    size_t nheredocs;
+    size_t heredoc_cap;
 
-    len = strlen(input);
-    if (len == 0)
-        return PARSER_RET_EMPTY; // All whitespace
+    size_t expansion_cap; // Of the command being parsed
+} parser_t;
 
-    // Skip trailing whitespaces
-    while (isspace(input[len - 1]))
-        len--;
+static int parse_and_or(parser_t *parser, list_node_t **node);
 
-    if (len == 0)
-        return PARSER_RET_EMPTY;
+static int parse_pipeline(parser_t *parser, list_node_t **node);
 
-    if (*input == '|')
-        return PARSER_RET_INVALID; // Line can't start with pipe symbol
+static int parse_command(parser_t *parser, command_t *cmd);
 
-    copy = malloc((len + 1) * sizeof(char));
-    if (!copy)
-        return PARSER_RET_MEM;
+static int parse_word(parser_t *parser, char **word, command_t *cmd);
+
+static int parse_dollar(parser_t *parser, const char **pos, const char *word, bool quoted, command_t *cmd);
+
+static const char *subst_end(const char *pos);
+
+static size_t name_len(const char *pos);
+
+static expansion_t *add_expansion(parser_t *parser, command_t *cmd, expansion_kind_t kind, size_t offset, bool quoted);
+
+static int copy_out(parser_t *parser, char **word, const char *src, size_t len);
+
+static int parse_here(parser_t *parser, command_t *cmd);
 
-    strncpy(copy, input, len);
-    copy[len] = '\0'; // Make sure string is null terminated
+static int next_line(parser_t *parser, parse_more_t *more);
 
-    // We should have at least one command
-    list->count = 1;
+static int read_body(parser_t *parser, heredoc_t *heredoc);
 
-    i = 0;
-    quotes = 0;
-    while (i < len)
+static list_node_t *new_node(parser_t *parser, list_op_t op, list_node_t *left, list_node_t *right);
+
+static int push_arg(parser_t *parser, command_t *cmd, size_t *cap, char *arg);
+
+static int push_tee(parser_t *parser, command_t *cmd, size_t *cap, char *file);
+
+static int reserve(parser_t *parser, char **word, size_t len);
+
+static void skip_blanks(parser_t *parser);
+
+static const char *line_end(const char *pos);
+
+static int char_class_at(const char *pos);
+
+/*
+ * Single left to right pass over the line. Words are copied once into the
+ * arena with quotes removed, argv and command arrays grow in place there.
+ *
+ * Lists separated by ';', '&' or line breaks are chained through the right
+ * side of LIST_SEQ nodes, '&&' and '||' group to the left like in other
+ * shells.
+ */
+int parse_command_list(list_node_t **root, const char *input, arena_t *arena, parse_more_t *more)
+{
+    parser_t parser;
+    list_node_t **tail = root;
+    int ret;
+
+    parser.pos = input;
+    parser.end = line_end(input);
+    parser.arena = arena;
+    parser.out = NULL;
+    parser.out_end = NULL;
+    parser.heredocs = NULL;
+    parser.nheredocs = 0;
+    parser.heredoc_cap = 0;
+
+    next_line(&parser, more);
+    if (*parser.pos == '\0')
+        return PARSER_RET_EMPTY; // All whitespace
+
+    for (;;)
     {
-        if (!(quotes & QUOTE_SINGLE) && copy[i] == '"')
-            quotes ^= QUOTE_DOUBLE;
-        if (!(quotes & QUOTE_DOUBLE) && copy[i] == '\'')
-            quotes ^= QUOTE_SINGLE;
+        ret = parse_and_or(&parser, tail);
+        if (ret < 0)
+            return ret;
 
-        if (copy[i] == '|' && !quotes)
+        switch (*parser.pos)
         {
-            list->count++;
-            copy[i] = '\0';
+        case '\0':
+        case '\n':
+            break;
+        case '&':
+            // In sh this puts a whole '&&' or '||' list in background, which takes a subshell
+            if ((*tail)->op != LIST_PIPELINE)
+                return PARSER_RET_INVALID;
+
+            (*tail)->pipeline.commands[(*tail)->pipeline.count - 1].in_bg = true;
+            parser.pos++;
+            break;
+        case ';':
+            parser.pos++;
+            break;
+        default:
+            return PARSER_RET_INVALID;
+        }
 
-            if (++i >= len)
-                goto bad_input; // Missing other side of pipe
+        ret = next_line(&parser, more);
+        if (ret < 0)
+            return ret;
+        if (*parser.pos == '\0')
+            return PARSER_OK; // Terminator at the end of the input
 
-            while (copy[i] == ' ')
-            {
-                copy[i] = '\0';
-                i++; // Skip whitespace
-            }
+        *tail = new_node(&parser, LIST_SEQ, *tail, NULL);
+        if (!*tail)
+            return PARSER_RET_MEM;
+        tail = &(*tail)->right;
+    }
+}
 
-            if (copy[i] == '|')
-                goto bad_input; // Empty pipe
+int parse_and_or(parser_t *parser, list_node_t **node)
+{
+    list_node_t *right;
+    list_op_t op;
+    int ret;
 
-            continue;
-        }
+    ret = parse_pipeline(parser, node);
+    if (ret < 0)
+        return ret;
 
-        i++;
+    for (;;)
+    {
+        if (parser->pos[0] == '&' && parser->pos[1] == '&')
+            op = LIST_AND;
+        else if (parser->pos[0] == '|' && parser->pos[1] == '|')
+            op = LIST_OR;
+        else
+            return PARSER_OK;
+
+        parser->pos += 2;
+
+        ret = parse_pipeline(parser, &right);
+        if (ret < 0)
+            return ret;
+
+        *node = new_node(parser, op, *node, right);
+        if (!*node)
+            return PARSER_RET_MEM;
     }
-    if (quotes)
-        goto bad_input; // Mismatched quotation
+}
+
+// Stops in front of the operator following the pipeline
+int parse_pipeline(parser_t *parser, list_node_t **node)
+{
+    command_list_t *list;
+    size_t cap = INITIAL_COMMANDS;
+    command_t *new_cmds;
+    const char *start, *end;
+    size_t len, size;
+    int ret;
+
+    *node = new_node(parser, LIST_PIPELINE, NULL, NULL);
+    if (!*node)
+        return PARSER_RET_MEM;
+    list = &(*node)->pipeline;
+
+    skip_blanks(parser);
+    start = parser->pos;
 
-    list->commands = malloc(list->count * sizeof(command_t));
+    list->count = 0;
+    list->piped = false;
+    list->commands = arena_alloc(parser->arena, cap * sizeof(command_t));
     if (!list->commands)
-    {
-        free(copy);
         return PARSER_RET_MEM;
-    }
 
-    for (i = 0, offset = 0; offset < len; i++)
+    for (;;)
     {
-        cmd = copy + offset;
-        if (parse_command(&list->commands[i], cmd) <= 0)
-            goto bad_input;
+        if (list->count == cap)
+        {
+            new_cmds = arena_grow(parser->arena, list->commands, cap * sizeof(command_t),
+                                  cap * 2 * sizeof(command_t));
+            if (!new_cmds)
+                return PARSER_RET_MEM;
+
+            list->commands = new_cmds;
+            cap *= 2;
+        }
+
+        ret = parse_command(parser, &list->commands[list->count]);
+        if (ret == PARSER_RET_EMPTY)
+            return PARSER_RET_INVALID; // Missing command or side of pipe
+        if (ret < 0)
+            return ret;
 
-        offset += strlen(cmd);
+        list->count++;
 
-        while (offset < len && copy[offset] == '\0')
-            offset++;
+        if (parser->pos[0] != '|' || parser->pos[1] == '|')
+            break;
+        parser->pos++;
+
+        // '|[SIZE]' sizes this pipe, otherwise '[' starts the next command
+        if (*parser->pos == '[')
+        {
+            end = parse_size(parser->pos + 1, &size);
+            if (end && *end == ']')
+            {
+                list->commands[list->count - 1].pipe_size = size;
+                parser->pos = end + 1;
+            }
+        }
     }
 
-    free(copy);
-    return PARSER_OK;
+    // Source text without trailing blanks, shown in job listings
+    for (len = parser->pos - start; len > 0 && char_class_at(start + len - 1) == SCAN_BLANK; len--)
+        ;
 
-bad_input:
-    free(copy);
-    free(list->commands);
-    return PARSER_RET_INVALID;
+    list->text = arena_alloc(parser->arena, len + 1);
+    if (!list->text)
+        return PARSER_RET_MEM;
+    memcpy(list->text, start, len);
+    list->text[len] = '\0';
+
+    return PARSER_OK;
 }
 
-int parse_command(command_t *cmd, const char *input)
+// Parses a single pipeline stage, stops at an operator or the end of the line
+int parse_command(parser_t *parser, command_t *cmd)
 {
-    size_t len;
-    unsigned int quotes;
-    size_t offset;
-    char **redir_file;
+    size_t cap = INITIAL_ARGS;
+    size_t tee_cap = 0;
+    bool tee;
+    char *word;
+    char op;
+    int ret;
+
+    cmd->argc = 0;
+    cmd->in_bg = false;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->here_doc = NULL;
+    cmd->tee_files = NULL;
+    cmd->tee_count = 0;
+    cmd->pipe_size = 0;
+    cmd->expansions = NULL;
+    cmd->nexpansions = 0;
+    parser->expansion_cap = 0;
+
+    cmd->argv = arena_alloc(parser->arena, cap * sizeof(char *));
+    if (!cmd->argv)
+        return PARSER_RET_MEM;
 
-    size_t i, j;
+    for (;;)
+    {
+        skip_blanks(parser);
 
-    // Skip beginning whitespaces
-    while (isspace(*input))
-        input++;
+        // '|>' copies output to a file, it isn't a pipe
+        tee = parser->pos[0] == '|' && parser->pos[1] == '>';
+        if (tee)
+            parser->pos++;
 
-    len = strlen(input);
-    if (len == 0)
-        return PARSER_RET_EMPTY;
+        switch (*parser->pos)
+        {
+        case '<':
+            if (parser->pos[1] == '<')
+            {
+                ret = parse_here(parser, cmd);
+                if (ret < 0)
+                    return ret;
+                break;
+            }
+            /* fall through */
+        case '>':
+            op = *parser->pos++;
+            skip_blanks(parser);
+
+            ret = parse_word(parser, &word, NULL);
+            if (ret == PARSER_RET_EMPTY || (ret > 0 && *word == '\0'))
+                return PARSER_RET_INVALID; // No file after redir
+            if (ret < 0)
+                return ret;
+
+            // Last input redirection wins, output goes to every file named
+            if (op == '<')
+            {
+                cmd->input_file = word;
+                cmd->here_doc = NULL;
+            }
+            else if (!tee && !cmd->output_file)
+                cmd->output_file = word;
+            else if (push_tee(parser, cmd, &tee_cap, word) < 0)
+                return PARSER_RET_MEM;
+            break;
+        case '\0':
+        case '\n':
+        case '|':
+        case '&':
+        case ';':
+            goto done;
+        default:
+            ret = parse_word(parser, &word, cmd);
+            if (ret <= 0)
+                return (ret == 0) ? PARSER_RET_INVALID : ret;
+
+            ret = push_arg(parser, cmd, &cap, word);
+            if (ret < 0)
+                return ret;
+            break;
+        }
+    }
 
-    // Skip trailing whitespaces
-    while (isspace(input[len - 1]))
-        len--;
-    if (len == 0)
+done:
+    if (cmd->argc == 0)
         return PARSER_RET_EMPTY;
 
-    // Look for ampersand
-    if (input[len - 1] == '&')
-    {
-        cmd->in_bg = true;
-        len--;
-    }
-    else
-    {
-        cmd->in_bg = false;
-    }
-    // Skip whitespaces between command and ampersand
-    while (isspace(input[len - 1]))
-        len--;
-    if (len == 0)
-        return PARSER_RET_EMPTY;
+    // exec requires NULL terminated array
+    return push_arg(parser, cmd, &cap, NULL);
+}
 
-    cmd->buffer = malloc((len + 1) * sizeof(char));
-    if (!cmd->buffer)
-        return PARSER_RET_MEM;
+/*
+ * '$(...)', '$NAME', '${NAME}' and '$?' are recorded in cmd as expansions of
+ * the word, outside of arguments (cmd is NULL) they aren't allowed. Any other
+ * '$' is kept as it is. Unquoted '*', '?' and '[' of arguments are recorded
+ * too, they stay in the word.
+ */
+int parse_word(parser_t *parser, char **word, command_t *cmd)
+{
+    const char *pos = parser->pos;
+    const char *close;
+    bool quoted = false;
+    size_t len;
+    int cls;
+    int ret;
 
-    strncpy(cmd->buffer, input, len);
-    cmd->buffer[len] = '\0'; // Make sure string is null terminated
+    *word = parser->out;
 
-    cmd->output_file = NULL;
-    cmd->input_file = NULL;
-    for (i = len - 1, quotes = 0; i > 0 && (!cmd->output_file || !cmd->input_file); i--)
+    for (;;)
     {
-        if (!(quotes & QUOTE_SINGLE) && cmd->buffer[i] == '"')
+        // Plain run up to the next blank, quote, operator, '$' or wildcard
+        len = scan_word(pos);
+        if (copy_out(parser, word, pos, len) < 0)
+            return PARSER_RET_MEM;
+        pos += len;
+
+        cls = char_class_at(pos);
+        if (cls == SCAN_DOLLAR)
         {
-            quotes ^= QUOTE_DOUBLE;
+            ret = parse_dollar(parser, &pos, *word, false, cmd);
+            if (ret < 0)
+                return ret;
+            if (ret > 0)
+                quoted = true; // Stands for a word even if the output is empty
+            else if (copy_out(parser, word, pos++, 1) < 0)
+                return PARSER_RET_MEM;
+            continue;
         }
-        else if (!(quotes & QUOTE_DOUBLE) && cmd->buffer[i] == '\'')
+
+        // Only unquoted wildcards of arguments match paths
+        if (cls == SCAN_GLOB)
         {
-            quotes ^= QUOTE_SINGLE;
+            if (cmd && !add_expansion(parser, cmd, EXPANSION_GLOB, parser->out - *word, false))
+                return PARSER_RET_MEM;
+            if (copy_out(parser, word, pos++, 1) < 0)
+                return PARSER_RET_MEM;
+            continue;
         }
-        else if (cmd->buffer[i] == '>' || cmd->buffer[i] == '<')
+
+        if (cls != SCAN_QUOTE)
+            break;
+
+        if (*pos == '\'')
         {
-            if (quotes)
-                break; // Quoted redirection operator
+            close = strchr(pos + 1, '\'');
+            if (!close)
+                return PARSER_RET_INVALID; // Mismatched quotation
+
+            if (copy_out(parser, word, pos + 1, close - (pos + 1)) < 0)
+                return PARSER_RET_MEM;
+            pos = close + 1;
+            quoted = true;
+            continue;
+        }
 
-            if (cmd->buffer[i] == '>')
-            {
-                if (cmd->output_file)
-                    continue;
-                redir_file = &cmd->output_file;
-            }
-            else
-            {
-                if (cmd->input_file)
-                    continue;
-                redir_file = &cmd->input_file;
-            }
+        // Double quotes only keep '$' special
+        for (pos++;; pos++)
+        {
+            len = strcspn(pos, "\"$");
+            if (copy_out(parser, word, pos, len) < 0)
+                return PARSER_RET_MEM;
+            pos += len;
+
+            if (*pos == '\0')
+                return PARSER_RET_INVALID; // Mismatched quotation
+            if (*pos == '"')
+                break;
+
+            ret = parse_dollar(parser, &pos, *word, true, cmd);
+            if (ret < 0)
+                return ret;
+            if (ret == 0 && copy_out(parser, word, pos, 1) < 0)
+                return PARSER_RET_MEM;
+            if (ret > 0)
+                pos--;
+        }
+        pos++;
+        quoted = true;
+    }
 
-            offset = i;
-            cmd->buffer[i] = '\0';
+    parser->pos = pos;
 
-            while (cmd->buffer[++i] == ' ')
-                if (i >= len)
-                    goto bad_input; // No file after redir
+    if (parser->out == *word && !quoted)
+        return PARSER_RET_EMPTY;
 
-            if (cmd->buffer[i] == '"')
-            {
-                quotes ^= QUOTE_DOUBLE;
-                i++;
-            }
-            else if (cmd->buffer[i] == '\"')
-            {
-                quotes ^= QUOTE_SINGLE;
-                i++;
-            }
+    if (reserve(parser, word, 1) < 0)
+        return PARSER_RET_MEM;
+    *parser->out++ = '\0';
 
-            if (quotes)
-            {
-                for (j = i; j < len; j++)
-                {
-                    if (!(quotes & QUOTE_SINGLE) && cmd->buffer[j] == '"')
-                    {
-                        quotes ^= QUOTE_DOUBLE;
-                        cmd->buffer[j] = '\0';
-                    }
-                    else if (!(quotes & QUOTE_DOUBLE) && cmd->buffer[j] == '\'')
-                    {
-                        quotes ^= QUOTE_SINGLE;
-                        cmd->buffer[j] = '\0';
-                    }
-                }
-
-                if (j - i == 1)
-                    goto bad_input; // Empty quoted string
-            }
+    return PARSER_OK;
+}
+
+/*
+ * '<<<word' feeds the word and a line break to the command. '<<WORD' and
+ * '<<-WORD' take the lines after the current one up to WORD, the body is
+ * filled in once the parser gets there.
+ */
+int parse_here(parser_t *parser, command_t *cmd)
+{
+    heredoc_t *new_heredocs;
+    here_doc_t *doc;
+    bool string, strip_tabs;
+    char *word;
+    size_t len;
+    int ret;
+
+    parser->pos += 2;
+    string = *parser->pos == '<';
+    strip_tabs = *parser->pos == '-';
+    if (string || strip_tabs)
+        parser->pos++;
+
+    skip_blanks(parser);
+
+    ret = parse_word(parser, &word, NULL);
+    if (ret == PARSER_RET_EMPTY || (ret > 0 && !string && *word == '\0'))
+        return PARSER_RET_INVALID; // No word after redir
+    if (ret < 0)
+        return ret;
+
+    doc = arena_alloc(parser->arena, sizeof(here_doc_t));
+    if (!doc)
+        return PARSER_RET_MEM;
+
+    cmd->here_doc = doc;
+    cmd->input_file = NULL;
+
+    if (string)
+    {
+        len = strlen(word);
+
+        doc->data = arena_alloc(parser->arena, len + 2);
+        if (!doc->data)
+            return PARSER_RET_MEM;
+
+        memcpy(doc->data, word, len);
+        doc->data[len] = '\n';
+        doc->data[len + 1] = '\0';
+        doc->len = len + 1;
+
+        return PARSER_OK;
+    }
+
+    doc->data = NULL;
+    doc->len = 0;
+
+    if (parser->nheredocs == parser->heredoc_cap)
+    {
+        if (parser->heredoc_cap == 0)
+            new_heredocs = arena_alloc(parser->arena, INITIAL_HEREDOCS * sizeof(heredoc_t));
+        else
+            new_heredocs = arena_grow(parser->arena, parser->heredocs, parser->heredoc_cap * sizeof(heredoc_t),
+                                      parser->heredoc_cap * 2 * sizeof(heredoc_t));
+        if (!new_heredocs)
+            return PARSER_RET_MEM;
+
+        parser->heredocs = new_heredocs;
+        parser->heredoc_cap = (parser->heredoc_cap) ? parser->heredoc_cap * 2 : INITIAL_HEREDOCS;
+    }
+
+    parser->heredocs[parser->nheredocs].doc = doc;
+    parser->heredocs[parser->nheredocs].delim = word;
+    parser->heredocs[parser->nheredocs].strip_tabs = strip_tabs;
+    parser->nheredocs++;
+
+    return PARSER_OK;
+}
+
+/*
+ * Moves over blanks and line breaks to the next command. Bodies of the
+ * heredocs on a line are read at its end, in the order they appeared.
+ */
+int next_line(parser_t *parser, parse_more_t *more)
+{
+    size_t i;
+    int ret;
+
+    for (;;)
+    {
+        skip_blanks(parser);
 
-            *redir_file = &cmd->buffer[i];
+        if (*parser->pos == '\n')
+            parser->pos++;
+        else if (*parser->pos != '\0' || parser->nheredocs == 0)
+            return PARSER_OK;
 
-            len = offset;
-            while (isspace(cmd->buffer[len - 1]))
+        for (i = 0; i < parser->nheredocs; i++)
+        {
+            ret = read_body(parser, &parser->heredocs[i]);
+            if (ret == PARSER_RET_MORE && more)
             {
-                cmd->buffer[len - 1] = '\0';
-                len--;
+                more->delim = parser->heredocs[i].delim;
+                more->strip_tabs = parser->heredocs[i].strip_tabs;
             }
+            if (ret < 0)
+                return ret;
         }
+        parser->nheredocs = 0;
+
+        parser->end = line_end(parser->pos);
+    }
+}
+
+// Copies the lines up to the delimiter into the heredoc, stops after it
+int read_body(parser_t *parser, heredoc_t *heredoc)
+{
+    const char *start = parser->pos;
+    const char *line, *text, *nl;
+    size_t delim_len, len;
+    char *out;
+
+    delim_len = strlen(heredoc->delim);
+
+    // Find the end first, the body is then copied in one go
+    for (line = start;; line = nl + 1)
+    {
+        if (*line == '\0')
+            return PARSER_RET_MORE;
+
+        for (text = line; heredoc->strip_tabs && *text == '\t'; text++)
+            ;
+
+        nl = strchr(text, '\n');
+        len = (nl) ? (size_t)(nl - text) : strlen(text);
+        if (len == delim_len && memcmp(text, heredoc->delim, len) == 0)
+            break;
+
+        if (!nl)
+            return PARSER_RET_MORE;
     }
 
-    cmd->argc = 1; // For program name
-    for (i = 0, quotes = 0; i < len;)
+    out = arena_alloc(parser->arena, line - start + 1);
+    if (!out)
+        return PARSER_RET_MEM;
+
+    heredoc->doc->data = out;
+
+    if (!heredoc->strip_tabs)
+    {
+        memcpy(out, start, line - start);
+        out += line - start;
+    }
+    else
     {
-        if (!(quotes & QUOTE_SINGLE) && cmd->buffer[i] == '"')
+        while (start < line)
         {
-            cmd->buffer[i] = '\0';
-            quotes ^= QUOTE_DOUBLE;
+            while (*start == '\t')
+                start++;
+
+            len = strchr(start, '\n') + 1 - start;
+            memcpy(out, start, len);
+            out += len;
+            start += len;
         }
-        if (!(quotes & QUOTE_DOUBLE) && cmd->buffer[i] == '\'')
+    }
+
+    *out = '\0';
+    heredoc->doc->len = out - heredoc->doc->data;
+
+    parser->pos = (nl) ? nl + 1 : text + len;
+
+    return PARSER_OK;
+}
+
+/*
+ * Records the expansion *pos points at and moves past it. Returns 0 if it is
+ * just a '$', the caller copies that.
+ */
+int parse_dollar(parser_t *parser, const char **pos, const char *word, bool quoted, command_t *cmd)
+{
+    expansion_t *exp;
+    expansion_kind_t kind;
+    const char *text, *end;
+    size_t len;
+
+    // '$(cmd)', '${NAME}', '$NAME' or '$?'
+    text = *pos + 2;
+    if ((*pos)[1] == '(')
+    {
+        kind = EXPANSION_COMMAND;
+        end = subst_end(*pos);
+        if (!end)
+            return PARSER_RET_INVALID;
+        len = end - text;
+        end++;
+    }
+    else if ((*pos)[1] == '{')
+    {
+        kind = EXPANSION_VAR;
+        end = strchr(text, '}');
+        if (!end)
+            return PARSER_RET_INVALID;
+        len = end - text;
+        if (!(len == 1 && *text == '?') && (len == 0 || name_len(text) != len))
+            return PARSER_RET_INVALID; // Bad substitution
+        end++;
+    }
+    else
+    {
+        kind = EXPANSION_VAR;
+        text = *pos + 1;
+        len = (*text == '?') ? 1 : name_len(text);
+        if (len == 0)
+            return 0;
+        end = text + len;
+    }
+
+    if (!cmd)
+        return PARSER_RET_INVALID; // Only arguments are expanded
+
+    exp = add_expansion(parser, cmd, kind, parser->out - word, quoted);
+    if (!exp)
+        return PARSER_RET_MEM;
+
+    exp->text = arena_alloc(parser->arena, len + 1);
+    if (!exp->text)
+        return PARSER_RET_MEM;
+    memcpy(exp->text, text, len);
+    exp->text[len] = '\0';
+
+    *pos = end;
+
+    return 1;
+}
+
+// Appends an expansion of the word being parsed, its text is left NULL
+expansion_t *add_expansion(parser_t *parser, command_t *cmd, expansion_kind_t kind, size_t offset, bool quoted)
+{
+    expansion_t *new_expansions, *exp;
+
+    if (cmd->nexpansions == parser->expansion_cap)
+    {
+        if (parser->expansion_cap == 0)
+            new_expansions = arena_alloc(parser->arena, INITIAL_EXPANSIONS * sizeof(expansion_t));
+        else
+            new_expansions = arena_grow(parser->arena, cmd->expansions, parser->expansion_cap * sizeof(expansion_t),
+                                        parser->expansion_cap * 2 * sizeof(expansion_t));
+        if (!new_expansions)
+            return NULL;
+
+        cmd->expansions = new_expansions;
+        parser->expansion_cap = (parser->expansion_cap) ? parser->expansion_cap * 2 : INITIAL_EXPANSIONS;
+    }
+
+    exp = &cmd->expansions[cmd->nexpansions++];
+
+    // The word is pushed right after it's parsed
+    exp->word = cmd->argc;
+    exp->offset = offset;
+    exp->text = NULL;
+    exp->quoted = quoted;
+    exp->kind = kind;
+
+    return exp;
+}
+
+/*
+ * Finds the ')' closing the '$(' at pos. Parentheses inside have to
+ * balance, quoted ones don't count.
+ */
+const char *subst_end(const char *pos)
+{
+    size_t depth = 1;
+
+    for (pos += 2; *pos; pos++)
+    {
+        switch (*pos)
         {
-            cmd->buffer[i] = '\0';
-            quotes ^= QUOTE_SINGLE;
+        case '\'':
+        case '"':
+            pos = strchr(pos + 1, *pos);
+            if (!pos)
+                return NULL;
+            break;
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (--depth == 0)
+                return pos;
+            break;
         }
+    }
+
+    return NULL;
+}
 
-        if (!quotes && isspace(cmd->buffer[i]))
-        { 
-            cmd->argc++;
+// Length of the variable name at pos, 0 if there is none
+size_t name_len(const char *pos)
+{
+    size_t len;
 
-            cmd->buffer[i] = '\0';
+    if (!(*pos == '_' || (*pos >= 'a' && *pos <= 'z') || (*pos >= 'A' && *pos <= 'Z')))
+        return 0;
 
-            while (++i < len && isspace(cmd->buffer[i]))
-                cmd->buffer[i] = '\0';
+    for (len = 1; pos[len] == '_' || (pos[len] >= 'a' && pos[len] <= 'z') || (pos[len] >= 'A' && pos[len] <= 'Z') ||
+                  (pos[len] >= '0' && pos[len] <= '9');
+         len++)
+        ;
 
-            continue;
-        }
+    return len;
+}
+
+int copy_out(parser_t *parser, char **word, const char *src, size_t len)
+{
+    if (len == 0)
+        return 0;
 
-        i++;
+    if (reserve(parser, word, len) < 0)
+        return -1;
+
+    memcpy(parser->out, src, len);
+    parser->out += len;
+
+    return 0;
+}
+
+list_node_t *new_node(parser_t *parser, list_op_t op, list_node_t *left, list_node_t *right)
+{
+    list_node_t *node;
+
+    node = arena_alloc(parser->arena, sizeof(list_node_t));
+    if (!node)
+        return NULL;
+
+    node->op = op;
+    node->left = left;
+    node->right = right;
+
+    return node;
+}
+
+int push_arg(parser_t *parser, command_t *cmd, size_t *cap, char *arg)
+{
+    char **new_argv;
+
+    if (cmd->argc == *cap)
+    {
+        new_argv = arena_grow(parser->arena, cmd->argv, *cap * sizeof(char *), *cap * 2 * sizeof(char *));
+        if (!new_argv)
+            return PARSER_RET_MEM;
+
+        cmd->argv = new_argv;
+        *cap *= 2;
     }
-    if (quotes)
-        goto bad_input; // Mismatched quotation
 
-    cmd->argv = malloc((cmd->argc + 1) * sizeof(char *)); // + 1 for null terminating array
-    if (!cmd->argv)
+    cmd->argv[cmd->argc] = arg;
+    if (arg)
+        cmd->argc++;
+
+    return PARSER_OK;
+}
+
+int push_tee(parser_t *parser, command_t *cmd, size_t *cap, char *file)
+{
+    char **new_files;
+
+    if (cmd->tee_count == *cap)
     {
-        free(cmd->buffer);
-        return PARSER_RET_MEM;
+        if (*cap == 0)
+            new_files = arena_alloc(parser->arena, INITIAL_TEES * sizeof(char *));
+        else
+            new_files = arena_grow(parser->arena, cmd->tee_files, *cap * sizeof(char *), *cap * 2 * sizeof(char *));
+        if (!new_files)
+            return PARSER_RET_MEM;
+
+        cmd->tee_files = new_files;
+        *cap = (*cap) ? *cap * 2 : INITIAL_TEES;
     }
 
-    // If the program name is quoted, buffer[0] will be '\0', we don't want that
-    if (cmd->buffer[0] == '\0')
-        offset = 1;
-    else
-        offset = 0;
+    cmd->tee_files[cmd->tee_count++] = file;
+
+    return PARSER_OK;
+}
+
+/*
+ * Reads a byte count with an optional K, M or G suffix. Returns the position
+ * after it, NULL if str doesn't start with one or it doesn't fit.
+ */
+const char *parse_size(const char *str, size_t *size)
+{
+    const char *pos = str;
+    size_t value = 0;
+    int shift = 0;
 
-    for (i = 0; offset < len && i < cmd->argc; i++)
+    for (; *pos >= '0' && *pos <= '9'; pos++)
     {
-        cmd->argv[i] = cmd->buffer + offset;
-        offset += strlen(cmd->argv[i]);
+        if (value > (SIZE_MAX - (*pos - '0')) / 10)
+            return NULL;
+        value = value * 10 + (*pos - '0');
+    }
+
+    if (pos == str)
+        return NULL;
 
-        while (offset < len && cmd->buffer[offset] == '\0')
-            offset++;
+    switch (*pos)
+    {
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
     }
-    cmd->argv[i] = NULL; // exec requires NULL terminated array
 
-    return PARSER_OK;
+    if (shift > 0)
+    {
+        if (value > (SIZE_MAX >> shift))
+            return NULL;
+        value <<= shift;
+        pos++;
+    }
 
-bad_input:
-    free(cmd->buffer);
-    return PARSER_RET_INVALID;
+    *size = value;
+    return pos;
 }
 
-void free_command_list(command_list_t *cmdlist)
+/*
+ * Makes room for len more bytes of the word being built. A fresh region is
+ * sized for the rest of the line, so this rarely happens more than once.
+ */
+int reserve(parser_t *parser, char **word, size_t len)
 {
-    size_t i;
+    size_t used, size, rest;
+    char *region;
+
+    if ((size_t)(parser->out_end - parser->out) >= len)
+        return 0;
+
+    // A quoted word may run past the end of the line it started on
+    rest = (parser->pos < parser->end) ? (size_t)(parser->end - parser->pos) : 0;
+
+    used = parser->out - *word;
+    size = used + len + rest + TEXT_SLACK;
+
+    region = arena_alloc(parser->arena, size);
+    if (!region)
+        return -1;
+
+    // Carry over the part of the word written so far
+    if (used > 0)
+        memcpy(region, *word, used);
 
-    for (i = 0; i < cmdlist->count; i++)
-        free_command(&cmdlist->commands[i]);
+    *word = region;
+    parser->out = region + used;
+    parser->out_end = region + size;
+
+    return 0;
+}
+
+// Line breaks end commands, they aren't skipped
+void skip_blanks(parser_t *parser)
+{
+    while (char_class_at(parser->pos) == SCAN_BLANK && *parser->pos != '\n')
+        parser->pos++;
+}
+
+const char *line_end(const char *pos)
+{
+    const char *nl;
 
-    free(cmdlist->commands);
+    nl = strchr(pos, '\n');
+    return (nl) ? nl : pos + strlen(pos);
 }
 
-void free_command(command_t *cmd)
+int char_class_at(const char *pos)
 {
-    free(cmd->argv);
-    free(cmd->buffer);
+    return scan_class[(unsigned char)*pos];
 }
@@ -4,15 +4,40 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "arena.h"
+
 #define PARSER_OK 1
 #define PARSER_RET_EMPTY 0
 #define PARSER_RET_INVALID -1
 #define PARSER_RET_MEM -2
+#define PARSER_RET_MORE -3 // Input ends inside a heredoc body
 
-typedef struct command
+typedef enum expansion_kind
 {
-    char *buffer;
+    EXPANSION_COMMAND, // '$(cmd)'
+    EXPANSION_VAR,     // '$NAME', '${NAME}' or '$?'
+    EXPANSION_GLOB     // Unquoted '*', '?' or '[' at offset, without text
+} expansion_kind_t;
 
+// A '$' in an argument, what it stands for is put in when the command runs
+typedef struct expansion
+{
+    size_t word;   // Index in argv
+    size_t offset; // Where the value goes in the word
+    char *text;    // Command inside the parentheses or variable name
+    bool quoted;   // Inside double quotes, the value isn't split into fields
+    expansion_kind_t kind;
+} expansion_t;
+
+// Inline stdin of a command, from '<<WORD' or '<<<word'
+typedef struct here_doc
+{
+    char *data;
+    size_t len;
+} here_doc_t;
+
+typedef struct command
+{
     size_t argc;
     char **argv;
 
@@ -20,20 +45,64 @@ typedef struct command
 
     char *input_file;
     char *output_file;
+    here_doc_t *here_doc; // Replaces input_file when set
+
+    // More places output goes: '> a > b' writes to both, '|> a' copies it to a
+    // on top of where it was going
+    char **tee_files;
+    size_t tee_count;
+
+    size_t pipe_size; // Of the pipe to the next stage, set with '|[SIZE]', 0 for the default
+
+    // In order of word and offset, argv holds the words without them
+    expansion_t *expansions;
+    size_t nexpansions;
 } command_t;
 
+// A pipeline, commands connected by '|'
 typedef struct command_list
 {
     size_t count;
     command_t *commands;
+    bool piped; // Was a pipeline before the optimizer left one command, it still runs as a stage
+
+    char *text; // Source text of the pipeline
 } command_list_t;
 
-int parse_command(command_t *cmd, const char *input);
+typedef enum list_op
+{
+    LIST_PIPELINE,
+    LIST_SEQ, // ';' or '&'
+    LIST_AND, // '&&'
+    LIST_OR   // '||'
+} list_op_t;
+
+typedef struct list_node
+{
+    list_op_t op;
+    command_list_t pipeline; // Only for LIST_PIPELINE
+
+    struct list_node *left;
+    struct list_node *right;
+} list_node_t;
 
-void free_command(command_t *cmd);
+// What a heredoc body that isn't terminated yet waits for
+typedef struct parse_more
+{
+    const char *delim; // In the arena
+    bool strip_tabs;
+} parse_more_t;
 
-int parse_command_list(command_list_t *cmdlist, const char *input);
+/*
+ * Everything the resulting tree points to is allocated from arena, release it
+ * with arena_reset() once the tree is no longer needed.
+ *
+ * Lines are separated by '\n', heredoc bodies follow the line they are on.
+ * PARSER_RET_MORE means input ended before a body did, more (if not NULL)
+ * then tells which line ends it.
+ */
+int parse_command_list(list_node_t **root, const char *input, arena_t *arena, parse_more_t *more);
 
-void free_command_list(command_list_t *cmdlist);
+const char *parse_size(const char *str, size_t *size);
 
-#endif
\ No newline at end of file
+#endif
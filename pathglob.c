@@ -0,0 +1,620 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include "pathglob.h"
+
+// Big enough for a few thousand entries per system call
+#define DIRENT_BUF (256 * 1024)
+#define INITIAL_ENTRIES 256
+#define INITIAL_PATHS 16
+
+// Record layout of getdents64()
+typedef struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+
+/*
+ * Entries point into the buffers getdents64() filled, which stay in the
+ * arena, so names are never copied.
+ */
+typedef struct glob_dir
+{
+    struct glob_dir *next;
+    const char *path;
+    const linux_dirent64_t **entries;
+    size_t count;
+} glob_dir_t;
+
+typedef enum glob_op_type
+{
+    GLOB_LIT,
+    GLOB_ANY,
+    GLOB_STAR,
+    GLOB_CLASS
+} glob_op_type_t;
+
+typedef struct glob_op
+{
+    glob_op_type_t type;
+    const char *lit; // GLOB_LIT, not terminated
+    size_t len;
+    uint8_t set[32]; // GLOB_CLASS, a bit per byte that matches
+} glob_op_t;
+
+// Part of the pattern between two slashes
+typedef struct glob_seg
+{
+    glob_op_t *ops;
+    size_t nops;
+    bool magic;    // Has wildcards, without them lit is the name as it is
+    bool globstar; // '**', any number of directories
+    bool dot;      // Starts with a '.', so hidden entries may match
+    const char *lit;
+
+    // Literal the name has to end with, checked before the full match
+    const char *tail;
+    size_t tail_len;
+} glob_seg_t;
+
+typedef struct walk
+{
+    glob_seg_t *segs;
+    size_t nsegs;
+    bool dirs_only; // Pattern ended in '/'
+    pathglob_cache_t *cache;
+    pathglob_res_t *res;
+} walk_t;
+
+static int compile(const char *pat, size_t len, arena_t *arena, glob_seg_t *seg);
+static size_t class_end(const char *pat, size_t i, size_t len);
+static void compile_class(const char *pat, size_t start, size_t end, glob_op_t *op);
+static bool match(const glob_seg_t *seg, const char *name);
+static int walk(walk_t *w, const char *prefix, size_t k);
+static glob_dir_t *read_dir(pathglob_cache_t *cache, const char *path);
+static int load_entries(arena_t *arena, int fd, glob_dir_t *dir);
+static bool is_dir(const linux_dirent64_t *ent, const char *path, bool follow);
+static char *join(arena_t *arena, const char *prefix, const char *name);
+static int add_result(walk_t *w, char *path);
+static int cmp_paths(const void *a, const void *b);
+
+void pathglob_cache_init(pathglob_cache_t *cache, arena_t *arena)
+{
+    cache->arena = arena;
+    cache->dirs = NULL;
+}
+
+/*
+ * Expands '*', '?', '[...]' and '**' in pattern, a backslash makes the next
+ * character plain. Entries starting with '.' only match a '.' in the
+ * pattern. Matches end up sorted in res, which is left empty if there are
+ * none or the pattern has no wildcards. Unreadable directories count as
+ * empty, -1 is returned only without memory.
+ */
+int pathglob(const char *pattern, pathglob_cache_t *cache, pathglob_res_t *res)
+{
+    arena_t *arena = cache->arena;
+    walk_t w = {NULL, 0, false, cache, res};
+    const char *p, *end;
+    bool magic = false;
+    size_t len;
+
+    res->paths = NULL;
+    res->count = 0;
+    res->cap = 0;
+
+    len = strlen(pattern);
+    w.segs = arena_alloc(arena, (len / 2 + 1) * sizeof(glob_seg_t));
+    if (!w.segs)
+        return -1;
+
+    for (p = pattern; *p; p = end)
+    {
+        end = strchrnul(p, '/');
+        if (end > p)
+        {
+            if (compile(p, end - p, arena, &w.segs[w.nsegs]) < 0)
+                return -1;
+            magic |= w.segs[w.nsegs++].magic;
+        }
+
+        if (*end == '/')
+        {
+            w.dirs_only = end[1] == '\0';
+            end++;
+        }
+    }
+
+    // Nothing to look for, the word stays as it is
+    if (!magic)
+        return 0;
+
+    if (walk(&w, (pattern[0] == '/') ? "/" : "", 0) < 0)
+        return -1;
+
+    if (res->count > 1)
+        qsort(res->paths, res->count, sizeof(char *), cmp_paths);
+
+    return 0;
+}
+
+int compile(const char *pat, size_t len, arena_t *arena, glob_seg_t *seg)
+{
+    glob_op_t *op;
+    char *lit;
+    size_t i, end, nlit = 0;
+    char c;
+
+    // No more ops than characters, literals all fit in one buffer
+    seg->ops = arena_alloc(arena, len * sizeof(glob_op_t));
+    lit = arena_alloc(arena, len + 1);
+    if (!seg->ops || !lit)
+        return -1;
+
+    seg->nops = 0;
+    seg->magic = false;
+    seg->globstar = len == 2 && pat[0] == '*' && pat[1] == '*';
+
+    for (i = 0; i < len; i++)
+    {
+        c = pat[i];
+        op = &seg->ops[seg->nops];
+
+        if (c == '*')
+        {
+            if (seg->nops == 0 || op[-1].type != GLOB_STAR)
+            {
+                op->type = GLOB_STAR;
+                seg->nops++;
+            }
+            seg->magic = true;
+            continue;
+        }
+        if (c == '?')
+        {
+            op->type = GLOB_ANY;
+            seg->nops++;
+            seg->magic = true;
+            continue;
+        }
+        if (c == '[' && (end = class_end(pat, i, len)) > 0)
+        {
+            compile_class(pat, i + 1, end, op);
+            seg->nops++;
+            seg->magic = true;
+            i = end;
+            continue;
+        }
+
+        if (c == '\\' && i + 1 < len)
+            c = pat[++i];
+
+        // Runs of plain characters become one op
+        if (seg->nops > 0 && op[-1].type == GLOB_LIT)
+        {
+            op[-1].len++;
+        }
+        else
+        {
+            op->type = GLOB_LIT;
+            op->lit = lit + nlit;
+            op->len = 1;
+            seg->nops++;
+        }
+        lit[nlit++] = c;
+    }
+    lit[nlit] = '\0';
+
+    seg->lit = lit;
+    seg->dot = seg->nops > 0 && seg->ops[0].type == GLOB_LIT && seg->ops[0].lit[0] == '.';
+
+    seg->tail = NULL;
+    seg->tail_len = 0;
+    if (seg->nops > 1 && seg->ops[seg->nops - 1].type == GLOB_LIT)
+    {
+        seg->tail = seg->ops[seg->nops - 1].lit;
+        seg->tail_len = seg->ops[seg->nops - 1].len;
+    }
+
+    return 0;
+}
+
+// Index of the ']' closing the '[' at i, 0 if there is none
+size_t class_end(const char *pat, size_t i, size_t len)
+{
+    i++;
+    if (i < len && (pat[i] == '!' || pat[i] == '^'))
+        i++;
+
+    // A ']' right at the start is part of the set
+    if (i < len && pat[i] == ']')
+        i++;
+
+    for (; i < len; i++)
+    {
+        if (pat[i] == '\\')
+            i++;
+        else if (pat[i] == ']')
+            return i;
+    }
+
+    return 0;
+}
+
+void compile_class(const char *pat, size_t start, size_t end, glob_op_t *op)
+{
+    bool negate = false;
+    unsigned char lo, hi;
+    size_t i, c;
+
+    op->type = GLOB_CLASS;
+    memset(op->set, 0, sizeof(op->set));
+
+    if (pat[start] == '!' || pat[start] == '^')
+    {
+        negate = true;
+        start++;
+    }
+
+    for (i = start; i < end; i++)
+    {
+        if (pat[i] == '\\' && i + 1 < end)
+            i++;
+        lo = hi = pat[i];
+
+        if (i + 2 < end && pat[i + 1] == '-')
+        {
+            i += 2;
+            if (pat[i] == '\\' && i + 1 < end)
+                i++;
+            hi = pat[i];
+        }
+
+        for (c = lo; c <= hi; c++)
+            op->set[c >> 3] |= 1 << (c & 7);
+    }
+
+    if (negate)
+    {
+        for (i = 0; i < sizeof(op->set); i++)
+            op->set[i] = ~op->set[i];
+    }
+}
+
+/*
+ * Wildcards are tried left to right, only the last '*' is backtracked,
+ * which is enough since anything an earlier one could take a later one can
+ * take as well.
+ */
+bool match(const glob_seg_t *seg, const char *name)
+{
+    const glob_op_t *op = seg->ops;
+    const glob_op_t *end = seg->ops + seg->nops;
+    const glob_op_t *star_op = NULL;
+    const char *star_s = NULL;
+    const char *s = name;
+    unsigned char c;
+    size_t len;
+
+    if (name[0] == '.' && !seg->dot)
+        return false;
+
+    if (seg->tail_len > 0)
+    {
+        len = strlen(name);
+        if (len < seg->tail_len || memcmp(name + len - seg->tail_len, seg->tail, seg->tail_len) != 0)
+            return false;
+    }
+
+    for (;;)
+    {
+        if (op < end)
+        {
+            c = *s;
+            switch (op->type)
+            {
+            case GLOB_STAR:
+                if (++op == end)
+                    return true;
+                star_op = op;
+                star_s = s;
+                continue;
+            case GLOB_LIT:
+                if (strncmp(s, op->lit, op->len) == 0)
+                {
+                    s += op->len;
+                    op++;
+                    continue;
+                }
+                break;
+            case GLOB_ANY:
+                if (c)
+                {
+                    s++;
+                    op++;
+                    continue;
+                }
+                break;
+            case GLOB_CLASS:
+                if (c && (op->set[c >> 3] & (1 << (c & 7))))
+                {
+                    s++;
+                    op++;
+                    continue;
+                }
+                break;
+            }
+        }
+        else if (*s == '\0')
+        {
+            return true;
+        }
+
+        // Let the last '*' take one more character
+        if (!star_op || *star_s == '\0')
+            return false;
+
+        s = ++star_s;
+        op = star_op;
+    }
+}
+
+// Matches segment k and the ones after it below prefix, "" being the current directory
+int walk(walk_t *w, const char *prefix, size_t k)
+{
+    const glob_seg_t *seg = &w->segs[k];
+    bool last = k + 1 == w->nsegs;
+    const linux_dirent64_t *ent;
+    glob_dir_t *dir;
+    struct stat st;
+    char *path;
+    size_t i;
+
+    if (!seg->magic)
+    {
+        path = join(w->cache->arena, prefix, seg->lit);
+        if (!path)
+            return -1;
+
+        if (!last)
+            return walk(w, path, k + 1);
+
+        if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0 || (w->dirs_only && !is_dir(NULL, path, true)))
+            return 0;
+
+        return add_result(w, path);
+    }
+
+    // No directory at all
+    if (seg->globstar && !last && walk(w, prefix, k + 1) < 0)
+        return -1;
+
+    dir = read_dir(w->cache, (*prefix) ? prefix : ".");
+    if (!dir)
+        return -1;
+
+    for (i = 0; i < dir->count; i++)
+    {
+        ent = dir->entries[i];
+        if (ent->d_name[0] == '.' &&
+            (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+            continue;
+
+        if (seg->globstar ? ent->d_name[0] == '.' : !match(seg, ent->d_name))
+            continue;
+
+        path = join(w->cache->arena, prefix, ent->d_name);
+        if (!path)
+            return -1;
+
+        // Symlinks aren't followed down, they could loop
+        if (seg->globstar)
+        {
+            if (last && (!w->dirs_only || is_dir(ent, path, true)) && add_result(w, path) < 0)
+                return -1;
+            if (is_dir(ent, path, false) && walk(w, path, k) < 0)
+                return -1;
+            continue;
+        }
+
+        if (last)
+        {
+            if ((!w->dirs_only || is_dir(ent, path, true)) && add_result(w, path) < 0)
+                return -1;
+        }
+        else if (is_dir(ent, path, true) && walk(w, path, k + 1) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Each directory is read once per cache, NULL only without memory
+glob_dir_t *read_dir(pathglob_cache_t *cache, const char *path)
+{
+    glob_dir_t *dir;
+    size_t len;
+    int fd;
+
+    for (dir = cache->dirs; dir; dir = dir->next)
+    {
+        if (strcmp(dir->path, path) == 0)
+            return dir;
+    }
+
+    len = strlen(path);
+    dir = arena_alloc(cache->arena, sizeof(glob_dir_t) + len + 1);
+    if (!dir)
+        return NULL;
+
+    dir->path = memcpy((char *)(dir + 1), path, len + 1);
+    dir->entries = NULL;
+    dir->count = 0;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        if (load_entries(cache->arena, fd, dir) < 0)
+        {
+            close(fd);
+            return NULL;
+        }
+        close(fd);
+    }
+
+    dir->next = cache->dirs;
+    cache->dirs = dir;
+
+    return dir;
+}
+
+/*
+ * getdents64() straight into the arena, no readdir() copies and no stat()
+ * per entry since the records carry the file type.
+ */
+int load_entries(arena_t *arena, int fd, glob_dir_t *dir)
+{
+    const linux_dirent64_t **entries = NULL, **new_entries;
+    const linux_dirent64_t *ent;
+    size_t count = 0, cap = 0;
+    char *buf;
+    ssize_t nread, off;
+
+    for (;;)
+    {
+        buf = arena_alloc(arena, DIRENT_BUF);
+        if (!buf)
+            goto fail;
+
+        nread = syscall(SYS_getdents64, fd, buf, DIRENT_BUF);
+
+        // Give back what the read didn't fill, it's the newest allocation
+        arena_grow(arena, buf, DIRENT_BUF, (nread > 0) ? (size_t)nread : 0);
+        if (nread <= 0)
+            break;
+
+        for (off = 0; off < nread; off += ent->d_reclen)
+        {
+            ent = (const linux_dirent64_t *)(buf + off);
+
+            if (count == cap)
+            {
+                cap = (cap) ? cap * 2 : INITIAL_ENTRIES;
+                new_entries = realloc(entries, cap * sizeof(*entries));
+                if (!new_entries)
+                    goto fail;
+                entries = new_entries;
+            }
+            entries[count++] = ent;
+        }
+    }
+
+    if (count > 0)
+    {
+        dir->entries = arena_alloc(arena, count * sizeof(*entries));
+        if (!dir->entries)
+            goto fail;
+        memcpy(dir->entries, entries, count * sizeof(*entries));
+    }
+    dir->count = count;
+
+    free(entries);
+    return 0;
+
+fail:
+    free(entries);
+    return -1;
+}
+
+// ent may be NULL, or not know the type, then path is looked at
+bool is_dir(const linux_dirent64_t *ent, const char *path, bool follow)
+{
+    struct stat st;
+
+    if (ent && ent->d_type == DT_DIR)
+        return true;
+    if (ent && ent->d_type != DT_UNKNOWN && !(follow && ent->d_type == DT_LNK))
+        return false;
+
+    if (fstatat(AT_FDCWD, path, &st, (follow) ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+        return false;
+
+    return S_ISDIR(st.st_mode);
+}
+
+char *join(arena_t *arena, const char *prefix, const char *name)
+{
+    size_t plen = strlen(prefix);
+    size_t nlen = strlen(name);
+    bool slash = plen > 0 && prefix[plen - 1] != '/';
+    char *path;
+
+    path = arena_alloc(arena, plen + slash + nlen + 1);
+    if (!path)
+        return NULL;
+
+    memcpy(path, prefix, plen);
+    if (slash)
+        path[plen] = '/';
+    memcpy(path + plen + slash, name, nlen + 1);
+
+    return path;
+}
+
+int add_result(walk_t *w, char *path)
+{
+    pathglob_res_t *res = w->res;
+    arena_t *arena = w->cache->arena;
+    char **new_paths;
+    size_t len;
+
+    // Keep the '/' the pattern ended with
+    if (w->dirs_only)
+    {
+        len = strlen(path);
+        path = arena_grow(arena, path, len + 1, len + 2);
+        if (!path)
+            return -1;
+        path[len] = '/';
+        path[len + 1] = '\0';
+    }
+
+    if (res->count == res->cap)
+    {
+        new_paths = arena_grow(arena, res->paths, res->cap * sizeof(char *),
+                               ((res->cap) ? res->cap * 2 : INITIAL_PATHS) * sizeof(char *));
+        if (!new_paths)
+            return -1;
+
+        res->paths = new_paths;
+        res->cap = (res->cap) ? res->cap * 2 : INITIAL_PATHS;
+    }
+
+    res->paths[res->count++] = path;
+
+    return 0;
+}
+
+int cmp_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
@@ -0,0 +1,28 @@
+#ifndef PATHGLOB_H
+#define PATHGLOB_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+struct glob_dir;
+
+// Directories read while expanding one pipeline, everything lives in arena
+typedef struct pathglob_cache
+{
+    arena_t *arena;
+    struct glob_dir *dirs;
+} pathglob_cache_t;
+
+typedef struct pathglob_res
+{
+    char **paths; // Sorted, in the cache's arena
+    size_t count;
+    size_t cap;
+} pathglob_res_t;
+
+void pathglob_cache_init(pathglob_cache_t *cache, arena_t *arena);
+
+int pathglob(const char *pattern, pathglob_cache_t *cache, pathglob_res_t *res);
+
+#endif
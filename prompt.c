@@ -0,0 +1,728 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "prompt.h"
+#include "kai.h"
+#include "cmdhash.h"
+
+// How long a segment may keep a program running
+#define PROMPT_TIMEOUT_MS 500
+
+static const char PROMPT_USER_SYM[] = "\e[1m%\e[0m ";
+static const char PROMPT_ROOT_SYM[] = "\e[31m\e[1m#\e[0m ";
+
+static int seg_user(prompt_seg_t *seg, kai_ctx_t *kai_ctx);
+static int seg_host(prompt_seg_t *seg, kai_ctx_t *kai_ctx);
+static int seg_cwd(prompt_seg_t *seg, kai_ctx_t *kai_ctx);
+static int seg_status(prompt_seg_t *seg, kai_ctx_t *kai_ctx);
+static int seg_sym(prompt_seg_t *seg, kai_ctx_t *kai_ctx);
+static int seg_jobs(prompt_seg_t *seg, kai_ctx_t *kai_ctx);
+static ssize_t seg_load(char *buf, size_t size, char *const envp[]);
+static ssize_t seg_vcs(char *buf, size_t size, char *const envp[]);
+static int seg_set(prompt_seg_t *seg, const char *data, size_t len);
+
+static int worker_start(prompt_t *prompt);
+static void worker_stop(prompt_t *prompt);
+static void worker_request(prompt_t *prompt, kai_ctx_t *kai_ctx);
+static void *worker_main(void *arg);
+
+static int find_git_dir(char *path, size_t size);
+static ssize_t read_file(const char *path, char *buf, size_t size);
+static int run_quiet(char *const argv[], char *const envp[], int timeout_ms);
+static char **copy_env(char *const envp[]);
+
+/*
+ * Load, user@host, cwd and its branch, the number of jobs, the status of the
+ * last command if it failed, then % or #.
+ */
+static const prompt_seg_t SEGMENTS[] = {
+    {.style = "", .events = PROMPT_EV_EVAL, .compute = seg_load},
+    {.style = "\e[1m\e[34m", .update = seg_user},
+    {.style = "\e[39m@\e[33m", .update = seg_host},
+    {.style = "\e[39m \e[32m", .events = PROMPT_EV_CD, .update = seg_cwd},
+    {.style = "\e[39m", .events = PROMPT_EV_CD | PROMPT_EV_EVAL, .compute = seg_vcs},
+    {.style = "", .events = PROMPT_EV_EVAL | PROMPT_EV_JOBS, .update = seg_jobs},
+    {.style = "", .events = PROMPT_EV_EVAL, .update = seg_status},
+    {.style = "", .update = seg_sym},
+};
+
+int prompt_init(prompt_t *prompt, kai_ctx_t *kai_ctx)
+{
+    size_t i;
+
+    prompt->nsegs = sizeof(SEGMENTS) / sizeof(SEGMENTS[0]);
+    prompt->segs = malloc(sizeof(SEGMENTS));
+    prompt->stale = 0;
+    prompt->text = NULL;
+    prompt->len = 0;
+    prompt->cap = 0;
+    prompt->width = 0;
+    prompt->efd = -1;
+
+    if (!prompt->segs)
+        return -1;
+    memcpy(prompt->segs, SEGMENTS, sizeof(SEGMENTS));
+
+    // Everything is computed once, later only on the events of each segment
+    for (i = 0; i < prompt->nsegs; i++)
+    {
+        if (prompt->segs[i].update && prompt->segs[i].update(&prompt->segs[i], kai_ctx) < 0)
+        {
+            prompt_free(prompt);
+            return -1;
+        }
+    }
+
+    // Slow segments stay empty without a worker
+    if (worker_start(prompt) == 0)
+        worker_request(prompt, kai_ctx);
+
+    return prompt_render(prompt, kai_ctx);
+}
+
+void prompt_free(prompt_t *prompt)
+{
+    size_t i;
+
+    worker_stop(prompt);
+
+    for (i = 0; i < prompt->nsegs; i++)
+        free(prompt->segs[i].text);
+
+    free(prompt->segs);
+    free(prompt->text);
+
+    prompt->segs = NULL;
+    prompt->nsegs = 0;
+    prompt->text = NULL;
+}
+
+// Nothing is recomputed until the next render
+void prompt_invalidate(prompt_t *prompt, unsigned int events)
+{
+    prompt->stale |= events;
+}
+
+/*
+ * Brings prompt->text up to date. Only segments waiting on one of the events
+ * since the last call are computed again, and the text is only put back
+ * together if one of them came out different. Slow segments keep their last
+ * value until the worker is done with them, see prompt_collect().
+ */
+int prompt_render(prompt_t *prompt, kai_ctx_t *kai_ctx)
+{
+    prompt_seg_t *seg;
+    bool changed = !prompt->text;
+    bool request = false;
+    size_t i, len = 1;
+    char *new_text;
+
+    for (i = 0; i < prompt->nsegs; i++)
+    {
+        seg = &prompt->segs[i];
+        if (seg->events & prompt->stale)
+        {
+            if (seg->compute)
+                request = true;
+            else if (seg->update(seg, kai_ctx) < 0)
+                return -1;
+        }
+
+        changed |= seg->changed;
+        len += strlen(seg->style) + seg->len;
+    }
+    prompt->stale = 0;
+
+    if (request)
+        worker_request(prompt, kai_ctx);
+
+    if (!changed)
+        return 0;
+
+    if (prompt->cap < len)
+    {
+        new_text = realloc(prompt->text, len);
+        if (!new_text)
+            return -1;
+
+        prompt->text = new_text;
+        prompt->cap = len;
+    }
+
+    prompt->len = 0;
+    for (i = 0; i < prompt->nsegs; i++)
+    {
+        seg = &prompt->segs[i];
+
+        len = strlen(seg->style);
+        memcpy(prompt->text + prompt->len, seg->style, len);
+        prompt->len += len;
+
+        if (seg->len > 0)
+            memcpy(prompt->text + prompt->len, seg->text, seg->len);
+        prompt->len += seg->len;
+
+        seg->changed = false;
+    }
+    prompt->text[prompt->len] = '\0';
+
+    prompt->width = prompt_width(prompt->text, prompt->len);
+
+    return 0;
+}
+
+/*
+ * Takes the values the worker finished since the last call, once prompt->efd
+ * turned readable. Returns 1 if any of them changed the prompt, which then
+ * needs a render.
+ */
+int prompt_collect(prompt_t *prompt)
+{
+    prompt_seg_t *seg;
+    uint64_t count;
+    bool changed = false;
+    size_t i;
+    int ret = 0;
+
+    if (prompt->efd < 0)
+        return 0;
+
+    while (read(prompt->efd, &count, sizeof(count)) > 0)
+        ;
+
+    pthread_mutex_lock(&prompt->worker.lock);
+    for (i = 0; i < prompt->nsegs; i++)
+    {
+        seg = &prompt->segs[i];
+        if (!seg->fresh)
+            continue;
+
+        seg->fresh = false;
+        if (seg_set(seg, seg->pending, seg->pending_len) < 0)
+            ret = -1;
+        changed |= seg->changed;
+    }
+    pthread_mutex_unlock(&prompt->worker.lock);
+
+    return (ret < 0) ? -1 : changed;
+}
+
+/*
+ * Escape sequences take no room and every UTF-8 character is counted as one
+ * column, wide characters aren't told apart.
+ */
+size_t prompt_width(const char *text, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    const unsigned char *end = p + len;
+    size_t width = 0;
+
+    while (p < end)
+    {
+        if (*p == '\e')
+        {
+            // CSI runs up to a final byte in '@'..'~', others are one character
+            if (++p < end && *p++ == '[')
+            {
+                while (p < end && (*p < 0x40 || *p > 0x7e))
+                    p++;
+                p++;
+            }
+            continue;
+        }
+
+        if (*p >= 0x20 && *p != 0x7f && (*p & 0xc0) != 0x80)
+            width++;
+        p++;
+    }
+
+    return width;
+}
+
+int seg_user(prompt_seg_t *seg, kai_ctx_t *kai_ctx)
+{
+    char user[LOGIN_NAME_MAX + 1];
+
+    if (geteuid() == 0)
+        strcpy(user, "root");
+    else if (getlogin_r(user, sizeof(user)) != 0)
+        return -1;
+
+    return seg_set(seg, user, strlen(user));
+}
+
+int seg_host(prompt_seg_t *seg, kai_ctx_t *kai_ctx)
+{
+    char host[HOST_NAME_MAX + 1];
+
+    if (gethostname(host, sizeof(host)) != 0)
+        return -1;
+
+    return seg_set(seg, host, strlen(host));
+}
+
+// A directory that went away keeps showing the path it had
+int seg_cwd(prompt_seg_t *seg, kai_ctx_t *kai_ctx)
+{
+    char path[PATH_MAX + 1];
+
+    if (!getcwd(path, sizeof(path)))
+        return 0;
+
+    return seg_set(seg, path, strlen(path));
+}
+
+int seg_status(prompt_seg_t *seg, kai_ctx_t *kai_ctx)
+{
+    char buf[32];
+    int len = 0;
+
+    if (kai_ctx->last_status != 0)
+        len = snprintf(buf, sizeof(buf), " \e[31m%d\e[39m", kai_ctx->last_status);
+
+    return seg_set(seg, buf, len);
+}
+
+int seg_sym(prompt_seg_t *seg, kai_ctx_t *kai_ctx)
+{
+    if (geteuid() == 0)
+        return seg_set(seg, PROMPT_ROOT_SYM, sizeof(PROMPT_ROOT_SYM) - 1);
+
+    return seg_set(seg, PROMPT_USER_SYM, sizeof(PROMPT_USER_SYM) - 1);
+}
+
+int seg_jobs(prompt_seg_t *seg, kai_ctx_t *kai_ctx)
+{
+    char buf[32];
+    int len = 0;
+
+    if (kai_ctx->jobs.count > 0)
+        len = snprintf(buf, sizeof(buf), " \e[36m[%zu]\e[39m", kai_ctx->jobs.count);
+
+    return seg_set(seg, buf, len);
+}
+
+// First field of /proc/loadavg
+ssize_t seg_load(char *buf, size_t size, char *const envp[])
+{
+    char data[64];
+
+    if (read_file("/proc/loadavg", data, sizeof(data)) < 0)
+        return -1;
+
+    return snprintf(buf, size, "\e[90m%.*s\e[39m ", (int)strcspn(data, " "), data);
+}
+
+/*
+ * Branch of the git repository around the working directory, marked with a
+ * '*' if tracked files were changed. The branch is read straight from HEAD,
+ * only the changes need git, which is given up on after a while.
+ */
+ssize_t seg_vcs(char *buf, size_t size, char *const envp[])
+{
+    static char *const DIFF_ARGV[] = {"git", "--no-optional-locks", "diff", "--quiet", "HEAD", "--", NULL};
+    char path[PATH_MAX + 1];
+    char head[256];
+    const char *branch;
+    bool dirty;
+
+    if (find_git_dir(path, sizeof(path)) < 0 || strlen(path) + sizeof("/HEAD") > sizeof(path))
+        return 0;
+
+    strcat(path, "/HEAD");
+    if (read_file(path, head, sizeof(head)) < 0)
+        return 0;
+    head[strcspn(head, "\n")] = '\0';
+
+    // A detached HEAD is shown by its short hash
+    if (strncmp(head, "ref: refs/heads/", 16) == 0)
+    {
+        branch = head + 16;
+    }
+    else
+    {
+        head[7] = '\0';
+        branch = head;
+    }
+
+    // Differences make it exit with 1
+    dirty = run_quiet(DIFF_ARGV, envp, PROMPT_TIMEOUT_MS) == 1;
+
+    return snprintf(buf, size, " \e[35m(%s%s)\e[39m", branch, (dirty) ? "*" : "");
+}
+
+int seg_set(prompt_seg_t *seg, const char *data, size_t len)
+{
+    char *new_text;
+
+    if (seg->text && seg->len == len && memcmp(seg->text, data, len) == 0)
+        return 0;
+
+    if (seg->cap < len + 1)
+    {
+        new_text = realloc(seg->text, len + 1);
+        if (!new_text)
+            return -1;
+
+        seg->text = new_text;
+        seg->cap = len + 1;
+    }
+
+    memcpy(seg->text, data, len);
+    seg->text[len] = '\0';
+    seg->len = len;
+    seg->changed = true;
+
+    return 0;
+}
+
+// The worker thread takes no signals, they are left to the event loop
+int worker_start(prompt_t *prompt)
+{
+    prompt_worker_t *w = &prompt->worker;
+    sigset_t all, old;
+    int ret;
+
+    prompt->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (prompt->efd < 0)
+        return -1;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->requested = 0;
+    w->done = 0;
+    w->quit = false;
+    w->env_next = NULL;
+    w->env_generation = 0;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&w->thread, NULL, worker_main, prompt);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret != 0)
+    {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        close(prompt->efd);
+        prompt->efd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void worker_stop(prompt_t *prompt)
+{
+    prompt_worker_t *w = &prompt->worker;
+
+    if (prompt->efd < 0)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->quit = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+
+    free(w->env_next);
+    w->env_next = NULL;
+
+    close(prompt->efd);
+    prompt->efd = -1;
+}
+
+// Also hands over the variables if programs would see different ones
+void worker_request(prompt_t *prompt, kai_ctx_t *kai_ctx)
+{
+    prompt_worker_t *w = &prompt->worker;
+    char **envp, **env = NULL;
+
+    if (prompt->efd < 0)
+        return;
+
+    if (kai_ctx->vars.generation != w->env_generation && (envp = vars_envp(&kai_ctx->vars)))
+        env = copy_env(envp);
+
+    pthread_mutex_lock(&w->lock);
+    if (env)
+    {
+        free(w->env_next);
+        w->env_next = env;
+        w->env_generation = kai_ctx->vars.generation;
+    }
+    w->requested++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Computes every slow segment once per round, each result is handed over as
+ * soon as it's there. A newer request makes the rest of a round out of date,
+ * like the branch of the directory before a 'cd', so it starts over.
+ */
+void *worker_main(void *arg)
+{
+    prompt_t *prompt = arg;
+    prompt_worker_t *w = &prompt->worker;
+    char buf[PROMPT_ASYNC_MAX];
+    const uint64_t one = 1;
+    prompt_seg_t *seg;
+    unsigned long round;
+    char **env = NULL;
+    ssize_t len;
+    size_t i;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (!w->quit && w->done == w->requested)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->quit)
+            break;
+
+        round = w->requested;
+
+        if (w->env_next)
+        {
+            free(env);
+            env = w->env_next;
+            w->env_next = NULL;
+        }
+
+        for (i = 0; i < prompt->nsegs && round == w->requested && !w->quit; i++)
+        {
+            seg = &prompt->segs[i];
+            if (!seg->compute)
+                continue;
+
+            pthread_mutex_unlock(&w->lock);
+            len = seg->compute(buf, sizeof(buf), env);
+            pthread_mutex_lock(&w->lock);
+
+            if (round != w->requested)
+                break;
+
+            // snprintf() gives the length it wanted, not what fit
+            if (len < 0)
+                len = 0;
+            else if ((size_t)len >= sizeof(buf))
+                len = sizeof(buf) - 1;
+
+            memcpy(seg->pending, buf, len);
+            seg->pending_len = len;
+            seg->fresh = true;
+
+            // Only fails if the counter is full, which is readable all the same
+            if (write(prompt->efd, &one, sizeof(one)) < 0)
+                continue;
+        }
+
+        if (round == w->requested)
+            w->done = round;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    free(env);
+
+    return NULL;
+}
+
+// Looks for .git from the working directory up, a .git file points elsewhere
+int find_git_dir(char *path, size_t size)
+{
+    char link[PATH_MAX + 1];
+    struct stat st;
+    char *slash;
+    size_t len;
+
+    if (!getcwd(path, size - sizeof("/.git")))
+        return -1;
+
+    for (len = strlen(path);;)
+    {
+        strcpy(path + len, (len > 1) ? "/.git" : ".git");
+        if (stat(path, &st) == 0)
+            break;
+
+        path[len] = '\0';
+        slash = strrchr(path, '/');
+        if (!slash || len == 1)
+            return -1;
+
+        len = (slash == path) ? 1 : (size_t)(slash - path);
+        path[len] = '\0';
+    }
+
+    if (S_ISDIR(st.st_mode))
+        return 0;
+
+    // Worktrees and submodules: "gitdir: <path>", relative to where .git is
+    if (read_file(path, link, sizeof(link)) < 0 || strncmp(link, "gitdir: ", 8) != 0)
+        return -1;
+    link[strcspn(link, "\n")] = '\0';
+
+    if (link[8] == '/')
+    {
+        if (strlen(link + 8) >= size)
+            return -1;
+        strcpy(path, link + 8);
+        return 0;
+    }
+
+    path[len] = '\0';
+    if (len + 1 + strlen(link + 8) >= size)
+        return -1;
+    strcat(path, "/");
+    strcat(path, link + 8);
+
+    return 0;
+}
+
+// Reads what fits into buf and terminates it
+ssize_t read_file(const char *path, char *buf, size_t size)
+{
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len < 0)
+        return -1;
+
+    buf[len] = '\0';
+
+    return len;
+}
+
+/*
+ * Runs a program without input or output in a process group of its own, so
+ * Ctrl-C at the prompt doesn't reach it. It is looked up in the PATH of envp,
+ * which is NULL if the variables couldn't be copied. Gives its exit status,
+ * -1 if it couldn't run or was killed after timeout_ms. Without pidfds there
+ * is no timeout.
+ */
+int run_quiet(char *const argv[], char *const envp[], int timeout_ms)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    struct pollfd pfd;
+    sigset_t mask;
+    char *path;
+    int status;
+    pid_t pid;
+    size_t i;
+    int ret;
+
+    if (!envp)
+        return -1;
+
+    for (i = 0; envp[i] && strncmp(envp[i], "PATH=", 5) != 0; i++)
+        ;
+
+    path = cmdhash_search(argv[0], (envp[i]) ? envp[i] + 5 : NULL);
+    if (!path)
+        return -1;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    // The worker blocks everything and the shell ignores SIGPIPE
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+
+    ret = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    free(path);
+
+    if (ret != 0)
+        return -1;
+
+#ifdef SYS_pidfd_open
+    pfd.fd = syscall(SYS_pidfd_open, pid, 0);
+    pfd.events = POLLIN;
+    if (pfd.fd >= 0)
+    {
+        while ((ret = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+            ;
+        close(pfd.fd);
+
+        if (ret == 0)
+            kill(pid, SIGKILL);
+    }
+#endif
+
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    if (!WIFEXITED(status))
+        return -1;
+
+    return WEXITSTATUS(status);
+}
+
+// The array and the strings in one block, freed with a single free()
+char **copy_env(char *const envp[])
+{
+    size_t n, i, len, size = 0;
+    char **copy;
+    char *str;
+
+    for (n = 0; envp[n]; n++)
+        size += strlen(envp[n]) + 1;
+
+    copy = malloc((n + 1) * sizeof(char *) + size);
+    if (!copy)
+        return NULL;
+
+    str = (char *)(copy + n + 1);
+    for (i = 0; i < n; i++)
+    {
+        len = strlen(envp[i]) + 1;
+        memcpy(str, envp[i], len);
+        copy[i] = str;
+        str += len;
+    }
+    copy[n] = NULL;
+
+    return copy;
+}
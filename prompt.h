@@ -0,0 +1,86 @@
+#ifndef PROMPT_H
+#define PROMPT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+// Events after which a segment has to be computed again
+#define PROMPT_EV_CD 0x1   // Working directory changed
+#define PROMPT_EV_EVAL 0x2 // A command line ran
+#define PROMPT_EV_JOBS 0x4 // A job went away
+
+// Longest text of a segment computed in the background
+#define PROMPT_ASYNC_MAX 256
+
+struct kai_ctx;
+
+typedef struct prompt_seg
+{
+    const char *style; // Escape sequences put before the text
+    unsigned int events; // 0 if it's computed only once
+    int (*update)(struct prompt_seg *seg, struct kai_ctx *kai_ctx);
+
+    // Slow segments run on the worker instead, they fill buf and give its length, -1 on failure.
+    // Programs they start get envp.
+    ssize_t (*compute)(char *buf, size_t size, char *const envp[]);
+
+    char *text;
+    size_t len;
+    size_t cap;
+    bool changed; // Since the prompt was last put together
+
+    // Result of compute waiting to be picked up, guarded by the worker's lock
+    char pending[PROMPT_ASYNC_MAX];
+    size_t pending_len;
+    bool fresh;
+} prompt_seg_t;
+
+typedef struct prompt_worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Rounds asked for and finished, the worker catches up with requested
+    unsigned long requested;
+    unsigned long done;
+    bool quit;
+
+    // Copy of the exported variables, vars_set() frees the pairs vars_envp() gives.
+    // The worker takes it over when it starts a round.
+    char **env_next;
+    unsigned long env_generation;
+} prompt_worker_t;
+
+typedef struct prompt
+{
+    prompt_seg_t *segs;
+    size_t nsegs;
+    unsigned int stale; // Events since the last render
+
+    // Segments put together, only redone when one of them changed
+    char *text;
+    size_t len;
+    size_t cap;
+    size_t width; // Columns it takes on the terminal, fetchline places the cursor past them
+
+    // Readable once the worker has fresh values, -1 without a worker
+    int efd;
+    prompt_worker_t worker;
+} prompt_t;
+
+int prompt_init(prompt_t *prompt, struct kai_ctx *kai_ctx);
+
+void prompt_free(prompt_t *prompt);
+
+void prompt_invalidate(prompt_t *prompt, unsigned int events);
+
+int prompt_render(prompt_t *prompt, struct kai_ctx *kai_ctx);
+
+int prompt_collect(prompt_t *prompt);
+
+size_t prompt_width(const char *text, size_t len);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(KAI_SCAN_SCALAR) && defined(__x86_64__)
+#define SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+// Runs shorter than this are cheaper to finish byte by byte
+#define SHORT_RUN 16
+
+const unsigned char scan_class[256] = {
+    ['\0'] = SCAN_END,
+    [' '] = SCAN_BLANK,
+    ['\t'] = SCAN_BLANK,
+    ['\n'] = SCAN_BLANK,
+    ['\v'] = SCAN_BLANK,
+    ['\f'] = SCAN_BLANK,
+    ['\r'] = SCAN_BLANK,
+    ['\''] = SCAN_QUOTE,
+    ['"'] = SCAN_QUOTE,
+    ['|'] = SCAN_OP,
+    ['&'] = SCAN_OP,
+    ['<'] = SCAN_OP,
+    ['>'] = SCAN_OP,
+    [';'] = SCAN_OP,
+    ['$'] = SCAN_DOLLAR,
+    ['*'] = SCAN_GLOB,
+    ['?'] = SCAN_GLOB,
+    ['['] = SCAN_GLOB,
+};
+
+typedef size_t (*scan_fn_t)(const char *str);
+
+static size_t scan_resolve(const char *str);
+
+static size_t scan_scalar(const char *str);
+
+#ifdef SCAN_SIMD
+static size_t scan_sse2(const char *str);
+
+static size_t scan_avx2(const char *str);
+#endif
+
+static scan_fn_t scan_fn = scan_resolve;
+static const char *scan_name = "scalar";
+
+// Length of the run of word characters at the start of str
+size_t scan_word(const char *str)
+{
+    size_t len;
+
+    // Most words are short, only long runs are worth the vector loop
+    for (len = 0; len < SHORT_RUN; len++)
+    {
+        if (scan_class[(unsigned char)str[len]] != SCAN_WORD)
+            return len;
+    }
+
+    return len + scan_fn(str + len);
+}
+
+const char *scan_impl_name(void)
+{
+    if (scan_fn == scan_resolve)
+        scan_resolve("");
+
+    return scan_name;
+}
+
+// Picks the widest implementation the CPU supports on first use
+size_t scan_resolve(const char *str)
+{
+    scan_fn = scan_scalar;
+    scan_name = "scalar";
+
+#ifdef SCAN_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan_fn = scan_avx2;
+        scan_name = "avx2";
+    }
+    else
+    {
+        scan_fn = scan_sse2; // Always there on x86-64
+        scan_name = "sse2";
+    }
+#endif
+
+    return scan_fn(str);
+}
+
+size_t scan_scalar(const char *str)
+{
+    const unsigned char *p = (const unsigned char *)str;
+
+    while (scan_class[*p] == SCAN_WORD)
+        p++;
+
+    return p - (const unsigned char *)str;
+}
+
+#ifdef SCAN_SIMD
+/*
+ * Both vector versions only do aligned loads, which never cross into the next
+ * page, so reading a little before the string or past its terminator is safe.
+ * Lanes before the start are shifted out of the mask. ASan doesn't know that,
+ * hence no_sanitize_address.
+ */
+#define SSE2_EQ(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+
+__attribute__((no_sanitize_address)) static inline unsigned int delims_sse2(const char *block)
+{
+    __m128i v = _mm_load_si128((const __m128i *)block);
+    __m128i ctl, m;
+
+    // '\t' to '\r' in one go: v - 9 <= 4 unsigned
+    ctl = _mm_sub_epi8(v, _mm_set1_epi8(9));
+    m = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8(4)), ctl);
+
+    m = _mm_or_si128(m, SSE2_EQ(v, '\0'));
+    m = _mm_or_si128(m, SSE2_EQ(v, ' '));
+    m = _mm_or_si128(m, SSE2_EQ(v, '\''));
+    m = _mm_or_si128(m, SSE2_EQ(v, '"'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '|'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '&'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '<'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '>'));
+    m = _mm_or_si128(m, SSE2_EQ(v, ';'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '$'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '*'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '?'));
+    m = _mm_or_si128(m, SSE2_EQ(v, '['));
+
+    return _mm_movemask_epi8(m);
+}
+
+__attribute__((no_sanitize_address)) size_t scan_sse2(const char *str)
+{
+    const char *block = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+    unsigned int mask;
+
+    mask = delims_sse2(block) >> (str - block);
+    if (mask)
+        return __builtin_ctz(mask);
+
+    for (;;)
+    {
+        block += 16;
+        mask = delims_sse2(block);
+        if (mask)
+            return block + __builtin_ctz(mask) - str;
+    }
+}
+
+#define AVX2_EQ(v, c) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))
+
+__attribute__((target("avx2"), no_sanitize_address)) static inline unsigned int delims_avx2(const char *block)
+{
+    __m256i v = _mm256_load_si256((const __m256i *)block);
+    __m256i ctl, m;
+
+    ctl = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+    m = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, _mm256_set1_epi8(4)), ctl);
+
+    m = _mm256_or_si256(m, AVX2_EQ(v, '\0'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, ' '));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '\''));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '"'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '|'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '&'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '<'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '>'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, ';'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '$'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '*'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '?'));
+    m = _mm256_or_si256(m, AVX2_EQ(v, '['));
+
+    return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) size_t scan_avx2(const char *str)
+{
+    const char *block = (const char *)((uintptr_t)str & ~(uintptr_t)31);
+    unsigned int mask;
+
+    mask = delims_avx2(block) >> (str - block);
+    if (mask)
+        return __builtin_ctz(mask);
+
+    for (;;)
+    {
+        block += 32;
+        mask = delims_avx2(block);
+        if (mask)
+            return block + __builtin_ctz(mask) - str;
+    }
+}
+#endif
@@ -0,0 +1,21 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Character classes, anything not listed is part of a word
+#define SCAN_WORD 0
+#define SCAN_END 1
+#define SCAN_BLANK 2
+#define SCAN_QUOTE 3
+#define SCAN_OP 4
+#define SCAN_DOLLAR 5 // Starts an expansion
+#define SCAN_GLOB 6   // Wildcard of a path pattern
+
+extern const unsigned char scan_class[256];
+
+size_t scan_word(const char *str);
+
+const char *scan_impl_name(void);
+
+#endif
@@ -0,0 +1,307 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "script.h"
+#include "eval.h"
+#include "jobs.h"
+#include "kai.h"
+
+#define READ_CHUNK_LEN (64 * 1024)
+#define MAX_EVENTS 16
+
+static bool run_line_at(int fd, char *line, size_t len, size_t rest, kai_ctx_t *kai_ctx);
+
+static int wait_input(int fd, int epfd, kai_ctx_t *kai_ctx);
+
+static int run_line(char *line, size_t len, kai_ctx_t *kai_ctx);
+
+static void end_input(kai_ctx_t *kai_ctx);
+
+static void reap_jobs(kai_ctx_t *kai_ctx);
+
+static void finish_tasks(kai_ctx_t *kai_ctx);
+
+static bool runs_tasks(const job_t *job);
+
+/*
+ * Non-interactive input is handed to eval() line by line, without prompt,
+ * terminal setup or history. Commands that read the shell's input get the
+ * rest of the script like in sh: files are read in large chunks with the
+ * offset moved back to the end of the line while it runs, pipes and
+ * terminals can't be, so they are read a byte at a time.
+ */
+int script_run_fd(int fd, kai_ctx_t *kai_ctx)
+{
+    char *buf, *new_buf;
+    size_t cap = READ_CHUNK_LEN;
+    size_t len = 0;
+    size_t start, end;
+    size_t want;
+    char *nl;
+    ssize_t nread;
+    int epfd = -1;
+    struct epoll_event ev;
+
+    want = (lseek(fd, 0, SEEK_CUR) >= 0) ? READ_CHUNK_LEN : 1;
+
+    buf = malloc(cap + 1); // + 1 for '\0' of the last line
+    if (!buf)
+        return -1;
+
+    // Background jobs are reaped and their in-process stages moved along while input is awaited
+    if (want == 1)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            // Jobs are still collected after every line
+            close(epfd);
+            epfd = -1;
+        }
+
+        kai_ctx->jobs.epfd = epfd;
+    }
+
+    while (kai_ctx->running)
+    {
+        // Make room for a full read, lines longer than a chunk grow the buffer
+        if (cap - len < want)
+        {
+            new_buf = realloc(buf, cap * 2 + 1);
+            if (!new_buf)
+                goto fail;
+
+            buf = new_buf;
+            cap *= 2;
+        }
+
+        if (epfd >= 0 && wait_input(fd, epfd, kai_ctx) < 0)
+            goto fail;
+
+        nread = read(fd, buf + len, (want == 1) ? 1 : cap - len);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+        if (nread == 0)
+            break;
+
+        // Only the new bytes can contain line breaks not seen yet
+        start = 0;
+        end = len + nread;
+        nl = memchr(buf + len, '\n', nread);
+        while (nl && kai_ctx->running)
+        {
+            // What the line's command read is gone from what was read ahead
+            if (!run_line_at(fd, buf + start, nl - (buf + start), end - (nl - buf + 1), kai_ctx))
+                end = nl - buf + 1;
+
+            start = nl - buf + 1;
+            nl = memchr(buf + start, '\n', end - start);
+        }
+
+        // Keep the incomplete last line for the next read
+        len = end - start;
+        memmove(buf, buf + start, len);
+    }
+
+    // Input may not end with a line break
+    if (len > 0 && kai_ctx->running)
+        run_line(buf, len, kai_ctx);
+
+    end_input(kai_ctx);
+
+    if (epfd >= 0)
+    {
+        kai_ctx->jobs.epfd = -1;
+        close(epfd);
+    }
+
+    free(buf);
+    return 0;
+
+fail:
+    if (epfd >= 0)
+    {
+        kai_ctx->jobs.epfd = -1;
+        close(epfd);
+    }
+
+    free(buf);
+    return -1;
+}
+
+int script_run_string(const char *input, kai_ctx_t *kai_ctx)
+{
+    char *copy;
+    char *line, *nl;
+
+    copy = strdup(input);
+    if (!copy)
+        return -1;
+
+    for (line = copy; line && kai_ctx->running; line = (nl) ? nl + 1 : NULL)
+    {
+        nl = strchr(line, '\n');
+        run_line(line, (nl) ? (size_t)(nl - line) : strlen(line), kai_ctx);
+    }
+
+    end_input(kai_ctx);
+
+    free(copy);
+    return 0;
+}
+
+/*
+ * Runs a line with the input offset at the rest bytes read past it. Returns
+ * false if the command moved the offset, what was read ahead is stale then.
+ */
+bool run_line_at(int fd, char *line, size_t len, size_t rest, kai_ctx_t *kai_ctx)
+{
+    off_t pos;
+
+    if (rest == 0)
+    {
+        run_line(line, len, kai_ctx);
+        return true;
+    }
+
+    pos = lseek(fd, -(off_t)rest, SEEK_CUR);
+
+    run_line(line, len, kai_ctx);
+
+    if (pos < 0 || lseek(fd, 0, SEEK_CUR) != pos)
+        return false;
+
+    lseek(fd, rest, SEEK_CUR);
+    return true;
+}
+
+// Blocks until fd has input, collecting background jobs that finish meanwhile
+int wait_input(int fd, int epfd, kai_ctx_t *kai_ctx)
+{
+    struct epoll_event events[MAX_EVENTS];
+    bool ready = false;
+    int n, i;
+
+    // Without jobs there is nothing to collect, the read can just block
+    while (!ready && kai_ctx->jobs.count > 0)
+    {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (i = 0; i < n; i++)
+            ready |= events[i].data.fd == fd;
+
+        reap_jobs(kai_ctx);
+    }
+
+    return 0;
+}
+
+int run_line(char *line, size_t len, kai_ctx_t *kai_ctx)
+{
+    eval_res_t evresult;
+
+    line[len] = '\0';
+
+    eval(&evresult, line, kai_ctx);
+    if (evresult.status < 0)
+    {
+        fprintf(stderr, "[!] Error: %s\n", evresult.err_msg);
+        return -1;
+    }
+
+    reap_jobs(kai_ctx);
+
+    return 0;
+}
+
+// A command still waiting for the end of its heredoc isn't run
+void end_input(kai_ctx_t *kai_ctx)
+{
+    eval_res_t evresult;
+
+    eval_end(&evresult, kai_ctx);
+    if (evresult.status < 0)
+        fprintf(stderr, "[!] Error: %s\n", evresult.err_msg);
+
+    finish_tasks(kai_ctx);
+}
+
+// Nobody is around to be told about background jobs, just collect them
+void reap_jobs(kai_ctx_t *kai_ctx)
+{
+    job_t *job;
+    size_t iter;
+
+    job_table_poll(&kai_ctx->jobs);
+
+    iter = 0;
+    while ((job = job_table_next_notify(&kai_ctx->jobs, &iter)))
+    {
+        if (job->state == JOB_DONE)
+        {
+            job_table_retire(&kai_ctx->jobs, job);
+            iter--;
+        }
+    }
+}
+
+/*
+ * In-process stages of background jobs end with the shell, unlike processes,
+ * so jobs with any left are waited for.
+ */
+void finish_tasks(kai_ctx_t *kai_ctx)
+{
+    job_t *job;
+    size_t i;
+
+    for (i = 0; i < kai_ctx->jobs.count;)
+    {
+        job = kai_ctx->jobs.jobs[i];
+
+        if (job->state == JOB_RUNNING && runs_tasks(job) && job_wait(&kai_ctx->jobs, job) < 0)
+            break;
+
+        if (job->state == JOB_DONE)
+            job_table_remove(&kai_ctx->jobs, job);
+        else
+            i++;
+    }
+}
+
+bool runs_tasks(const job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->nprocs; i++)
+    {
+        if (job->procs[i].task && !job->procs[i].done)
+            return true;
+    }
+
+    for (i = 0; i < job->nhelpers; i++)
+    {
+        if (!job->helpers[i]->done)
+            return true;
+    }
+
+    return false;
+}
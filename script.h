@@ -0,0 +1,10 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "kai.h"
+
+int script_run_fd(int fd, kai_ctx_t *kai_ctx);
+
+int script_run_string(const char *input, kai_ctx_t *kai_ctx);
+
+#endif
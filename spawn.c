@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <spawn.h>
+#include <signal.h>
+
+#include "spawn.h"
+#include "parser.h"
+
+static void job_signals(sigset_t *set);
+
+static void join_group(pid_t pid, const spawn_attr_t *sattr);
+
+#ifndef KAI_SPAWN_FORK
+
+/*
+ * posix_spawn() is backed by clone(CLONE_VM | CLONE_VFORK) in glibc, so the
+ * child never copies our page tables and the exec errno is handed back to us
+ * directly as the return value. The status is therefore already known when
+ * spawn_start() returns.
+ */
+int spawn_start(spawn_handle_t *handle, command_t *cmd, const char *path, int infd, int outfd,
+                const spawn_attr_t *sattr)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigmask;
+    short flags;
+
+    int ret;
+
+    handle->pid = -1;
+    handle->status_fd = -1;
+    handle->stale = false; // start_stage() retries itself, the error is known here
+
+    ret = posix_spawnattr_init(&attr);
+    if (ret != 0)
+        goto end;
+
+    // Signals the shell blocks for itself shouldn't stay blocked in children
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    flags = POSIX_SPAWN_SETSIGMASK;
+
+    // Nor should the ones it ignores for job control
+    job_signals(&sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigmask);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+
+    if (sattr->pgid >= 0)
+    {
+        posix_spawnattr_setpgroup(&attr, sattr->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+
+    posix_spawnattr_setflags(&attr, flags);
+
+    ret = posix_spawn_file_actions_init(&actions);
+    if (ret != 0)
+        goto destroy_attr;
+
+#if __GLIBC_PREREQ(2, 35)
+    // Take the terminal before exec, so the program can't race us for it
+    if (sattr->tty_fd >= 0)
+    {
+        ret = posix_spawn_file_actions_addtcsetpgrp_np(&actions, sattr->tty_fd);
+        if (ret != 0)
+            goto destroy;
+    }
+#endif
+
+    if (outfd != STDOUT_FILENO)
+    {
+        ret = posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+        if (ret != 0)
+            goto destroy;
+    }
+    if (infd != STDIN_FILENO)
+    {
+        ret = posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+        if (ret != 0)
+            goto destroy;
+    }
+
+    ret = posix_spawn(&handle->pid, path, &actions, &attr, cmd->argv, sattr->envp);
+    if (ret == 0)
+        join_group(handle->pid, sattr);
+
+destroy:
+    posix_spawn_file_actions_destroy(&actions);
+destroy_attr:
+    posix_spawnattr_destroy(&attr);
+end:
+    handle->err = ret;
+
+    return (ret != 0) ? -1 : 0;
+}
+
+#else
+
+/*
+ * The child reports a failed exec through a close-on-exec pipe. Reading the
+ * report is deferred to spawn_finish() so that several children can be
+ * forked before waiting on any of them.
+ */
+int spawn_start(spawn_handle_t *handle, command_t *cmd, const char *path, int infd, int outfd,
+                const spawn_attr_t *sattr)
+{
+    pid_t fpid;
+    int pipefd[2];
+    sigset_t sigmask;
+    int sig, stale;
+
+    handle->pid = -1;
+    handle->status_fd = -1;
+    handle->err = 0;
+    handle->stale = false;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+    {
+        handle->err = errno;
+        return -1;
+    }
+
+    fpid = fork();
+    if (fpid < 0)
+    {
+        handle->err = errno;
+
+        close(pipefd[0]);
+        close(pipefd[1]);
+
+        return -1;
+    }
+    else if (fpid == 0)
+    {
+        // Close reading end of pipe on child
+        close(pipefd[0]);
+
+        join_group(0, sattr);
+
+        job_signals(&sigmask);
+        for (sig = 1; sig < NSIG; sig++)
+        {
+            if (sigismember(&sigmask, sig))
+                signal(sig, SIG_DFL);
+        }
+
+        sigemptyset(&sigmask);
+        sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+        if (dup2(outfd, STDOUT_FILENO) < 0)
+            goto error;
+        if (dup2(infd, STDIN_FILENO) < 0)
+            goto error;
+
+        execve(path, cmd->argv, sattr->envp);
+
+        // The shell only hears of a stale cached path in spawn_finish(), so search PATH here
+        stale = -ENOENT;
+        if (errno == ENOENT && path != cmd->argv[0] && write(pipefd[1], &stale, sizeof(stale)) == sizeof(stale))
+        {
+            environ = sattr->envp;
+            execvp(cmd->argv[0], cmd->argv);
+        }
+
+    error:
+        if (write(pipefd[1], &errno, sizeof(errno)) != sizeof(errno))
+            _exit(126);
+        _exit(127);
+    }
+
+    // Close writing end of pipe on parent
+    close(pipefd[1]);
+
+    // Also done here, so the group exists before the next stage joins it
+    join_group(fpid, sattr);
+
+    handle->pid = fpid;
+    handle->status_fd = pipefd[0];
+
+    return 0;
+}
+
+#endif
+
+pid_t spawn_finish(spawn_handle_t *handle)
+{
+    int exec_errno;
+    ssize_t ret;
+
+    if (handle->status_fd >= 0)
+    {
+        ret = read(handle->status_fd, &exec_errno, sizeof(exec_errno));
+
+        // -ENOENT comes first when the child had to search PATH, its outcome follows
+        if (ret == sizeof(exec_errno) && exec_errno == -ENOENT)
+        {
+            handle->stale = true;
+            ret = read(handle->status_fd, &exec_errno, sizeof(exec_errno));
+        }
+
+        if (ret < 0)
+            handle->err = errno;
+        else if (ret > 0)
+            handle->err = exec_errno;
+        // else: pipe closed by a successful exec
+
+        close(handle->status_fd);
+        handle->status_fd = -1;
+
+        if (handle->err != 0)
+        {
+            kill(handle->pid, SIGKILL);
+            waitpid(handle->pid, NULL, 0);
+            handle->pid = -1;
+        }
+    }
+
+    if (handle->err != 0)
+    {
+        errno = handle->err;
+        return -1;
+    }
+
+    return handle->pid;
+}
+
+/*
+ * Forks a copy of the shell set up like a stage, for what has to run apart
+ * from it without exec. Returns 0 in the child, which must _exit(), and the
+ * pid in the shell. Stdout has to be flushed before.
+ */
+pid_t spawn_fork(spawn_handle_t *handle, int infd, int outfd, const spawn_attr_t *sattr)
+{
+    sigset_t sigmask;
+    pid_t fpid;
+    int sig;
+
+    handle->pid = -1;
+    handle->status_fd = -1;
+    handle->err = 0;
+    handle->stale = false;
+
+    fpid = fork();
+    if (fpid < 0)
+    {
+        handle->err = errno;
+        return -1;
+    }
+
+    if (fpid == 0)
+    {
+        join_group(0, sattr);
+
+        job_signals(&sigmask);
+        for (sig = 1; sig < NSIG; sig++)
+        {
+            if (sigismember(&sigmask, sig))
+                signal(sig, SIG_DFL);
+        }
+
+        sigemptyset(&sigmask);
+        sigprocmask(SIG_SETMASK, &sigmask, NULL);
+
+        if (dup2(outfd, STDOUT_FILENO) < 0 || dup2(infd, STDIN_FILENO) < 0)
+            _exit(126);
+
+        // Without an exec close-on-exec does nothing, a write end of the input would keep EOF away
+        close_range(3, ~0U, 0);
+
+        return 0;
+    }
+
+    join_group(fpid, sattr);
+
+    handle->pid = fpid;
+    return fpid;
+}
+
+void job_signals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGTSTP);
+    sigaddset(set, SIGTTIN);
+    sigaddset(set, SIGTTOU);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGPIPE);
+}
+
+/*
+ * Called from both sides of the spawn, whichever runs first wins. A pid of 0
+ * refers to the calling process.
+ */
+void join_group(pid_t pid, const spawn_attr_t *sattr)
+{
+    pid_t pgid;
+
+    if (sattr->pgid < 0)
+        return;
+
+    setpgid(pid, sattr->pgid);
+
+    if (sattr->tty_fd >= 0)
+    {
+        pgid = (sattr->pgid) ? sattr->pgid : ((pid) ? pid : getpid());
+        tcsetpgrp(sattr->tty_fd, pgid);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "parser.h"
+
+typedef struct spawn_attr
+{
+    pid_t pgid; // Process group to join, 0 for a new one, -1 to stay in ours
+    int tty_fd; // Terminal to hand to the group, -1 to leave it alone
+    char **envp; // Environment of the program
+} spawn_attr_t;
+
+typedef struct spawn_handle
+{
+    pid_t pid;
+    int err;       // exec errno once known, 0 on success
+    int status_fd; // Pending exec status report, -1 if none
+    bool stale;    // The path given was gone and the program was looked up in PATH again
+} spawn_handle_t;
+
+int spawn_start(spawn_handle_t *handle, command_t *cmd, const char *path, int infd, int outfd,
+                const spawn_attr_t *sattr);
+
+pid_t spawn_finish(spawn_handle_t *handle);
+
+pid_t spawn_fork(spawn_handle_t *handle, int infd, int outfd, const spawn_attr_t *sattr);
+
+#endif
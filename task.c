@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "task.h"
+
+#define TASK_BUF_LEN (64 * 1024)
+#define TASK_STEP_READS 16 // Then the step yields, a source that never blocks mustn't keep Ctrl-C out
+
+static bool fanout_step(task_t *task);
+
+static int fill_sinks(task_t *task);
+
+static int drain_sink(task_t *task, task_sink_t *sink);
+
+static bool open_source(task_t *task);
+
+static bool ready(int fd, short events);
+
+static void wait_on(task_t *task, int fd, uint32_t events);
+
+static void finish(task_t *task, int status);
+
+static void close_fd(task_t *task, int *fd);
+
+static void close_sinks(task_t *task);
+
+/*
+ * Files are copied in order, "-" stands for infd, which is also the only
+ * source when there are no files. The task works on duplicates of infd and
+ * outfd, the caller keeps its own.
+ */
+task_t *task_new(char **files, size_t nfiles, int infd, int outfd, int status)
+{
+    task_t *task;
+    size_t i;
+    int flags;
+
+    task = calloc(1, sizeof(task_t));
+    if (!task)
+        return NULL;
+
+    task->infd = -1;
+    task->outfd = -1;
+    task->stdin_fd = -1;
+    task->wait_fd = -1;
+    task->epfd = -1;
+    task->epoll_fd = -1;
+    task->status = status;
+
+    task->buf = malloc(TASK_BUF_LEN);
+    task->files = (nfiles > 0) ? calloc(nfiles, sizeof(char *)) : NULL;
+    if (!task->buf || (nfiles > 0 && !task->files))
+        goto fail;
+
+    for (i = 0; i < nfiles; i++)
+    {
+        task->files[i] = strdup(files[i]);
+        if (!task->files[i])
+            goto fail;
+    }
+    task->nfiles = nfiles;
+
+    if (outfd >= 0)
+    {
+        task->outfd = fcntl(outfd, F_DUPFD_CLOEXEC, 3);
+        if (task->outfd < 0)
+            goto fail;
+
+        flags = fcntl(task->outfd, F_GETFL);
+        task->out_nonblock = flags >= 0 && (flags & O_NONBLOCK);
+    }
+
+    if (infd >= 0)
+    {
+        task->stdin_fd = fcntl(infd, F_DUPFD_CLOEXEC, 3);
+        if (task->stdin_fd < 0)
+            goto fail;
+
+        task->reads_input = true;
+    }
+
+    return task;
+
+fail:
+    task_free(task);
+    return NULL;
+}
+
+/*
+ * Copies the pipe infd to every fd in outfds without the data passing
+ * through user space: each sink gets the chunk in infd through tee() into a
+ * pipe of its own, from which it is spliced on. Only sinks that can't be
+ * spliced into, like terminals, fall back to read() and write().
+ */
+task_t *task_fanout(int infd, const int *outfds, size_t nout)
+{
+    task_t *task;
+    int pipe_size;
+    size_t i;
+
+    task = task_new(NULL, 0, -1, -1, 0);
+    if (!task)
+        return NULL;
+
+    task->sinks = calloc(nout, sizeof(task_sink_t));
+    if (!task->sinks)
+        goto fail;
+
+    for (i = 0; i < nout; i++)
+    {
+        task->sinks[i].fd = -1;
+        task->sinks[i].pipe[0] = task->sinks[i].pipe[1] = -1;
+    }
+    task->nsinks = nout;
+
+    task->infd = fcntl(infd, F_DUPFD_CLOEXEC, 3);
+    if (task->infd < 0)
+        goto fail;
+
+    // A sink pipe has to take in everything infd can hold
+    pipe_size = fcntl(infd, F_GETPIPE_SZ);
+
+    for (i = 0; i < nout; i++)
+    {
+        task->sinks[i].fd = fcntl(outfds[i], F_DUPFD_CLOEXEC, 3);
+        if (task->sinks[i].fd < 0 || pipe2(task->sinks[i].pipe, O_CLOEXEC) < 0)
+            goto fail;
+
+        if (pipe_size > 0 && fcntl(task->sinks[i].pipe[1], F_SETPIPE_SZ, pipe_size) < 0)
+            goto fail;
+    }
+
+    return task;
+
+fail:
+    task_free(task);
+    return NULL;
+}
+
+void task_free(task_t *task)
+{
+    size_t i;
+
+    if (!task)
+        return;
+
+    close_fd(task, &task->infd);
+    close_fd(task, &task->stdin_fd);
+    close_fd(task, &task->outfd);
+    close_sinks(task);
+    free(task->sinks);
+
+    for (i = 0; i < task->nfiles; i++)
+        free(task->files[i]);
+
+    free(task->files);
+    free(task->buf);
+    free(task);
+}
+
+/*
+ * Moves data along until an fd would block. Returns true once the task is
+ * done, its fds are closed by then so the neighbouring stages see EOF.
+ */
+bool task_step(task_t *task)
+{
+    ssize_t n;
+    size_t count;
+    int reads = 0;
+
+    if (task->sinks)
+        return fanout_step(task);
+
+    while (!task->done)
+    {
+        if (task->off < task->len)
+        {
+            if (!ready(task->outfd, POLLOUT))
+            {
+                wait_on(task, task->outfd, EPOLLOUT);
+                return false;
+            }
+
+            // A full PIPE_BUF is guaranteed not to block after POLLOUT
+            count = task->len - task->off;
+            if (!task->out_nonblock && count > PIPE_BUF)
+                count = PIPE_BUF;
+
+            n = write(task->outfd, task->buf + task->off, count);
+            if (n < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+
+                // Reader went away, like a process killed by SIGPIPE
+                finish(task, (errno == EPIPE) ? 128 + SIGPIPE : 1);
+                break;
+            }
+
+            task->off += n;
+            continue;
+        }
+
+        if (task->infd < 0 && !open_source(task))
+        {
+            finish(task, task->status);
+            break;
+        }
+        if (task->infd < 0)
+            continue; // File couldn't be opened, try the next one
+
+        if (!ready(task->infd, POLLIN) || reads++ == TASK_STEP_READS)
+        {
+            wait_on(task, task->infd, EPOLLIN);
+            return false;
+        }
+
+        n = read(task->infd, task->buf, TASK_BUF_LEN);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+
+            fprintf(stderr, "cat: %s\n", strerror(errno));
+            task->status = 1;
+            n = 0;
+        }
+
+        if (n == 0)
+        {
+            // Source exhausted, the stage input is closed once the task is done
+            if (task->infd != task->stdin_fd)
+                close_fd(task, &task->infd);
+            task->infd = -1;
+            continue;
+        }
+
+        task->len = n;
+        task->off = 0;
+    }
+
+    return true;
+}
+
+// Stops the task early, like a process killed by a signal
+void task_cancel(task_t *task, int status)
+{
+    if (!task->done)
+        finish(task, status);
+}
+
+// Keeps the fd the task waits on registered in epfd
+void task_watch(task_t *task, int epfd)
+{
+    task->epfd = epfd;
+    wait_on(task, task->wait_fd, task->wait_events);
+}
+
+/*
+ * Works in chunks: once every sink has passed on its copy of the last one,
+ * the next is taken from infd. Sinks are drained in order, a step resumes
+ * at the one it stopped at since the copy buffer may hold its data.
+ */
+bool fanout_step(task_t *task)
+{
+    task_sink_t *sink;
+    size_t i;
+    int reads = 0;
+    int ret;
+
+    while (!task->done)
+    {
+        for (i = task->cur_sink; i < task->nsinks; i++)
+        {
+            sink = &task->sinks[i];
+            task->cur_sink = i;
+
+            while (sink->pending > 0 || task->off < task->len)
+            {
+                if (!ready(sink->fd, POLLOUT))
+                {
+                    wait_on(task, sink->fd, EPOLLOUT);
+                    return false;
+                }
+
+                if (drain_sink(task, sink) < 0)
+                {
+                    // A reader that went away ends the copy, like it would for tee
+                    if (errno == EPIPE)
+                    {
+                        finish(task, 128 + SIGPIPE);
+                        return true;
+                    }
+
+                    fprintf(stderr, "[!] Fan-out: %s\n", strerror(errno));
+                    task->status = 1;
+
+                    // Leave this sink out from now on
+                    sink->pending = 0;
+                    task->off = task->len = 0;
+                    close_fd(task, &sink->fd);
+                    sink->fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+                    if (sink->fd < 0)
+                    {
+                        finish(task, 1);
+                        return true;
+                    }
+                }
+            }
+        }
+
+        task->cur_sink = 0;
+
+        if (!ready(task->infd, POLLIN) || reads++ == TASK_STEP_READS)
+        {
+            wait_on(task, task->infd, EPOLLIN);
+            return false;
+        }
+
+        ret = fill_sinks(task);
+        if (ret < 0 && errno == EAGAIN)
+            continue;
+        if (ret <= 0)
+        {
+            if (ret < 0)
+                fprintf(stderr, "[!] Fan-out: %s\n", strerror(errno));
+
+            finish(task, (ret < 0) ? 1 : task->status);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Hands every sink a copy of what infd holds, the last one takes it out of
+ * infd. Returns the chunk size, 0 at the end of input.
+ */
+int fill_sinks(task_t *task)
+{
+    ssize_t chunk = 0, n;
+    size_t i, moved;
+
+    for (i = 0; i + 1 < task->nsinks; i++)
+    {
+        n = tee(task->infd, task->sinks[i].pipe[1], (i == 0) ? INT_MAX : chunk, SPLICE_F_NONBLOCK);
+        if (n <= 0)
+            return n;
+
+        // Sink pipes are as large as infd and empty, so they all get the full chunk
+        if (i > 0 && n != chunk)
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        chunk = n;
+        task->sinks[i].pending = n;
+    }
+
+    if (i == 0)
+    {
+        // A single sink takes whatever there is
+        chunk = splice(task->infd, NULL, task->sinks[0].pipe[1], NULL, INT_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (chunk <= 0)
+            return chunk;
+    }
+
+    for (moved = (i == 0) ? chunk : 0; moved < (size_t)chunk; moved += n)
+    {
+        n = splice(task->infd, NULL, task->sinks[i].pipe[1], NULL, chunk - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR)
+        {
+            n = 0;
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+    }
+    task->sinks[i].pending = chunk;
+
+    return chunk;
+}
+
+// Passes some of the sink's chunk on, -1 on failure
+int drain_sink(task_t *task, task_sink_t *sink)
+{
+    ssize_t n;
+
+    if (!sink->copy)
+    {
+        n = splice(sink->pipe[0], NULL, sink->fd, NULL, sink->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0)
+        {
+            sink->pending -= n;
+            return 0;
+        }
+        if (errno != EINVAL)
+            return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+
+        sink->copy = true;
+    }
+
+    if (task->off == task->len)
+    {
+        n = read(sink->pipe[0], task->buf, (sink->pending < TASK_BUF_LEN) ? sink->pending : TASK_BUF_LEN);
+        if (n <= 0)
+            return (n < 0 && errno == EINTR) ? 0 : -1;
+
+        sink->pending -= n;
+        task->len = n;
+        task->off = 0;
+    }
+
+    n = write(sink->fd, task->buf + task->off, task->len - task->off);
+    if (n < 0)
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+
+    task->off += n;
+    if (task->off == task->len)
+        task->off = task->len = 0;
+
+    return 0;
+}
+
+// Sets up the next source, false if there are none left
+bool open_source(task_t *task)
+{
+    const char *name;
+
+    if (task->nfiles == 0)
+    {
+        if (task->next_file++ > 0 || task->stdin_fd < 0)
+            return false;
+
+        task->infd = task->stdin_fd;
+        return true;
+    }
+
+    if (task->next_file >= task->nfiles)
+        return false;
+
+    name = task->files[task->next_file++];
+    if (strcmp(name, "-") == 0)
+    {
+        task->infd = task->stdin_fd;
+        return true;
+    }
+
+    task->infd = open(name, O_RDONLY | O_CLOEXEC);
+    if (task->infd < 0)
+    {
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+        task->status = 1;
+    }
+
+    return true;
+}
+
+bool ready(int fd, short events)
+{
+    struct pollfd pfd = {.fd = fd, .events = events};
+
+    // Errors and hangups are left for read() and write() to report
+    return poll(&pfd, 1, 0) != 0;
+}
+
+void wait_on(task_t *task, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    task->wait_fd = fd;
+    task->wait_events = events;
+
+    if (task->epfd < 0)
+        return;
+
+    if (task->epoll_fd >= 0 && task->epoll_fd != fd)
+    {
+        epoll_ctl(task->epfd, EPOLL_CTL_DEL, task->epoll_fd, NULL);
+        task->epoll_fd = -1;
+    }
+
+    if (fd < 0)
+        return;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(task->epfd, (task->epoll_fd == fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0)
+        task->epoll_fd = fd;
+}
+
+void finish(task_t *task, int status)
+{
+    task->status = status;
+    task->done = true;
+
+    wait_on(task, -1, 0);
+
+    if (task->infd != task->stdin_fd)
+        close_fd(task, &task->infd);
+    task->infd = -1;
+
+    close_fd(task, &task->stdin_fd);
+    close_fd(task, &task->outfd);
+    close_sinks(task);
+}
+
+void close_sinks(task_t *task)
+{
+    size_t i;
+
+    for (i = 0; i < task->nsinks; i++)
+    {
+        close_fd(task, &task->sinks[i].fd);
+        close_fd(task, &task->sinks[i].pipe[0]);
+        close_fd(task, &task->sinks[i].pipe[1]);
+    }
+}
+
+void close_fd(task_t *task, int *fd)
+{
+    if (*fd < 0)
+        return;
+
+    // Closing a dup doesn't drop the description from epoll
+    if (task->epoll_fd == *fd)
+    {
+        epoll_ctl(task->epfd, EPOLL_CTL_DEL, *fd, NULL);
+        task->epoll_fd = -1;
+    }
+
+    close(*fd);
+    *fd = -1;
+}
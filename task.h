@@ -0,0 +1,66 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// One destination of a fan-out task
+typedef struct task_sink
+{
+    int fd;
+    int pipe[2]; // Holds this sink's copy of the current chunk
+    size_t pending; // Bytes of the chunk still in pipe
+    bool copy; // fd doesn't take splice(), the chunk goes through the task buffer
+} task_sink_t;
+
+/*
+ * A pipeline stage run inside the shell. It copies its sources to outfd a
+ * buffer at a time and never blocks, task_step() is called again once the fd
+ * it waits on is ready.
+ */
+typedef struct task
+{
+    int infd;  // Source being copied, -1 between sources
+    int outfd;
+    int stdin_fd; // Input of the stage, used for "-" or when there are no files
+    bool captured; // stdin_fd is a memfd already holding all the output, see capture_stage()
+    bool reads_input; // Was given a stage input, stays set once stdin_fd is closed
+    bool out_nonblock;
+
+    char **files; // Sources still to open, NULL if the stage input is the only one
+    size_t nfiles;
+    size_t next_file;
+
+    char *buf;
+    size_t len;
+    size_t off;
+
+    // Fan-out tasks copy infd to every sink instead of outfd
+    task_sink_t *sinks;
+    size_t nsinks;
+    size_t cur_sink; // Sink being drained, the only one whatever is in buf belongs to
+
+    int status;
+    bool done;
+
+    // What the task waits on and the epoll set it is registered in
+    int wait_fd;
+    uint32_t wait_events;
+    int epfd;
+    int epoll_fd; // fd currently in epfd, -1 if none
+} task_t;
+
+task_t *task_new(char **files, size_t nfiles, int infd, int outfd, int status);
+
+task_t *task_fanout(int infd, const int *outfds, size_t nout);
+
+void task_free(task_t *task);
+
+bool task_step(task_t *task);
+
+void task_cancel(task_t *task, int status);
+
+void task_watch(task_t *task, int epfd);
+
+#endif
@@ -0,0 +1,722 @@
+/*
+ * In-process versions of small utilities that scripts call all the time.
+ * They write to stdout and read fd 0, eval_builtin() points those at the
+ * command's redirections beforehand.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "utils.h"
+
+#define CAT_BUF_LEN (64 * 1024)
+
+static const char ERR_NO_FORMAT[] = "Missing format string";
+static const char ERR_MISSING_BRACKET[] = "Missing ']'";
+static const char ERR_TEST_SYNTAX[] = "Invalid test expression";
+static const char ERR_TEST_INTEGER[] = "Integer expression expected";
+
+typedef struct test_ctx
+{
+    char **argv;
+    size_t argc;
+    size_t pos;
+    const char *err;
+} test_ctx_t;
+
+static bool put_escape(const char **str, bool octal_zero);
+
+static const char *print_spec(const char *fmt, char ***args, char **end, bool *stop, int *status);
+
+static long long arg_integer(const char *arg, int *status);
+
+static bool test_or(test_ctx_t *t);
+
+static bool test_and(test_ctx_t *t);
+
+static bool test_not(test_ctx_t *t);
+
+static bool test_primary(test_ctx_t *t);
+
+static bool test_unary(const char *op, const char *arg, test_ctx_t *t);
+
+static bool test_binary(const char *lhs, const char *op, const char *rhs, test_ctx_t *t);
+
+static bool is_unary_op(const char *op);
+
+static bool is_binary_op(const char *op);
+
+static long long test_integer(const char *str, test_ctx_t *t);
+
+static int cat_fd(int fd);
+
+static bool cat_ends(const char *path);
+
+static void set_exit(eval_res_t *result, int status);
+
+int util_echo(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    bool newline = true, escapes = false;
+    const char *arg, *p;
+    size_t i;
+
+    // Leading -n, -e and -E in any combination, anything else is printed
+    for (i = 1; i < cmd->argc; i++)
+    {
+        arg = cmd->argv[i];
+        if (arg[0] != '-' || arg[1] == '\0' || arg[strspn(arg + 1, "neE") + 1] != '\0')
+            break;
+
+        for (p = arg + 1; *p; p++)
+        {
+            if (*p == 'n')
+                newline = false;
+            else
+                escapes = (*p == 'e');
+        }
+    }
+
+    for (; i < cmd->argc; i++)
+    {
+        if (escapes)
+        {
+            for (p = cmd->argv[i]; *p;)
+            {
+                if (*p != '\\')
+                {
+                    putchar(*p++);
+                    continue;
+                }
+
+                p++;
+                if (!put_escape(&p, true))
+                    goto end; // \c
+            }
+        }
+        else
+        {
+            fputs(cmd->argv[i], stdout);
+        }
+
+        if (i + 1 < cmd->argc)
+            putchar(' ');
+    }
+
+    if (newline)
+        putchar('\n');
+
+end:
+    set_exit(result, 0);
+    return 1;
+}
+
+/*
+ * The format is reused until all arguments are consumed, missing ones count
+ * as empty strings or zero.
+ */
+int util_printf(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    char **args, **end;
+    const char *p;
+    bool stop = false;
+    int status = 0;
+
+    if (cmd->argc < 2)
+    {
+        result->status = -1;
+        result->err_msg = ERR_NO_FORMAT;
+
+        return -1;
+    }
+
+    args = &cmd->argv[2];
+    end = &cmd->argv[cmd->argc];
+
+    do
+    {
+        for (p = cmd->argv[1]; *p && !stop;)
+        {
+            if (*p == '\\')
+            {
+                p++;
+                stop = !put_escape(&p, false);
+            }
+            else if (*p == '%')
+            {
+                p = print_spec(p + 1, &args, end, &stop, &status);
+            }
+            else
+            {
+                putchar(*p++);
+            }
+        }
+    } while (!stop && args < end && args != &cmd->argv[2]);
+
+    set_exit(result, status);
+    return 1;
+}
+
+int util_test(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    test_ctx_t t;
+    bool ret;
+
+    t.argv = &cmd->argv[1];
+    t.argc = cmd->argc - 1;
+    t.pos = 0;
+    t.err = NULL;
+
+    if (strcmp(cmd->argv[0], "[") == 0)
+    {
+        if (t.argc == 0 || strcmp(t.argv[t.argc - 1], "]") != 0)
+        {
+            result->status = -1;
+            result->err_msg = ERR_MISSING_BRACKET;
+            result->exit_status = 2;
+
+            return -1;
+        }
+        t.argc--;
+    }
+
+    ret = (t.argc > 0) ? test_or(&t) : false;
+    if (!t.err && t.pos != t.argc)
+        t.err = ERR_TEST_SYNTAX; // Leftover arguments
+
+    if (t.err)
+    {
+        result->status = -1;
+        result->err_msg = t.err;
+        result->exit_status = 2;
+
+        return -1;
+    }
+
+    set_exit(result, ret ? 0 : 1);
+    return 1;
+}
+
+int util_true(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    set_exit(result, 0);
+    return 1;
+}
+
+int util_false(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    set_exit(result, 1);
+    return 1;
+}
+
+int util_cat(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx)
+{
+    bool reads_stdin = (cmd->argc == 1);
+    int status = 0;
+    int fd;
+    size_t i;
+
+    for (i = 1; i < cmd->argc; i++)
+    {
+        reads_stdin |= strcmp(cmd->argv[i], "-") == 0;
+
+        // Ctrl-C can't stop a builtin, anything that may never end is left to the real cat
+        if (strcmp(cmd->argv[i], "-") != 0 && !cat_ends(cmd->argv[i]))
+            return 0;
+    }
+
+    if (reads_stdin && !cat_ends(NULL))
+        return 0;
+
+    // Anything printed before goes out first
+    fflush(stdout);
+
+    if (cmd->argc == 1 && cat_fd(STDIN_FILENO) < 0)
+    {
+        fprintf(stderr, "cat: %s\n", strerror(errno));
+        status = 1;
+    }
+
+    for (i = 1; i < cmd->argc; i++)
+    {
+        if (strcmp(cmd->argv[i], "-") == 0)
+        {
+            fd = STDIN_FILENO;
+        }
+        else
+        {
+            fd = open(cmd->argv[i], O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                fprintf(stderr, "cat: %s: %s\n", cmd->argv[i], strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+
+        if (cat_fd(fd) < 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", cmd->argv[i], strerror(errno));
+            status = 1;
+        }
+
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+
+    set_exit(result, status);
+    return 1;
+}
+
+// Only regular files are sure to run out, NULL checks stdin
+bool cat_ends(const char *path)
+{
+    struct stat st;
+
+    if (path)
+        return stat(path, &st) < 0 || S_ISREG(st.st_mode); // One that's missing fails right away
+
+    return fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/*
+ * Prints the escape sequence *str points at (past the backslash) and moves
+ * past it. Octal escapes are \0NNN in echo and %b, \NNN in printf formats.
+ * Returns false for \c, which ends all output.
+ */
+bool put_escape(const char **str, bool octal_zero)
+{
+    const char *p = *str;
+    int c, digits;
+
+    switch (*p)
+    {
+    case 'a':
+        c = '\a';
+        break;
+    case 'b':
+        c = '\b';
+        break;
+    case 'e':
+        c = '\033';
+        break;
+    case 'f':
+        c = '\f';
+        break;
+    case 'n':
+        c = '\n';
+        break;
+    case 'r':
+        c = '\r';
+        break;
+    case 't':
+        c = '\t';
+        break;
+    case 'v':
+        c = '\v';
+        break;
+    case '\\':
+        c = '\\';
+        break;
+    case 'c':
+        *str = p + 1;
+        return false;
+    case '\0':
+        putchar('\\');
+        return true;
+    default:
+        if (*p >= '0' && *p <= '7')
+        {
+            if (octal_zero && *p == '0')
+                p++;
+
+            for (c = 0, digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++, p++)
+                c = c * 8 + (*p - '0');
+
+            putchar(c);
+            *str = p;
+            return true;
+        }
+
+        // Unknown escapes are printed as is
+        putchar('\\');
+        c = *p;
+        break;
+    }
+
+    putchar(c);
+    *str = p + 1;
+
+    return true;
+}
+
+// Handles one conversion, fmt points past the '%'. Returns where to continue
+const char *print_spec(const char *fmt, char ***args, char **end, bool *stop, int *status)
+{
+    char spec[32];
+    size_t len = 0;
+    const char *arg;
+    const char *p = fmt;
+
+    spec[len++] = '%';
+
+    // Flags, width and precision are passed on to printf() as they are
+    while (*p && strchr("-+ #0", *p) && len < 8)
+        spec[len++] = *p++;
+    while (*p >= '0' && *p <= '9' && len < 16)
+        spec[len++] = *p++;
+    if (*p == '.')
+    {
+        spec[len++] = *p++;
+        while (*p >= '0' && *p <= '9' && len < 24)
+            spec[len++] = *p++;
+    }
+
+    arg = (*args < end && *p != '%' && *p != '\0') ? *(*args)++ : NULL;
+
+    switch (*p)
+    {
+    case '%':
+        putchar('%');
+        break;
+    case 'd':
+    case 'i':
+        memcpy(spec + len, "lld", 4);
+        printf(spec, arg ? arg_integer(arg, status) : 0LL);
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        memcpy(spec + len, "ll", 2);
+        spec[len + 2] = *p;
+        spec[len + 3] = '\0';
+        printf(spec, arg ? (unsigned long long)arg_integer(arg, status) : 0ULL);
+        break;
+    case 'c':
+        if (arg && *arg)
+            putchar(*arg);
+        break;
+    case 's':
+        spec[len] = 's';
+        spec[len + 1] = '\0';
+        printf(spec, arg ? arg : "");
+        break;
+    case 'b':
+        for (arg = arg ? arg : ""; *arg && !*stop;)
+        {
+            if (*arg != '\\')
+            {
+                putchar(*arg++);
+                continue;
+            }
+
+            arg++;
+            *stop = !put_escape(&arg, true);
+        }
+        break;
+    case '\0':
+        fputs(fmt - 1, stdout); // Lone '%' at the end
+        return p;
+    default:
+        fprintf(stderr, "printf: %%%c: invalid conversion\n", *p);
+        *status = 1;
+        break;
+    }
+
+    return p + 1;
+}
+
+long long arg_integer(const char *arg, int *status)
+{
+    char *endptr;
+    long long val;
+
+    // 'c or "c gives the character code
+    if (arg[0] == '\'' || arg[0] == '"')
+        return (unsigned char)arg[1];
+
+    errno = 0;
+    val = strtoll(arg, &endptr, 0);
+    if (*arg == '\0' || *endptr != '\0' || errno != 0)
+    {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+
+    return val;
+}
+
+// expr: and ('-o' and)*
+bool test_or(test_ctx_t *t)
+{
+    bool ret = test_and(t);
+
+    while (!t->err && t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0)
+    {
+        t->pos++;
+        ret = test_and(t) || ret;
+    }
+
+    return ret;
+}
+
+// and: not ('-a' not)*
+bool test_and(test_ctx_t *t)
+{
+    bool ret = test_not(t);
+
+    while (!t->err && t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0)
+    {
+        t->pos++;
+        ret = test_not(t) && ret;
+    }
+
+    return ret;
+}
+
+// not: '!' not | primary, a lone '!' is just a string
+bool test_not(test_ctx_t *t)
+{
+    if (t->pos + 1 < t->argc && strcmp(t->argv[t->pos], "!") == 0)
+    {
+        t->pos++;
+        return !test_not(t);
+    }
+
+    return test_primary(t);
+}
+
+bool test_primary(test_ctx_t *t)
+{
+    size_t left = t->argc - t->pos;
+    char **argv = &t->argv[t->pos];
+    bool ret;
+
+    if (left == 0)
+    {
+        t->err = ERR_TEST_SYNTAX;
+        return false;
+    }
+
+    // Binary operators win, so "-n = -n" compares two strings
+    if (left >= 3 && is_binary_op(argv[1]))
+    {
+        t->pos += 3;
+        return test_binary(argv[0], argv[1], argv[2], t);
+    }
+
+    if (left >= 2 && strcmp(argv[0], "(") == 0)
+    {
+        t->pos++;
+        ret = test_or(t);
+
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0)
+            t->err = ERR_TEST_SYNTAX;
+        t->pos++;
+
+        return ret;
+    }
+
+    if (left >= 2 && is_unary_op(argv[0]))
+    {
+        t->pos += 2;
+        return test_unary(argv[0], argv[1], t);
+    }
+
+    t->pos++;
+    return argv[0][0] != '\0';
+}
+
+bool test_unary(const char *op, const char *arg, test_ctx_t *t)
+{
+    struct stat st;
+    long long fd;
+
+    switch (op[1])
+    {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 't':
+        fd = test_integer(arg, t);
+        return fd >= 0 && fd <= INT_MAX && isatty(fd);
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    default:
+        break;
+    }
+
+    if (stat(arg, &st) < 0)
+        return false;
+
+    switch (op[1])
+    {
+    case 'e':
+        return true;
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'u':
+        return (st.st_mode & S_ISUID) != 0;
+    case 'g':
+        return (st.st_mode & S_ISGID) != 0;
+    default:
+        return false;
+    }
+}
+
+bool test_binary(const char *lhs, const char *op, const char *rhs, test_ctx_t *t)
+{
+    long long a, b;
+    struct stat sa, sb;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(lhs, rhs) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(lhs, rhs) != 0;
+    if (strcmp(op, "<") == 0)
+        return strcmp(lhs, rhs) < 0;
+    if (strcmp(op, ">") == 0)
+        return strcmp(lhs, rhs) > 0;
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0)
+    {
+        if (stat(lhs, &sa) < 0 || stat(rhs, &sb) < 0)
+            return false;
+
+        if (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec)
+            a = sa.st_mtim.tv_nsec, b = sb.st_mtim.tv_nsec;
+        else
+            a = sa.st_mtim.tv_sec, b = sb.st_mtim.tv_sec;
+
+        return (op[1] == 'n') ? a > b : a < b;
+    }
+    if (strcmp(op, "-ef") == 0)
+    {
+        return stat(lhs, &sa) == 0 && stat(rhs, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+
+    a = test_integer(lhs, t);
+    b = test_integer(rhs, t);
+
+    if (strcmp(op, "-eq") == 0)
+        return a == b;
+    if (strcmp(op, "-ne") == 0)
+        return a != b;
+    if (strcmp(op, "-lt") == 0)
+        return a < b;
+    if (strcmp(op, "-le") == 0)
+        return a <= b;
+    if (strcmp(op, "-gt") == 0)
+        return a > b;
+
+    return a >= b; // -ge
+}
+
+bool is_unary_op(const char *op)
+{
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("nzrwxtLhefdbcpSsug", op[1]);
+}
+
+bool is_binary_op(const char *op)
+{
+    static const char *const ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef",
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        if (strcmp(op, ops[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+long long test_integer(const char *str, test_ctx_t *t)
+{
+    char *endptr;
+    long long val;
+
+    errno = 0;
+    val = strtoll(str, &endptr, 10);
+
+    // Surrounding blanks are fine, anything else is not
+    while (*endptr == ' ' || *endptr == '\t')
+        endptr++;
+    if (*str == '\0' || *endptr != '\0' || errno != 0)
+        t->err = ERR_TEST_INTEGER;
+
+    return val;
+}
+
+int cat_fd(int fd)
+{
+    static char buf[CAT_BUF_LEN];
+    ssize_t nread, nwritten, off;
+
+    for (;;)
+    {
+        nread = read(fd, buf, sizeof(buf));
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nread == 0)
+            return 0;
+
+        for (off = 0; off < nread; off += nwritten)
+        {
+            nwritten = write(STDOUT_FILENO, buf + off, nread - off);
+            if (nwritten < 0)
+            {
+                if (errno == EINTR)
+                {
+                    nwritten = 0;
+                    continue;
+                }
+                return -1;
+            }
+        }
+    }
+}
+
+void set_exit(eval_res_t *result, int status)
+{
+    result->status = 1;
+    result->err_msg = NULL;
+    result->exit_status = status;
+}
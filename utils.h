@@ -0,0 +1,20 @@
+#ifndef UTILS_H
+#define UTILS_H
+
+#include "parser.h"
+#include "eval.h"
+#include "kai.h"
+
+int util_echo(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+int util_printf(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+int util_test(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+int util_true(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+int util_false(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+int util_cat(command_t *cmd, eval_res_t *result, kai_ctx_t *kai_ctx);
+
+#endif
@@ -0,0 +1,237 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include "vars.h"
+
+#define INITIAL_CAPACITY 128
+#define INITIAL_ENVP 64
+
+void vars_init(vars_t *vars)
+{
+    htab_init(&vars->tab, sizeof(var_entry_t), INITIAL_CAPACITY);
+
+    vars->generation = 1;
+    vars->envp = NULL;
+    vars->envp_cap = 0;
+    vars->envp_generation = 0;
+}
+
+void vars_free(vars_t *vars)
+{
+    var_entry_t *entry;
+    size_t iter = 0;
+
+    while ((entry = htab_next(&vars->tab, &iter)))
+        free((char *)entry->key.name);
+
+    htab_free(&vars->tab);
+    free(vars->envp);
+    vars_init(vars);
+}
+
+// Takes over the environment the shell was started with, all exported
+int vars_import(vars_t *vars, char **env)
+{
+    const char *eq;
+    var_entry_t *entry;
+    char *pair;
+
+    for (; *env; env++)
+    {
+        eq = strchr(*env, '=');
+        if (!eq || eq == *env)
+            continue;
+
+        // The first of duplicate names wins, like getenv()
+        if (htab_find(&vars->tab, *env, eq - *env))
+            continue;
+
+        pair = strdup(*env);
+        entry = (pair) ? htab_insert(&vars->tab, pair, eq - *env) : NULL;
+        if (!entry)
+        {
+            free(pair);
+            return -1;
+        }
+
+        entry->exported = true;
+    }
+
+    vars->generation++;
+
+    return 0;
+}
+
+// NULL if the variable isn't set
+const char *vars_get(vars_t *vars, const char *name)
+{
+    return vars_get_len(vars, name, strlen(name));
+}
+
+// Looks up the first len bytes of name, so callers needn't copy it out
+const char *vars_get_len(vars_t *vars, const char *name, size_t len)
+{
+    var_entry_t *entry;
+
+    entry = htab_find(&vars->tab, name, len);
+    if (!entry)
+        return NULL;
+
+    return entry->key.name + entry->key.len + 1;
+}
+
+/*
+ * Exported variables stay exported, a variable is only made one when
+ * export is set.
+ */
+int vars_set(vars_t *vars, const char *name, const char *value, bool export)
+{
+    size_t len = strlen(name);
+    size_t vlen = strlen(value);
+    var_entry_t *entry;
+    char *pair;
+
+    if (!vars_valid_name(name, len))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pair = malloc(len + vlen + 2);
+    if (!pair)
+        return -1;
+
+    memcpy(pair, name, len);
+    pair[len] = '=';
+    memcpy(pair + len + 1, value, vlen + 1);
+
+    // The key points into the pair, so the new pair takes the old one's place
+    entry = htab_find(&vars->tab, name, len);
+    if (entry)
+    {
+        free((char *)entry->key.name);
+        entry->key.name = pair;
+        export |= entry->exported;
+    }
+    else
+    {
+        entry = htab_insert(&vars->tab, pair, len);
+        if (!entry)
+        {
+            free(pair);
+            return -1;
+        }
+    }
+
+    entry->exported = export;
+
+    // The old pair may still be in envp
+    if (export)
+        vars->generation++;
+
+    return 0;
+}
+
+int vars_export(vars_t *vars, const char *name)
+{
+    var_entry_t *entry;
+
+    entry = htab_find(&vars->tab, name, strlen(name));
+    if (!entry)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!entry->exported)
+    {
+        entry->exported = true;
+        vars->generation++;
+    }
+
+    return 0;
+}
+
+void vars_unset(vars_t *vars, const char *name)
+{
+    var_entry_t *entry;
+
+    entry = htab_find(&vars->tab, name, strlen(name));
+    if (!entry)
+        return;
+
+    if (entry->exported)
+        vars->generation++;
+
+    free((char *)entry->key.name);
+    htab_remove(&vars->tab, entry);
+}
+
+var_entry_t *vars_next(vars_t *vars, size_t *iter)
+{
+    return htab_next(&vars->tab, iter);
+}
+
+/*
+ * The environment for exec, NULL terminated. It points at the pairs of the
+ * table, so it is only rebuilt when an exported variable changed since the
+ * last call, and stays valid until the next change. Returns NULL without
+ * memory.
+ */
+char **vars_envp(vars_t *vars)
+{
+    var_entry_t *entry;
+    char **new_envp;
+    size_t new_cap;
+    size_t iter = 0, n = 0;
+
+    if (vars->envp && vars->envp_generation == vars->generation)
+        return vars->envp;
+
+    if (vars->envp_cap < vars->tab.count + 1)
+    {
+        new_cap = (vars->envp_cap) ? vars->envp_cap : INITIAL_ENVP;
+        while (new_cap < vars->tab.count + 1)
+            new_cap *= 2;
+
+        new_envp = realloc(vars->envp, new_cap * sizeof(char *));
+        if (!new_envp)
+            return NULL;
+
+        vars->envp = new_envp;
+        vars->envp_cap = new_cap;
+    }
+
+    while ((entry = vars_next(vars, &iter)))
+    {
+        if (entry->exported)
+            vars->envp[n++] = (char *)entry->key.name;
+    }
+    vars->envp[n] = NULL;
+
+    vars->envp_generation = vars->generation;
+
+    return vars->envp;
+}
+
+// Letters, digits and underscores, not starting with a digit
+bool vars_valid_name(const char *name, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9'))
+        return false;
+
+    for (i = 0; i < len; i++)
+    {
+        if (!(name[i] == '_' || (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+              (name[i] >= '0' && name[i] <= '9')))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef VARS_H
+#define VARS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "htab.h"
+
+typedef struct var_entry
+{
+    htab_key_t key; // name is the whole "NAME=value" pair, len covers NAME
+    bool exported;
+} var_entry_t;
+
+typedef struct vars
+{
+    htab_t tab;
+
+    // Bumped whenever the environment programs get changes
+    unsigned long generation;
+
+    // Built from the exported entries on demand, see vars_envp()
+    char **envp;
+    size_t envp_cap;
+    unsigned long envp_generation;
+} vars_t;
+
+void vars_init(vars_t *vars);
+
+void vars_free(vars_t *vars);
+
+int vars_import(vars_t *vars, char **env);
+
+const char *vars_get(vars_t *vars, const char *name);
+
+const char *vars_get_len(vars_t *vars, const char *name, size_t len);
+
+int vars_set(vars_t *vars, const char *name, const char *value, bool export);
+
+int vars_export(vars_t *vars, const char *name);
+
+void vars_unset(vars_t *vars, const char *name);
+
+var_entry_t *vars_next(vars_t *vars, size_t *iter);
+
+char **vars_envp(vars_t *vars);
+
+bool vars_valid_name(const char *name, size_t len);
+
+#endif